@@ -0,0 +1,413 @@
+#include "bench.h"
+
+#include <falloc.h>
+
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STATUS_LINE_SIZE 256
+#define MS_PER_SEC       1000
+#define NS_PER_MS        1000000
+#define NS_PER_SEC       1000000000
+
+const struct BenchAllocator BENCH_ALLOCATORS[] = {
+    {
+        .name = "falloc",
+        .alloc = &falloc,
+        .free = &ffree,
+        .realloc = &frealloc,
+    },
+    {
+        .name = "glibc",
+        .alloc = &malloc,
+        .free = &free,
+        .realloc = &realloc,
+    },
+};
+
+const size_t BENCH_ALLOCATOR_COUNT =
+    sizeof(BENCH_ALLOCATORS) / sizeof(BENCH_ALLOCATORS[0]);
+
+struct ThreadArgs {
+    struct BenchThread thread;
+    BenchThreadFunc func;
+    pthread_barrier_t *start_barrier;
+};
+
+struct Sample {
+    uint64_t ms;
+    int64_t live_bytes;
+    size_t rss_kb;
+    size_t mapped_kb;
+};
+
+// Only ever used in the forked process of a single run.
+static struct ThreadArgs thread_args[BENCH_MAX_THREADS];
+static pthread_t threads[BENCH_MAX_THREADS];
+
+static int64_t live_bytes[BENCH_MAX_THREADS];
+static struct Sample samples[BENCH_MAX_SAMPLES];
+static size_t sample_count = 0;
+static uint64_t sample_interval_ms = BENCH_SAMPLE_INTERVAL_MS;
+static size_t baseline_rss_kb = 0;
+static struct timespec sampling_start;
+static bool sampling = false;
+static pthread_t sampler;
+
+static double now_in_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double)now.tv_sec + ((double)now.tv_nsec / 1e9);
+}
+
+// VmHWM from /proc/self/status, 0 if it can't be read.
+static size_t peak_rss_kb(void) {
+    FILE *status = fopen("/proc/self/status", "r");
+
+    if (!status) {
+        return 0;
+    }
+
+    char line[STATUS_LINE_SIZE];
+    size_t peak = 0;
+
+    while (fgets(line, sizeof(line), status)) {
+        if (sscanf(line, "VmHWM: %zu kB", &peak) == 1) {
+            break;
+        }
+    }
+
+    (void)fclose(status);
+
+    return peak;
+}
+
+static void *thread_main(void *arg) {
+    struct ThreadArgs *args = arg;
+
+    (void)pthread_barrier_wait(args->start_barrier);
+
+    double start = now_in_seconds();
+    args->func(&args->thread);
+    args->thread.seconds = now_in_seconds() - start;
+
+    return NULL;
+}
+
+static void report(const struct BenchRun *run,
+                   const struct BenchAllocator *allocator, double seconds) {
+    uint64_t ops = 0;
+
+    for (size_t i = 0; i < run->thread_count; ++i) {
+        ops += thread_args[i].thread.ops;
+    }
+
+    printf("{\"benchmark\": \"%s\", \"params\": \"%s\", \"allocator\": \"%s\", "
+           "\"threads\": %zu, \"ops\": %llu, \"seconds\": %.6f, "
+           "\"ops_per_sec\": %.0f, \"peak_rss_kb\": %zu, "
+           "\"thread_ops_per_sec\": [",
+           run->benchmark, run->params, allocator->name, run->thread_count,
+           (unsigned long long)ops, seconds, (double)ops / seconds,
+           peak_rss_kb());
+
+    for (size_t i = 0; i < run->thread_count; ++i) {
+        const struct BenchThread *thread = &thread_args[i].thread;
+
+        printf("%s%.0f", i == 0 ? "" : ", ",
+               (double)thread->ops / thread->seconds);
+    }
+
+    printf("]");
+
+    if (run->report) {
+        run->report(run, stdout);
+    }
+
+    puts("}");
+}
+
+// Runs in the forked process.
+static bool run_once(struct BenchRun *run,
+                     const struct BenchAllocator *allocator) {
+    if (run->setup) {
+        run->setup(run, allocator);
+    }
+
+    pthread_barrier_t start_barrier;
+    pthread_barrier_init(&start_barrier, NULL, (unsigned)run->thread_count + 1);
+
+    for (size_t i = 0; i < run->thread_count; ++i) {
+        thread_args[i] = (struct ThreadArgs){
+            .thread =
+                {
+                    .allocator = allocator,
+                    .shared = run->shared,
+                    .index = i,
+                    .count = run->thread_count,
+                    // NOLINTNEXTLINE(readability-magic-numbers)
+                    .seed = (0x9E3779B97F4A7C15ULL * (i + 1)) | 1,
+                    .ops = 0,
+                    .seconds = 0,
+                },
+            .func = run->thread_func,
+            .start_barrier = &start_barrier,
+        };
+
+        if (pthread_create(&threads[i], NULL, &thread_main, &thread_args[i]) !=
+            0) {
+            perror("pthread_create() failed in run_once()");
+            return false;
+        }
+    }
+
+    (void)pthread_barrier_wait(&start_barrier);
+    double start = now_in_seconds();
+
+    for (size_t i = 0; i < run->thread_count; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    double seconds = now_in_seconds() - start;
+
+    pthread_barrier_destroy(&start_barrier);
+
+    if (run->teardown) {
+        run->teardown(run);
+    }
+
+    report(run, allocator, seconds);
+
+    return true;
+}
+
+size_t bench_max_threads(int argc, char **argv) {
+    long max_threads = 0;
+
+    if (argc > 1) {
+        max_threads = strtol(argv[1], NULL, 10);
+    } else {
+        max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if (max_threads < 1) {
+        return 1;
+    }
+
+    if (max_threads > BENCH_MAX_THREADS) {
+        return BENCH_MAX_THREADS;
+    }
+
+    return (size_t)max_threads;
+}
+
+size_t bench_thread_counts(size_t max_threads, size_t *out_counts) {
+    size_t count = 0;
+
+    for (size_t threads = 1; threads < max_threads; threads *= 2) {
+        out_counts[count] = threads;
+        ++count;
+    }
+
+    out_counts[count] = max_threads;
+
+    return count + 1;
+}
+
+bool bench_run(struct BenchRun *run) {
+    if (run->thread_count == 0 || run->thread_count > BENCH_MAX_THREADS) {
+        (void)fprintf(stderr, "%s: can't run with %zu threads\n",
+                      run->benchmark, run->thread_count);
+        return false;
+    }
+
+    bool succeeded = true;
+
+    for (size_t i = 0; i < BENCH_ALLOCATOR_COUNT; ++i) {
+        // Anything still buffered would be printed by both processes.
+        (void)fflush(stdout);
+
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            perror("fork() failed in bench_run()");
+            return false;
+        }
+
+        if (pid == 0) {
+            bool ran = run_once(run, &BENCH_ALLOCATORS[i]);
+            (void)fflush(stdout);
+            _exit(ran ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+
+        int status = 0;
+
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != EXIT_SUCCESS) {
+            (void)fprintf(stderr, "%s (%s) with %s failed\n", run->benchmark,
+                          run->params, BENCH_ALLOCATORS[i].name);
+            succeeded = false;
+        }
+    }
+
+    return succeeded;
+}
+
+// The first two fields of /proc/self/statm, in kB. Both are 0 if it can't be
+// read.
+static void read_statm(size_t *out_mapped_kb, size_t *out_rss_kb) {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    size_t mapped = 0;
+    size_t resident = 0;
+
+    if (statm) {
+        if (fscanf(statm, "%zu %zu", &mapped, &resident) != 2) {
+            mapped = 0;
+            resident = 0;
+        }
+
+        (void)fclose(statm);
+    }
+
+    size_t page_kb = (size_t)sysconf(_SC_PAGESIZE) / 1024;
+    *out_mapped_kb = mapped * page_kb;
+    *out_rss_kb = resident * page_kb;
+}
+
+static uint64_t ms_since_sampling_start(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int64_t ns =
+        ((int64_t)(now.tv_sec - sampling_start.tv_sec) * NS_PER_SEC) +
+        (now.tv_nsec - sampling_start.tv_nsec);
+
+    return (uint64_t)(ns / NS_PER_MS);
+}
+
+static void take_sample(void) {
+    int64_t live = 0;
+
+    for (size_t i = 0; i < BENCH_MAX_THREADS; ++i) {
+        live += __atomic_load_n(&live_bytes[i], __ATOMIC_RELAXED);
+    }
+
+    if (sample_count == BENCH_MAX_SAMPLES) {
+        for (size_t i = 0; i < BENCH_MAX_SAMPLES / 2; ++i) {
+            samples[i] = samples[i * 2];
+        }
+
+        sample_count = BENCH_MAX_SAMPLES / 2;
+        sample_interval_ms *= 2;
+    }
+
+    struct Sample *sample = &samples[sample_count];
+    sample->ms = ms_since_sampling_start();
+    sample->live_bytes = live;
+    read_statm(&sample->mapped_kb, &sample->rss_kb);
+
+    ++sample_count;
+}
+
+static void *sample_until_stopped(void *arg) {
+    (void)arg;
+
+    while (__atomic_load_n(&sampling, __ATOMIC_ACQUIRE)) {
+        struct timespec interval = {
+            .tv_sec = (time_t)(sample_interval_ms / MS_PER_SEC),
+            .tv_nsec = (long)(sample_interval_ms % MS_PER_SEC) * NS_PER_MS,
+        };
+        (void)nanosleep(&interval, NULL);
+
+        take_sample();
+    }
+
+    return NULL;
+}
+
+void bench_sampling_start(struct BenchRun *run,
+                          const struct BenchAllocator *allocator) {
+    (void)run;
+    (void)allocator;
+
+    size_t mapped_kb = 0;
+    read_statm(&mapped_kb, &baseline_rss_kb);
+    clock_gettime(CLOCK_MONOTONIC, &sampling_start);
+    take_sample();
+
+    __atomic_store_n(&sampling, true, __ATOMIC_RELEASE);
+
+    if (pthread_create(&sampler, NULL, &sample_until_stopped, NULL) != 0) {
+        perror("pthread_create() failed in bench_sampling_start()");
+        _exit(EXIT_FAILURE);
+    }
+}
+
+void bench_sampling_stop(struct BenchRun *run) {
+    (void)run;
+
+    __atomic_store_n(&sampling, false, __ATOMIC_RELEASE);
+    pthread_join(sampler, NULL);
+
+    take_sample();
+}
+
+static void print_fragmentation(const struct Sample *sample, FILE *out) {
+    if (sample->live_bytes <= 0) {
+        (void)fputs("null", out);
+        return;
+    }
+
+    size_t allocator_rss_kb = sample->rss_kb > baseline_rss_kb
+                                  ? sample->rss_kb - baseline_rss_kb
+                                  : 0;
+
+    (void)fprintf(out, "%.3f",
+                  (double)allocator_rss_kb * 1024 / (double)sample->live_bytes);
+}
+
+static size_t live_kb(const struct Sample *sample) {
+    return sample->live_bytes <= 0 ? 0 : (size_t)sample->live_bytes / 1024;
+}
+
+void bench_sampling_report(const struct BenchRun *run, FILE *out) {
+    (void)run;
+
+    const struct Sample *peak = &samples[0];
+
+    for (size_t i = 1; i < sample_count; ++i) {
+        if (samples[i].live_bytes > peak->live_bytes) {
+            peak = &samples[i];
+        }
+    }
+
+    (void)fprintf(out,
+                  ", \"baseline_rss_kb\": %zu, \"peak_live_kb\": %zu, "
+                  "\"fragmentation\": ",
+                  baseline_rss_kb, live_kb(peak));
+    print_fragmentation(peak, out);
+    (void)fputs(", \"samples\": [", out);
+
+    for (size_t i = 0; i < sample_count; ++i) {
+        (void)fprintf(out, "%s[%llu, %zu, %zu, %zu, ", i == 0 ? "" : ", ",
+                      (unsigned long long)samples[i].ms, live_kb(&samples[i]),
+                      samples[i].rss_kb, samples[i].mapped_kb);
+        print_fragmentation(&samples[i], out);
+        (void)fputs("]", out);
+    }
+
+    (void)fputs("]", out);
+}
+
+void bench_set_live_bytes(size_t thread_index, int64_t bytes) {
+    __atomic_store_n(&live_bytes[thread_index], bytes, __ATOMIC_RELAXED);
+}
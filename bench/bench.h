@@ -0,0 +1,122 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Every run of a benchmark is repeated for each allocator in BENCH_ALLOCATORS,
+// each time in a freshly forked process, so heaps and peak RSS never carry
+// over from one run to the next. Every run prints one JSON object per line on
+// stdout:
+//
+// {"benchmark": ..., "params": ..., "allocator": ..., "threads": ...,
+//  "ops": ..., "seconds": ..., "ops_per_sec": ..., "peak_rss_kb": ...,
+//  "thread_ops_per_sec": [...]}
+//
+// seconds is the wall time from the moment all threads are released until the
+// last one is joined, and peak_rss_kb is the process' VmHWM once they are. A
+// run can add fields of its own after thread_ops_per_sec.
+#define BENCH_MAX_THREADS 256
+
+struct BenchAllocator {
+    const char *name;
+    void *(*alloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+};
+
+extern const struct BenchAllocator BENCH_ALLOCATORS[];
+extern const size_t BENCH_ALLOCATOR_COUNT;
+
+struct BenchThread {
+    const struct BenchAllocator *allocator;
+    void *shared;
+    size_t index;
+    size_t count;
+    uint64_t seed;
+    // Set by the thread function, whatever one operation means for the
+    // benchmark.
+    uint64_t ops;
+    // Set by the harness, from when the thread is released until its function
+    // returns.
+    double seconds;
+};
+
+typedef void (*BenchThreadFunc)(struct BenchThread *thread);
+
+struct BenchRun {
+    const char *benchmark;
+    // Anything but the thread count the run depends on, such as a size range.
+    const char *params;
+    size_t thread_count;
+    BenchThreadFunc thread_func;
+    // Handed to every thread as is.
+    void *shared;
+    // Runs in the forked process before any thread starts. Can be null.
+    void (*setup)(struct BenchRun *run, const struct BenchAllocator *allocator);
+    // Runs in the forked process once every thread is joined, before the run
+    // is reported. Can be null.
+    void (*teardown)(struct BenchRun *run);
+    // Prints the run's own fields, each starting with ", ". Can be null.
+    void (*report)(const struct BenchRun *run, FILE *out);
+};
+
+// The largest thread count to scale up to, from the first command line
+// argument, or the number of online CPUs when there is none.
+size_t bench_max_threads(int argc, char **argv);
+
+// Fills out_counts with 1, 2, 4, ... up to max_threads, which is always the
+// last one, and returns how many there are. out_counts needs room for
+// BENCH_MAX_THREADS counts.
+size_t bench_thread_counts(size_t max_threads, size_t *out_counts);
+
+// Runs and reports the run once for every allocator. Returns false if any of
+// the runs failed.
+bool bench_run(struct BenchRun *run);
+
+// Memory over time. bench_sampling_start() starts a thread that samples the
+// process' RSS and mapped size, next to the live bytes the threads report
+// through bench_set_live_bytes(), every BENCH_SAMPLE_INTERVAL_MS. When the
+// samples run out, every other one is dropped and the interval doubles, so
+// runs of any length fit. The three functions fit the setup, teardown and
+// report of a run, which adds:
+//
+// "baseline_rss_kb": ..., "peak_live_kb": ..., "fragmentation": ...,
+// "samples": [[ms, live_kb, rss_kb, mapped_kb, fragmentation], ...]
+//
+// The baseline is the RSS when sampling starts. fragmentation is the RSS
+// above the baseline per live byte, null while nothing is live, and the
+// scalar one is taken at the sample with the most live bytes. mapped_kb
+// counts every mapping of the process, reservations included.
+#define BENCH_SAMPLE_INTERVAL_MS 10
+#define BENCH_MAX_SAMPLES        4096
+
+void bench_sampling_start(struct BenchRun *run,
+                          const struct BenchAllocator *allocator);
+void bench_sampling_stop(struct BenchRun *run);
+void bench_sampling_report(const struct BenchRun *run, FILE *out);
+
+// What the thread with thread_index currently has live. Negative when it
+// freed more of other threads' objects than it holds itself.
+void bench_set_live_bytes(size_t thread_index, int64_t bytes);
+
+// xorshift64*, cheap enough to call in the timed loops. The state can't be 0.
+static inline uint64_t bench_next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+
+    // NOLINTNEXTLINE(readability-magic-numbers)
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// A size in [min_size, max_size].
+static inline size_t bench_random_size(uint64_t *state, size_t min_size,
+                                       size_t max_size) {
+    return min_size + (size_t)(bench_next_random(state) %
+                               (uint64_t)(max_size - min_size + 1));
+}
+
+#endif // BENCH_H
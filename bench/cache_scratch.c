@@ -0,0 +1,68 @@
+#include "bench.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Cache-scratch after the Hoard benchmarks: the main thread allocates one small
+// object for every thread, so they likely share cache lines, and every thread
+// frees its object first. An allocator that hands the freed memory back out to
+// the thread that freed it makes the threads write to the same cache lines
+// from then on.
+#define ITERATIONS        100000
+#define WRITES_PER_OBJECT 100
+#define OBJECT_SIZE       8
+
+static void *first_objects[BENCH_MAX_THREADS];
+
+static void allocate_first_objects(struct BenchRun *run,
+                                   const struct BenchAllocator *allocator) {
+    for (size_t i = 0; i < run->thread_count; ++i) {
+        first_objects[i] = allocator->alloc(OBJECT_SIZE);
+    }
+}
+
+static void scratch(struct BenchThread *thread) {
+    const struct BenchAllocator *allocator = thread->allocator;
+
+    allocator->free(first_objects[thread->index]);
+
+    for (uint64_t i = 0; i < ITERATIONS; ++i) {
+        volatile uint8_t *object = allocator->alloc(OBJECT_SIZE);
+
+        for (size_t j = 0; j < WRITES_PER_OBJECT; ++j) {
+            object[j % OBJECT_SIZE] = (uint8_t)(object[j % OBJECT_SIZE] + 1);
+        }
+
+        allocator->free((void *)object);
+    }
+
+    thread->ops = ITERATIONS;
+}
+
+int main(int argc, char **argv) {
+    size_t thread_counts[BENCH_MAX_THREADS];
+    size_t run_count =
+        bench_thread_counts(bench_max_threads(argc, argv), thread_counts);
+
+    bool succeeded = true;
+
+    for (size_t i = 0; i < run_count; ++i) {
+        struct BenchRun run = {
+            .benchmark = "cache_scratch",
+            .params = "size=8,writes=100",
+            .thread_count = thread_counts[i],
+            .thread_func = &scratch,
+            .shared = NULL,
+            .setup = &allocate_first_objects,
+            .teardown = NULL,
+            .report = NULL,
+        };
+
+        if (!bench_run(&run)) {
+            succeeded = false;
+        }
+    }
+
+    return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,180 @@
+extern "C" {
+#include "bench.h"
+}
+
+#include "falloc.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+// Standard containers on falloc::allocator against std::allocator, and on
+// falloc::memory_resource against std::pmr::new_delete_resource(), each on one
+// thread and on all of them. The glibc runs go through operator new, which is
+// malloc underneath. One op is one element inserted or erased, or pushed back
+// for the vectors.
+namespace {
+
+constexpr int ROUNDS = 50;
+constexpr std::size_t ELEMENT_COUNT = 10000;
+// Keys spread over this many values, so some inserts find theirs taken.
+constexpr std::uint64_t KEY_RANGE = 4 * ELEMENT_COUNT;
+constexpr std::size_t VECTOR_COUNT = 1000;
+constexpr std::size_t MAX_VECTOR_LENGTH = 1000;
+
+enum class Container { map, vector, unordered_map };
+
+struct Workload {
+    const char *params;
+    Container container;
+    bool pmr;
+};
+
+const Workload WORKLOADS[] = {
+    {"container=map,interface=allocator", Container::map, false},
+    {"container=vector,interface=allocator", Container::vector, false},
+    {"container=unordered_map,interface=allocator", Container::unordered_map,
+     false},
+    {"container=map,interface=pmr", Container::map, true},
+    {"container=vector,interface=pmr", Container::vector, true},
+    {"container=unordered_map,interface=pmr", Container::unordered_map, true},
+};
+
+template <typename T, typename ByteAllocator>
+using Rebind =
+    typename std::allocator_traits<ByteAllocator>::template rebind_alloc<T>;
+
+using Entry = std::pair<const std::uint64_t, std::uint64_t>;
+
+// Fills the map with random keys and erases them again in the same order.
+template <typename Map>
+std::uint64_t churn_map(Map &map, std::uint64_t *state) {
+    std::vector<std::uint64_t> keys(ELEMENT_COUNT);
+    std::uint64_t ops = 0;
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (std::uint64_t &key : keys) {
+            key = bench_next_random(state) % KEY_RANGE;
+            ops += map.emplace(key, key).second ? 1 : 0;
+        }
+
+        for (std::uint64_t key : keys) {
+            ops += map.erase(key);
+        }
+    }
+
+    return ops;
+}
+
+// Grows vectors of random lengths one element at a time, all of them live
+// until the round ends.
+template <typename ByteAllocator>
+std::uint64_t churn_vectors(const ByteAllocator &allocator,
+                            std::uint64_t *state) {
+    using Vector =
+        std::vector<std::uint64_t, Rebind<std::uint64_t, ByteAllocator>>;
+    std::vector<Vector, Rebind<Vector, ByteAllocator>> vectors(allocator);
+    std::uint64_t ops = 0;
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        vectors.reserve(VECTOR_COUNT);
+
+        for (std::size_t i = 0; i < VECTOR_COUNT; ++i) {
+            // Takes the outer vector's allocator along with pmr.
+            Vector &vector = vectors.emplace_back();
+            std::size_t length =
+                bench_random_size(state, 1, MAX_VECTOR_LENGTH);
+
+            for (std::size_t j = 0; j < length; ++j) {
+                vector.push_back(j);
+            }
+
+            ops += length;
+        }
+
+        vectors.clear();
+        vectors.shrink_to_fit();
+    }
+
+    return ops;
+}
+
+template <typename ByteAllocator>
+std::uint64_t churn(Container container, const ByteAllocator &allocator,
+                    std::uint64_t *state) {
+    switch (container) {
+    case Container::map: {
+        std::map<std::uint64_t, std::uint64_t, std::less<>,
+                 Rebind<Entry, ByteAllocator>>
+            map(allocator);
+        return churn_map(map, state);
+    }
+    case Container::vector:
+        return churn_vectors(allocator, state);
+    case Container::unordered_map: {
+        std::unordered_map<std::uint64_t, std::uint64_t,
+                           std::hash<std::uint64_t>,
+                           std::equal_to<std::uint64_t>,
+                           Rebind<Entry, ByteAllocator>>
+            map(allocator);
+        return churn_map(map, state);
+    }
+    }
+
+    return 0;
+}
+
+void run_workload(BenchThread *thread) {
+    const auto *workload = static_cast<const Workload *>(thread->shared);
+    bool is_falloc = std::strcmp(thread->allocator->name, "falloc") == 0;
+    std::uint64_t state = thread->seed;
+
+    if (workload->pmr) {
+        std::pmr::memory_resource *resource =
+            is_falloc ? falloc::get_memory_resource()
+                      : std::pmr::new_delete_resource();
+        thread->ops =
+            churn(workload->container,
+                  std::pmr::polymorphic_allocator<std::byte>(resource), &state);
+    } else if (is_falloc) {
+        thread->ops = churn(workload->container,
+                            falloc::allocator<std::byte>(), &state);
+    } else {
+        thread->ops =
+            churn(workload->container, std::allocator<std::byte>(), &state);
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    std::size_t max_threads = bench_max_threads(argc, argv);
+    std::size_t thread_counts[] = {1, max_threads};
+    std::size_t run_count = max_threads == 1 ? 1 : 2;
+
+    bool succeeded = true;
+
+    for (const Workload &workload : WORKLOADS) {
+        for (std::size_t i = 0; i < run_count; ++i) {
+            BenchRun run{};
+            run.benchmark = "containers";
+            run.params = workload.params;
+            run.thread_count = thread_counts[i];
+            run.thread_func = &run_workload;
+            run.shared = const_cast<Workload *>(&workload);
+
+            if (!bench_run(&run)) {
+                succeeded = false;
+            }
+        }
+    }
+
+    return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,460 @@
+#include "bench.h"
+
+#include <falloc.h>
+#include <slab_alloc.h>
+
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Hardware counters per operation on each of falloc's paths. Every path is
+// measured in a freshly forked process and printed as one JSON object per
+// line:
+//
+// {"benchmark": "counters", "path": ..., "op": ..., "ops": ...,
+//  "ns_per_op": ..., "instructions_per_op": ..., "cycles_per_op": ...,
+//  "branch_misses_per_op": ..., "l1d_misses_per_op": ...,
+//  "llc_misses_per_op": ..., "dtlb_misses_per_op": ...}
+//
+// Counters only count user space. One the kernel doesn't give us, for lack of
+// a PMU or of permission (see /proc/sys/kernel/perf_event_paranoid), is null,
+// ns_per_op is always there. Instructions per op barely move from run to run,
+// which makes them the number to track across changes.
+#define LOOP_OPS             1000000
+#define SLAB_FILL_ROUNDS     64
+#define CROSS_THREAD_OBJECTS 100000
+#define SMALL_SIZE           64
+#define BIG_SIZE             4096
+#define NS_PER_SEC           1000000000ULL
+
+enum Counter {
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CYCLES,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_L1D_MISSES,
+    COUNTER_LLC_MISSES,
+    COUNTER_DTLB_MISSES,
+    COUNTER_COUNT,
+};
+
+// The counters are split into two groups, so each fits on the PMU at once
+// next to the other: the fixed counters with one programmable one, and three
+// programmable ones. When they don't, the kernel takes turns and the counts
+// are scaled up by the time each group actually ran.
+#define GROUP_COUNT 2
+
+#define HW_CACHE_READ_MISSES(cache)                                            \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) |                            \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+struct CounterSpec {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    size_t group;
+};
+
+static const struct CounterSpec COUNTERS[COUNTER_COUNT] = {
+    [COUNTER_INSTRUCTIONS] = {.name = "instructions",
+                              .type = PERF_TYPE_HARDWARE,
+                              .config = PERF_COUNT_HW_INSTRUCTIONS,
+                              .group = 0},
+    [COUNTER_CYCLES] = {.name = "cycles",
+                        .type = PERF_TYPE_HARDWARE,
+                        .config = PERF_COUNT_HW_CPU_CYCLES,
+                        .group = 0},
+    [COUNTER_BRANCH_MISSES] = {.name = "branch_misses",
+                               .type = PERF_TYPE_HARDWARE,
+                               .config = PERF_COUNT_HW_BRANCH_MISSES,
+                               .group = 0},
+    [COUNTER_L1D_MISSES] = {.name = "l1d_misses",
+                            .type = PERF_TYPE_HW_CACHE,
+                            .config = HW_CACHE_READ_MISSES(
+                                PERF_COUNT_HW_CACHE_L1D),
+                            .group = 1},
+    [COUNTER_LLC_MISSES] = {.name = "llc_misses",
+                            .type = PERF_TYPE_HW_CACHE,
+                            .config =
+                                HW_CACHE_READ_MISSES(PERF_COUNT_HW_CACHE_LL),
+                            .group = 1},
+    [COUNTER_DTLB_MISSES] = {.name = "dtlb_misses",
+                             .type = PERF_TYPE_HW_CACHE,
+                             .config = HW_CACHE_READ_MISSES(
+                                 PERF_COUNT_HW_CACHE_DTLB),
+                             .group = 1},
+};
+
+struct CounterGroup {
+    // -1 when none of the group's counters could be opened.
+    int leader;
+    // The group's counters in the order the kernel reports them.
+    enum Counter members[COUNTER_COUNT];
+    size_t member_count;
+};
+
+// Counters only run between counters_start() and counters_stop(), and keep
+// adding up until they are read at the end.
+struct Counters {
+    struct CounterGroup groups[GROUP_COUNT];
+    int fds[COUNTER_COUNT];
+    uint64_t ops;
+    uint64_t ns;
+    struct timespec start;
+};
+
+// What the kernel returns for PERF_FORMAT_GROUP with both times.
+struct GroupReading {
+    uint64_t count;
+    uint64_t time_enabled;
+    uint64_t time_running;
+    uint64_t values[COUNTER_COUNT];
+};
+
+struct Path {
+    const char *name;
+    // What one op is.
+    const char *op;
+    void (*measure)(struct Counters *counters);
+};
+
+static int open_counter(const struct CounterSpec *spec, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+
+    attr.type = spec->type;
+    attr.size = sizeof(attr);
+    attr.config = spec->config;
+    attr.disabled = group_fd == -1 ? 1 : 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd,
+                        PERF_FLAG_FD_CLOEXEC);
+}
+
+// Counters that can't be opened are left out, the first one of a group that
+// can becomes its leader.
+static void counters_open(struct Counters *counters) {
+    memset(counters, 0, sizeof(*counters));
+
+    for (size_t i = 0; i < GROUP_COUNT; ++i) {
+        counters->groups[i].leader = -1;
+    }
+
+    for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+        struct CounterGroup *group = &counters->groups[COUNTERS[i].group];
+        int fd = open_counter(&COUNTERS[i], group->leader);
+        counters->fds[i] = fd;
+
+        if (fd < 0) {
+            continue;
+        }
+
+        if (group->leader == -1) {
+            group->leader = fd;
+        }
+
+        group->members[group->member_count] = (enum Counter)i;
+        ++group->member_count;
+    }
+}
+
+static void counters_close(struct Counters *counters) {
+    for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+        if (counters->fds[i] >= 0) {
+            (void)close(counters->fds[i]);
+        }
+    }
+}
+
+static void groups_ioctl(struct Counters *counters, unsigned long request) {
+    for (size_t i = 0; i < GROUP_COUNT; ++i) {
+        if (counters->groups[i].leader >= 0) {
+            (void)ioctl(counters->groups[i].leader, request,
+                        PERF_IOC_FLAG_GROUP);
+        }
+    }
+}
+
+static inline void counters_start(struct Counters *counters) {
+    groups_ioctl(counters, PERF_EVENT_IOC_ENABLE);
+    clock_gettime(CLOCK_MONOTONIC, &counters->start);
+}
+
+static inline void counters_stop(struct Counters *counters, uint64_t ops) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    groups_ioctl(counters, PERF_EVENT_IOC_DISABLE);
+
+    counters->ns += ((uint64_t)(end.tv_sec - counters->start.tv_sec) *
+                     NS_PER_SEC) +
+                    (uint64_t)end.tv_nsec - (uint64_t)counters->start.tv_nsec;
+    counters->ops += ops;
+}
+
+// Writes the totals into out, scaled by how long each group ran, and marks
+// the counters that did in out_valid.
+static void counters_read(const struct Counters *counters,
+                          double out[COUNTER_COUNT],
+                          bool out_valid[COUNTER_COUNT]) {
+    memset(out_valid, 0, COUNTER_COUNT * sizeof(*out_valid));
+
+    for (size_t i = 0; i < GROUP_COUNT; ++i) {
+        const struct CounterGroup *group = &counters->groups[i];
+        struct GroupReading reading;
+
+        if (group->leader < 0 ||
+            read(group->leader, &reading, sizeof(reading)) <
+                (ssize_t)(sizeof(uint64_t) * (3 + group->member_count)) ||
+            reading.time_running == 0) {
+            continue;
+        }
+
+        double scale =
+            (double)reading.time_enabled / (double)reading.time_running;
+
+        for (size_t j = 0; j < group->member_count; ++j) {
+            out[group->members[j]] = (double)reading.values[j] * scale;
+            out_valid[group->members[j]] = true;
+        }
+    }
+}
+
+static void report(const struct Path *path, const struct Counters *counters) {
+    double totals[COUNTER_COUNT];
+    bool valid[COUNTER_COUNT];
+    counters_read(counters, totals, valid);
+
+    double ops = (double)counters->ops;
+
+    printf("{\"benchmark\": \"counters\", \"path\": \"%s\", \"op\": \"%s\", "
+           "\"ops\": %llu, \"ns_per_op\": %.2f",
+           path->name, path->op, (unsigned long long)counters->ops,
+           (double)counters->ns / ops);
+
+    for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+        if (valid[i]) {
+            printf(", \"%s_per_op\": %.3f", COUNTERS[i].name, totals[i] / ops);
+        } else {
+            printf(", \"%s_per_op\": null", COUNTERS[i].name);
+        }
+    }
+
+    puts("}");
+}
+
+// Paths
+
+// Every object goes back to the thread cache and comes straight out of it
+// again.
+static void measure_thread_cache_hit(struct Counters *counters) {
+    ffree(falloc(SMALL_SIZE));
+
+    counters_start(counters);
+
+    for (size_t i = 0; i < LOOP_OPS; ++i) {
+        void *ptr = falloc(SMALL_SIZE);
+        __asm__ volatile("" : : "r"(ptr) : "memory");
+        ffree(ptr);
+    }
+
+    counters_stop(counters, LOOP_OPS);
+}
+
+// Fills one slab after another straight through the slab allocator, so
+// nothing comes from the caches in front of it. The first allocation of a
+// slab sets it up, on a span that likely has to be committed first, and walks
+// past every slab filled before it.
+static void measure_new_slab(struct Counters *counters) {
+    finit();
+    struct SlabAlloc *heap = &falloc_get_instance()->slab_alloc;
+
+    for (size_t i = 0; i < SLAB_FILL_ROUNDS; ++i) {
+        counters_start(counters);
+        void *first = slab_alloc(heap, SMALL_SIZE);
+        counters_stop(counters, 1);
+
+        size_t remaining = slab_from_ptr(first)->bitmap.num_elems - 1;
+
+        for (size_t j = 0; j < remaining; ++j) {
+            void *ptr = slab_alloc(heap, SMALL_SIZE);
+            __asm__ volatile("" : : "r"(ptr) : "memory");
+        }
+    }
+}
+
+// Every allocation after the first of a fresh slab finds its object in the
+// bitmap. Each round gets a heap of its own, so the slab being filled is
+// always the first one and no full slabs are walked past.
+static void measure_bitmap_scan(struct Counters *counters) {
+    for (size_t i = 0; i < SLAB_FILL_ROUNDS; ++i) {
+        struct SlabAlloc heap = slab_alloc_init(NULL);
+        void *first = slab_alloc(&heap, SMALL_SIZE);
+        size_t remaining = slab_from_ptr(first)->bitmap.num_elems - 1;
+
+        counters_start(counters);
+
+        for (size_t j = 0; j < remaining; ++j) {
+            void *ptr = slab_alloc(&heap, SMALL_SIZE);
+            __asm__ volatile("" : : "r"(ptr) : "memory");
+        }
+
+        counters_stop(counters, remaining);
+
+        slab_alloc_deinit(&heap);
+    }
+}
+
+// Big objects go through the TLSF index of the fallback allocator and the
+// Rtree both ways.
+static void measure_fallback(struct Counters *counters) {
+    ffree(falloc(BIG_SIZE));
+
+    counters_start(counters);
+
+    for (size_t i = 0; i < LOOP_OPS; ++i) {
+        void *ptr = falloc(BIG_SIZE);
+        __asm__ volatile("" : : "r"(ptr) : "memory");
+        ffree(ptr);
+    }
+
+    counters_stop(counters, LOOP_OPS);
+}
+
+static void measure_rtree_lookup(struct Counters *counters) {
+    void *ptr = falloc(BIG_SIZE);
+
+    counters_start(counters);
+
+    for (size_t i = 0; i < LOOP_OPS; ++i) {
+        size_t size = fmemsize(ptr);
+        __asm__ volatile("" : : "r"(size) : "memory");
+    }
+
+    counters_stop(counters, LOOP_OPS);
+
+    ffree(ptr);
+}
+
+static void *allocate_objects(void *arg) {
+    void **objects = arg;
+
+    for (size_t i = 0; i < CROSS_THREAD_OBJECTS; ++i) {
+        objects[i] = falloc(SMALL_SIZE);
+    }
+
+    return NULL;
+}
+
+// Objects of a heap whose thread is gone, freed in batches onto its remote
+// list.
+static void measure_cross_thread(struct Counters *counters) {
+    static void *objects[CROSS_THREAD_OBJECTS];
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, &allocate_objects, objects) != 0) {
+        perror("pthread_create() failed in measure_cross_thread()");
+        _exit(EXIT_FAILURE);
+    }
+
+    pthread_join(thread, NULL);
+
+    counters_start(counters);
+
+    for (size_t i = 0; i < CROSS_THREAD_OBJECTS; ++i) {
+        ffree(objects[i]);
+    }
+
+    counters_stop(counters, CROSS_THREAD_OBJECTS);
+}
+
+static const struct Path PATHS[] = {
+    {.name = "thread_cache_hit",
+     .op = "falloc+ffree",
+     .measure = &measure_thread_cache_hit},
+    {.name = "bitmap_scan",
+     .op = "slab_alloc",
+     .measure = &measure_bitmap_scan},
+    {.name = "new_slab", .op = "slab_alloc", .measure = &measure_new_slab},
+    {.name = "fallback",
+     .op = "falloc+ffree",
+     .measure = &measure_fallback},
+    {.name = "rtree_lookup",
+     .op = "fmemsize",
+     .measure = &measure_rtree_lookup},
+    {.name = "cross_thread", .op = "ffree", .measure = &measure_cross_thread},
+};
+
+#define PATH_COUNT (sizeof(PATHS) / sizeof(PATHS[0]))
+
+// Runs in the forked process.
+static void run_path(const struct Path *path) {
+    struct Counters counters;
+    counters_open(&counters);
+
+    path->measure(&counters);
+    report(path, &counters);
+
+    counters_close(&counters);
+}
+
+static void warn_if_no_counters(void) {
+    int fd = open_counter(&COUNTERS[COUNTER_INSTRUCTIONS], -1);
+
+    if (fd < 0) {
+        (void)fprintf(stderr,
+                      "no hardware counters (%s), only ns_per_op is "
+                      "reported\n",
+                      strerror(errno));
+        return;
+    }
+
+    (void)close(fd);
+}
+
+int main(void) {
+    warn_if_no_counters();
+
+    bool succeeded = true;
+
+    for (size_t i = 0; i < PATH_COUNT; ++i) {
+        (void)fflush(stdout);
+
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            perror("fork() failed in main()");
+            return EXIT_FAILURE;
+        }
+
+        if (pid == 0) {
+            run_path(&PATHS[i]);
+            (void)fflush(stdout);
+            _exit(EXIT_SUCCESS);
+        }
+
+        int status = 0;
+
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != EXIT_SUCCESS) {
+            (void)fprintf(stderr, "counters: %s failed\n", PATHS[i].name);
+            succeeded = false;
+        }
+    }
+
+    return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,228 @@
+#include "bench.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// A long running workload in three phases, to see how much memory the
+// allocator holds on to next to what is live. Every thread ramps its live
+// bytes up to LIVE_TARGET over the first RAMP_PERCENT of the run, churns at
+// LIVE_TARGET until the last RAMP_PERCENT, and frees everything again over
+// those. Every op frees a random object and then allocates until the thread
+// is back at its target, so objects die in random order. While churning, the
+// sizes move from 2^MIN_SHIFT up to 2^MAX_SHIFT and back down, log uniform
+// over a window WINDOW_SHIFTS powers of 2 wide, so the heap is filled with
+// sizes it later has no use for. One op is one call.
+//
+// The arguments are the largest thread count and the length of a run in
+// seconds, DEFAULT_SECONDS if there is none. On top of the usual fields,
+// every run reports the memory samples of bench_sampling_report(), and the
+// samples after the ramp down show what is never given back.
+#define LIVE_TARGET     (4 << 20)
+#define SLOT_COUNT      (1 << 18)
+#define RAMP_PERCENT    20
+#define MIN_SHIFT       3
+#define MAX_SHIFT       13
+#define WINDOW_SHIFTS   3
+#define DEFAULT_SECONDS 30
+#define OPS_PER_CHECK   256
+#define NS_PER_SEC      1000000000
+
+struct Slot {
+    void *ptr;
+    size_t size;
+};
+
+struct Workload {
+    double seconds;
+    // SLOT_COUNT for every thread, faulted in before sampling starts so they
+    // count towards the baseline.
+    struct Slot *slots;
+};
+
+struct Churn {
+    const struct BenchAllocator *allocator;
+    struct Slot *slots;
+    size_t used;
+    int64_t live;
+    uint64_t state;
+    uint64_t ops;
+};
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int64_t ns = ((int64_t)(now.tv_sec - start->tv_sec) * NS_PER_SEC) +
+                 (now.tv_nsec - start->tv_nsec);
+
+    return (double)ns / NS_PER_SEC;
+}
+
+// The live bytes to churn at, progress through the run in percent.
+static int64_t target_at(double progress) {
+    if (progress < RAMP_PERCENT) {
+        return (int64_t)(LIVE_TARGET * progress / RAMP_PERCENT);
+    }
+
+    if (progress < 100 - RAMP_PERCENT) {
+        return LIVE_TARGET;
+    }
+
+    if (progress < 100) {
+        return (int64_t)(LIVE_TARGET * (100 - progress) / RAMP_PERCENT);
+    }
+
+    return 0;
+}
+
+// The smallest shift of the size window: MIN_SHIFT while ramping, and up to
+// MAX_SHIFT and back while churning.
+static unsigned window_at(double progress) {
+    const double churn_percent = 100 - (2 * RAMP_PERCENT);
+    double churned = (progress - RAMP_PERCENT) / churn_percent;
+
+    if (churned <= 0 || churned >= 1) {
+        return MIN_SHIFT;
+    }
+
+    double up = churned < 0.5 ? churned * 2 : (1 - churned) * 2;
+
+    return MIN_SHIFT + (unsigned)(up * (MAX_SHIFT - MIN_SHIFT) + 0.5);
+}
+
+static size_t random_size(uint64_t *state, unsigned window) {
+    unsigned shift =
+        window + (unsigned)(bench_next_random(state) % WINDOW_SHIFTS);
+
+    return bench_random_size(state, (size_t)1 << shift, (size_t)2 << shift);
+}
+
+static void free_random(struct Churn *churn) {
+    size_t slot = (size_t)(bench_next_random(&churn->state) % churn->used);
+
+    churn->allocator->free(churn->slots[slot].ptr);
+    churn->live -= (int64_t)churn->slots[slot].size;
+
+    churn->slots[slot] = churn->slots[--churn->used];
+    ++churn->ops;
+}
+
+static void churn_once(struct Churn *churn, int64_t target,
+                       unsigned window) {
+    if (churn->used > 0) {
+        free_random(churn);
+    }
+
+    while (churn->live < target && churn->used < SLOT_COUNT) {
+        size_t size = random_size(&churn->state, window);
+        void *ptr = churn->allocator->alloc(size);
+        *(uint8_t *)ptr = (uint8_t)size;
+
+        churn->slots[churn->used++] = (struct Slot){.ptr = ptr, .size = size};
+        churn->live += (int64_t)size;
+        ++churn->ops;
+    }
+}
+
+static void run_phases(struct BenchThread *thread) {
+    struct Workload *workload = thread->shared;
+    struct Churn churn = {
+        .allocator = thread->allocator,
+        .slots = &workload->slots[thread->index * SLOT_COUNT],
+        .used = 0,
+        .live = 0,
+        .state = thread->seed,
+        .ops = 0,
+    };
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    double progress = 0;
+
+    while (progress < 100) {
+        int64_t target = target_at(progress);
+        unsigned window = window_at(progress);
+
+        for (size_t i = 0; i < OPS_PER_CHECK; ++i) {
+            churn_once(&churn, target, window);
+            bench_set_live_bytes(thread->index, churn.live);
+        }
+
+        progress = seconds_since(&start) * 100 / workload->seconds;
+    }
+
+    while (churn.used > 0) {
+        free_random(&churn);
+    }
+
+    bench_set_live_bytes(thread->index, 0);
+    thread->ops = churn.ops;
+}
+
+static void workload_setup(struct BenchRun *run,
+                           const struct BenchAllocator *allocator) {
+    struct Workload *workload = run->shared;
+
+    size_t slots_size =
+        run->thread_count * SLOT_COUNT * sizeof(*workload->slots);
+    void *mem = mmap(NULL, slots_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+    if (mem == MAP_FAILED) {
+        perror("mmap() failed in workload_setup()");
+        _exit(EXIT_FAILURE);
+    }
+
+    workload->slots = mem;
+
+    bench_sampling_start(run, allocator);
+}
+
+int main(int argc, char **argv) {
+    size_t thread_counts[BENCH_MAX_THREADS];
+    size_t run_count =
+        bench_thread_counts(bench_max_threads(argc, argv), thread_counts);
+
+    struct Workload workload = {
+        .seconds = argc > 2 ? strtod(argv[2], NULL) : DEFAULT_SECONDS,
+        .slots = NULL,
+    };
+
+    if (workload.seconds <= 0) {
+        (void)fprintf(stderr, "usage: %s [threads] [seconds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char params[64];
+    (void)snprintf(params, sizeof(params), "live=%dMiB/thread,seconds=%g",
+                   LIVE_TARGET >> 20, workload.seconds);
+
+    bool succeeded = true;
+
+    for (size_t i = 0; i < run_count; ++i) {
+        struct BenchRun run = {
+            .benchmark = "fragmentation",
+            .params = params,
+            .thread_count = thread_counts[i],
+            .thread_func = &run_phases,
+            .shared = &workload,
+            .setup = &workload_setup,
+            .teardown = &bench_sampling_stop,
+            .report = &bench_sampling_report,
+        };
+
+        if (!bench_run(&run)) {
+            succeeded = false;
+        }
+    }
+
+    return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,94 @@
+#include "bench.h"
+
+#include <pthread.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Server churn after Larson and Krishnan: every benchmark thread stands for a
+// connection slot that is served by a chain of short lived workers. A worker
+// replaces OPS_PER_WORKER random objects out of SLOT_COUNT and exits, and the
+// next worker takes over the objects it left behind, so most frees are of
+// objects allocated by a thread that no longer exists.
+#define SLOT_COUNT     1000
+#define WORKER_COUNT   200
+#define OPS_PER_WORKER 10000
+#define MIN_SIZE       16
+#define MAX_SIZE       512
+
+struct Worker {
+    const struct BenchAllocator *allocator;
+    void **slots;
+    uint64_t *state;
+};
+
+static void *serve(void *arg) {
+    struct Worker *worker = arg;
+
+    for (size_t i = 0; i < OPS_PER_WORKER; ++i) {
+        size_t slot = (size_t)(bench_next_random(worker->state) % SLOT_COUNT);
+        worker->allocator->free(worker->slots[slot]);
+
+        size_t size = bench_random_size(worker->state, MIN_SIZE, MAX_SIZE);
+        worker->slots[slot] = worker->allocator->alloc(size);
+        *(uint8_t *)worker->slots[slot] = (uint8_t)i;
+    }
+
+    return NULL;
+}
+
+static void serve_connection(struct BenchThread *thread) {
+    void *slots[SLOT_COUNT] = {NULL};
+    uint64_t state = thread->seed;
+
+    struct Worker worker = {
+        .allocator = thread->allocator,
+        .slots = slots,
+        .state = &state,
+    };
+
+    for (size_t i = 0; i < WORKER_COUNT; ++i) {
+        pthread_t worker_thread;
+
+        if (pthread_create(&worker_thread, NULL, &serve, &worker) != 0) {
+            perror("pthread_create() failed in serve_connection()");
+            break;
+        }
+
+        pthread_join(worker_thread, NULL);
+        thread->ops += OPS_PER_WORKER;
+    }
+
+    for (size_t i = 0; i < SLOT_COUNT; ++i) {
+        thread->allocator->free(slots[i]);
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t thread_counts[BENCH_MAX_THREADS];
+    size_t run_count =
+        bench_thread_counts(bench_max_threads(argc, argv), thread_counts);
+
+    bool succeeded = true;
+
+    for (size_t i = 0; i < run_count; ++i) {
+        struct BenchRun run = {
+            .benchmark = "larson",
+            .params = "sizes=16-512",
+            .thread_count = thread_counts[i],
+            .thread_func = &serve_connection,
+            .shared = NULL,
+            .setup = NULL,
+            .teardown = NULL,
+            .report = NULL,
+        };
+
+        if (!bench_run(&run)) {
+            succeeded = false;
+        }
+    }
+
+    return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+}
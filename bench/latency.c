@@ -0,0 +1,482 @@
+#include "bench.h"
+
+#include <falloc.h>
+#include <slab_alloc.h>
+#include <slow_paths.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Times every single allocation and free of a random churn, mostly over the
+// slab classes with one size in BIG_ONE_IN from the big range, into
+// histograms per op and size class. Besides the usual fields, every run
+// reports:
+//
+// "timer": "rdtsc" or "clock_gettime",
+// "latency": [{"op": ..., "class": ..., "count": ..., "p50_ns": ...,
+//     "p99_ns": ..., "p999_ns": ..., "max_ns": ...}, ...],
+// "slow_paths": [{"op": ..., "path": ..., "count": ..., "p50_ns": ...,
+//     "max_ns": ...}, ...], the ops that took one of the paths in
+//     slow_paths.h,
+// "outliers": [{"op": ..., "p999_ns": ..., "count": ..., <path>: ...,
+//     "none": ...}, ...], the ops slower than the p99.9 of their op over all
+//     classes, by the slow path they took.
+//
+// An op that took several slow paths counts towards the first of
+// CAUSE_ORDER. Only falloc counts its slow paths, so every op of another
+// allocator counts as none.
+#define SLOT_COUNT     4096
+#define OPS_PER_THREAD 1000000
+#define MIN_SIZE       8
+#define MAX_BIG_SIZE   65536
+#define BIG_ONE_IN     20
+
+// Log-linear buckets after HdrHistogram: every power of 2 is split into
+// SUB_BUCKETS buckets, so a value is off by at most 1 / SUB_BUCKETS. Values of
+// 2^MAX_EXPONENT ticks and more all land in the last bucket, and max is kept
+// exactly.
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS     (1U << SUB_BUCKET_BITS)
+#define MAX_EXPONENT    40
+#define BUCKET_COUNT    ((MAX_EXPONENT - SUB_BUCKET_BITS + 2) * SUB_BUCKETS)
+
+#define CALIBRATION_NS 50000000
+#define NS_PER_SEC     1000000000ULL
+#define PERMILLE       1000
+#define P50            500
+#define P99            990
+#define P999           999
+
+enum Op {
+    OP_ALLOC,
+    OP_FREE,
+    OP_COUNT,
+};
+
+static const char *const OP_NAMES[OP_COUNT] = {
+    [OP_ALLOC] = "alloc",
+    [OP_FREE] = "free",
+};
+
+// The slab classes, and one more for big objects.
+#define CLASS_BIG   SLAB_NUM_CLASSES
+#define CLASS_COUNT (SLAB_NUM_CLASSES + 1)
+
+// Every slow path, and one more for ops that took none.
+#define CAUSE_NONE  FALLOC_SLOW_PATH_COUNT
+#define CAUSE_COUNT (FALLOC_SLOW_PATH_COUNT + 1)
+
+// The deepest paths come first: a new FixedAllocator block always comes with
+// a new slab.
+static const enum FallocSlowPath CAUSE_ORDER[FALLOC_SLOW_PATH_COUNT] = {
+    FALLOC_SLOW_PATH_FIXED_BLOCK,
+    FALLOC_SLOW_PATH_FALLBACK_REGION,
+    FALLOC_SLOW_PATH_RTREE_NODE,
+    FALLOC_SLOW_PATH_SLAB_INIT,
+};
+
+struct Histogram {
+    uint64_t count;
+    uint64_t max;
+    uint32_t buckets[BUCKET_COUNT];
+};
+
+struct Latencies {
+    struct Histogram by_class[OP_COUNT][CLASS_COUNT];
+    struct Histogram by_cause[OP_COUNT][CAUSE_COUNT];
+};
+
+// Only ever used in the forked process of a single run. Mapped directly, so
+// the histograms stay out of the allocator under test.
+static struct Latencies *thread_latencies[BENCH_MAX_THREADS];
+
+static double ticks_per_ns = 1.0;
+
+#if defined(__x86_64__)
+static const char *const TIMER_NAME = "rdtsc";
+
+// The fences keep the op from moving across the reads.
+static inline uint64_t read_ticks(void) {
+    _mm_lfence();
+    uint64_t ticks = __rdtsc();
+    _mm_lfence();
+
+    return ticks;
+}
+#else
+static const char *const TIMER_NAME = "clock_gettime";
+
+static inline uint64_t read_ticks(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((uint64_t)now.tv_sec * NS_PER_SEC) + (uint64_t)now.tv_nsec;
+}
+#endif
+
+static uint64_t now_in_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((uint64_t)now.tv_sec * NS_PER_SEC) + (uint64_t)now.tv_nsec;
+}
+
+static void calibrate_ticks(void) {
+    uint64_t start_ns = now_in_ns();
+    uint64_t start_ticks = read_ticks();
+
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = CALIBRATION_NS};
+    (void)nanosleep(&interval, NULL);
+
+    uint64_t ns = now_in_ns() - start_ns;
+    ticks_per_ns = (double)(read_ticks() - start_ticks) / (double)ns;
+}
+
+static inline size_t bucket_index(uint64_t ticks) {
+    if (ticks < SUB_BUCKETS) {
+        return (size_t)ticks;
+    }
+
+    size_t exponent = 63 - (size_t)__builtin_clzll(ticks);
+
+    if (exponent > MAX_EXPONENT) {
+        return BUCKET_COUNT - 1;
+    }
+
+    size_t sub_bucket =
+        (size_t)(ticks >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+
+    return ((exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS) + sub_bucket;
+}
+
+// The highest value that lands in the bucket.
+static uint64_t bucket_value(size_t index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+
+    size_t exponent = (index / SUB_BUCKETS) + SUB_BUCKET_BITS - 1;
+    uint64_t lowest = (uint64_t)(SUB_BUCKETS + (index % SUB_BUCKETS))
+                      << (exponent - SUB_BUCKET_BITS);
+
+    return lowest + ((uint64_t)1 << (exponent - SUB_BUCKET_BITS)) - 1;
+}
+
+static inline void histogram_record(struct Histogram *histogram,
+                                    uint64_t ticks) {
+    ++histogram->count;
+    ++histogram->buckets[bucket_index(ticks)];
+
+    if (ticks > histogram->max) {
+        histogram->max = ticks;
+    }
+}
+
+static void histogram_add(struct Histogram *into,
+                          const struct Histogram *histogram) {
+    into->count += histogram->count;
+
+    if (histogram->max > into->max) {
+        into->max = histogram->max;
+    }
+
+    for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+        into->buckets[i] += histogram->buckets[i];
+    }
+}
+
+// The bucket holding the value that permille of all values are at or below.
+static size_t histogram_bucket_at(const struct Histogram *histogram,
+                                  uint64_t permille) {
+    uint64_t rank = ((histogram->count * permille) + PERMILLE - 1) / PERMILLE;
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+        seen += histogram->buckets[i];
+
+        if (seen >= rank && seen != 0) {
+            return i;
+        }
+    }
+
+    return BUCKET_COUNT - 1;
+}
+
+static double ticks_to_ns(uint64_t ticks) {
+    return (double)ticks / ticks_per_ns;
+}
+
+// Never more than the largest value actually seen.
+static double histogram_value_at(const struct Histogram *histogram,
+                                 uint64_t permille) {
+    uint64_t value = bucket_value(histogram_bucket_at(histogram, permille));
+
+    return ticks_to_ns(value < histogram->max ? value : histogram->max);
+}
+
+static uint64_t histogram_count_above(const struct Histogram *histogram,
+                                      size_t bucket) {
+    uint64_t count = 0;
+
+    for (size_t i = bucket + 1; i < BUCKET_COUNT; ++i) {
+        count += histogram->buckets[i];
+    }
+
+    return count;
+}
+
+static struct Latencies *latencies_map(void) {
+    void *mem = mmap(NULL, sizeof(struct Latencies), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (mem == MAP_FAILED) {
+        perror("mmap() failed in latencies_map()");
+        _exit(EXIT_FAILURE);
+    }
+
+    return mem;
+}
+
+static inline size_t class_index(size_t size) {
+    return size > SLAB_CLASS_MAX ? CLASS_BIG : falloc_size_class(size);
+}
+
+static inline size_t cause_of(const uint64_t *before) {
+    for (size_t i = 0; i < FALLOC_SLOW_PATH_COUNT; ++i) {
+        if (falloc_slow_path_counts[CAUSE_ORDER[i]] != before[CAUSE_ORDER[i]]) {
+            return CAUSE_ORDER[i];
+        }
+    }
+
+    return CAUSE_NONE;
+}
+
+static inline void record(struct Latencies *latencies, enum Op op,
+                          size_t class, uint64_t ticks,
+                          const uint64_t *before) {
+    histogram_record(&latencies->by_class[op][class], ticks);
+    histogram_record(&latencies->by_cause[op][cause_of(before)], ticks);
+}
+
+static inline size_t random_size(uint64_t *state) {
+    if (bench_next_random(state) % BIG_ONE_IN == 0) {
+        return bench_random_size(state, SLAB_CLASS_MAX + 1, MAX_BIG_SIZE);
+    }
+
+    return bench_random_size(state, MIN_SIZE, SLAB_CLASS_MAX);
+}
+
+static void churn(struct BenchThread *thread) {
+    const struct BenchAllocator *allocator = thread->allocator;
+    struct Latencies *latencies = latencies_map();
+    thread_latencies[thread->index] = latencies;
+
+    void *slots[SLOT_COUNT] = {NULL};
+    uint8_t slot_classes[SLOT_COUNT];
+    uint64_t before[FALLOC_SLOW_PATH_COUNT];
+    uint64_t state = thread->seed;
+
+    for (uint64_t i = 0; i < OPS_PER_THREAD; ++i) {
+        size_t slot = (size_t)(bench_next_random(&state) % SLOT_COUNT);
+
+        if (slots[slot]) {
+            memcpy(before, falloc_slow_path_counts, sizeof(before));
+            uint64_t start = read_ticks();
+            allocator->free(slots[slot]);
+            uint64_t ticks = read_ticks() - start;
+
+            record(latencies, OP_FREE, slot_classes[slot], ticks, before);
+            ++thread->ops;
+        }
+
+        size_t size = random_size(&state);
+
+        memcpy(before, falloc_slow_path_counts, sizeof(before));
+        uint64_t start = read_ticks();
+        slots[slot] = allocator->alloc(size);
+        uint64_t ticks = read_ticks() - start;
+
+        *(uint8_t *)slots[slot] = (uint8_t)i;
+        slot_classes[slot] = (uint8_t)class_index(size);
+
+        record(latencies, OP_ALLOC, slot_classes[slot], ticks, before);
+        ++thread->ops;
+    }
+
+    for (size_t i = 0; i < SLOT_COUNT; ++i) {
+        allocator->free(slots[i]);
+    }
+}
+
+static void print_class(size_t class, FILE *out) {
+    if (class == CLASS_BIG) {
+        (void)fputs("\"big\"", out);
+    } else {
+        (void)fprintf(out, "%u", SLAB_SIZES[class]);
+    }
+}
+
+static const char *cause_name(size_t cause) {
+    return cause == CAUSE_NONE
+               ? "none"
+               : falloc_slow_path_name((enum FallocSlowPath)cause);
+}
+
+static void report_latency(const struct Latencies *merged, FILE *out) {
+    bool first = true;
+
+    (void)fprintf(out, ", \"timer\": \"%s\", \"latency\": [", TIMER_NAME);
+
+    for (size_t op = 0; op < OP_COUNT; ++op) {
+        for (size_t class = 0; class < CLASS_COUNT; ++class) {
+            const struct Histogram *histogram = &merged->by_class[op][class];
+
+            if (histogram->count == 0) {
+                continue;
+            }
+
+            (void)fprintf(out, "%s{\"op\": \"%s\", \"class\": ",
+                          first ? "" : ", ", OP_NAMES[op]);
+            print_class(class, out);
+            (void)fprintf(out,
+                          ", \"count\": %llu, \"p50_ns\": %.0f, "
+                          "\"p99_ns\": %.0f, \"p999_ns\": %.0f, "
+                          "\"max_ns\": %.0f}",
+                          (unsigned long long)histogram->count,
+                          histogram_value_at(histogram, P50),
+                          histogram_value_at(histogram, P99),
+                          histogram_value_at(histogram, P999),
+                          ticks_to_ns(histogram->max));
+            first = false;
+        }
+    }
+
+    (void)fputs("]", out);
+}
+
+static void report_slow_paths(const struct Latencies *merged, FILE *out) {
+    bool first = true;
+
+    (void)fputs(", \"slow_paths\": [", out);
+
+    for (size_t op = 0; op < OP_COUNT; ++op) {
+        for (size_t cause = 0; cause < FALLOC_SLOW_PATH_COUNT; ++cause) {
+            const struct Histogram *histogram = &merged->by_cause[op][cause];
+
+            if (histogram->count == 0) {
+                continue;
+            }
+
+            (void)fprintf(out,
+                          "%s{\"op\": \"%s\", \"path\": \"%s\", "
+                          "\"count\": %llu, \"p50_ns\": %.0f, "
+                          "\"max_ns\": %.0f}",
+                          first ? "" : ", ", OP_NAMES[op], cause_name(cause),
+                          (unsigned long long)histogram->count,
+                          histogram_value_at(histogram, P50),
+                          ticks_to_ns(histogram->max));
+            first = false;
+        }
+    }
+
+    (void)fputs("]", out);
+}
+
+// Outliers are counted at bucket granularity: everything in a bucket above
+// the one holding the p99.9.
+static void report_outliers(const struct Latencies *merged, FILE *out) {
+    static struct Histogram all;
+
+    (void)fputs(", \"outliers\": [", out);
+
+    for (size_t op = 0; op < OP_COUNT; ++op) {
+        memset(&all, 0, sizeof(all));
+
+        for (size_t class = 0; class < CLASS_COUNT; ++class) {
+            histogram_add(&all, &merged->by_class[op][class]);
+        }
+
+        size_t bucket = histogram_bucket_at(&all, P999);
+
+        (void)fprintf(out,
+                      "%s{\"op\": \"%s\", \"p999_ns\": %.0f, \"count\": %llu",
+                      op == 0 ? "" : ", ", OP_NAMES[op],
+                      histogram_value_at(&all, P999),
+                      (unsigned long long)histogram_count_above(&all, bucket));
+
+        for (size_t cause = 0; cause < CAUSE_COUNT; ++cause) {
+            (void)fprintf(out, ", \"%s\": %llu", cause_name(cause),
+                          (unsigned long long)histogram_count_above(
+                              &merged->by_cause[op][cause], bucket));
+        }
+
+        (void)fputs("}", out);
+    }
+
+    (void)fputs("]", out);
+}
+
+static void report(const struct BenchRun *run, FILE *out) {
+    struct Latencies *merged = latencies_map();
+
+    for (size_t i = 0; i < run->thread_count; ++i) {
+        const struct Latencies *latencies = thread_latencies[i];
+
+        for (size_t op = 0; op < OP_COUNT; ++op) {
+            for (size_t class = 0; class < CLASS_COUNT; ++class) {
+                histogram_add(&merged->by_class[op][class],
+                              &latencies->by_class[op][class]);
+            }
+
+            for (size_t cause = 0; cause < CAUSE_COUNT; ++cause) {
+                histogram_add(&merged->by_cause[op][cause],
+                              &latencies->by_cause[op][cause]);
+            }
+        }
+    }
+
+    report_latency(merged, out);
+    report_slow_paths(merged, out);
+    report_outliers(merged, out);
+}
+
+int main(int argc, char **argv) {
+    size_t max_threads = bench_max_threads(argc, argv);
+    size_t thread_counts[] = {1, max_threads};
+    size_t run_count = max_threads == 1 ? 1 : 2;
+
+    calibrate_ticks();
+
+    bool succeeded = true;
+
+    for (size_t i = 0; i < run_count; ++i) {
+        struct BenchRun run = {
+            .benchmark = "latency",
+            .params = "sizes=8-65536,big=1/20",
+            .thread_count = thread_counts[i],
+            .thread_func = &churn,
+            .shared = NULL,
+            .setup = NULL,
+            .teardown = NULL,
+            .report = &report,
+        };
+
+        if (!bench_run(&run)) {
+            succeeded = false;
+        }
+    }
+
+    return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+}
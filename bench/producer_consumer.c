@@ -0,0 +1,110 @@
+#include "bench.h"
+
+#include <sched.h>
+
+#include <assert.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Threads are paired up. The even thread of a pair allocates OBJECT_COUNT
+// objects and hands them to the odd one through a ring, which frees them, so
+// every free is a cross-thread free. Both threads count every object they
+// handle.
+#define OBJECT_COUNT  1000000
+#define RING_CAPACITY 1024
+#define MIN_SIZE      8
+#define MAX_SIZE      256
+#define CACHE_LINE    64
+
+static_assert((RING_CAPACITY & (RING_CAPACITY - 1)) == 0,
+              "ring indices wrap with a mask");
+
+// Single producer, single consumer. head and tail only ever grow.
+struct Ring {
+    alignas(CACHE_LINE) size_t head;
+    alignas(CACHE_LINE) size_t tail;
+    void *slots[RING_CAPACITY];
+};
+
+// The benchmark runs in a forked process, so every run starts with empty
+// rings.
+static struct Ring rings[BENCH_MAX_THREADS / 2];
+
+static void produce(struct BenchThread *thread, struct Ring *ring) {
+    uint64_t state = thread->seed;
+
+    for (uint64_t i = 0; i < OBJECT_COUNT; ++i) {
+        size_t size = bench_random_size(&state, MIN_SIZE, MAX_SIZE);
+        void *ptr = thread->allocator->alloc(size);
+        *(uint8_t *)ptr = (uint8_t)i;
+
+        size_t tail = ring->tail;
+
+        while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+               RING_CAPACITY) {
+            sched_yield();
+        }
+
+        ring->slots[tail & (RING_CAPACITY - 1)] = ptr;
+        __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void consume(struct BenchThread *thread, struct Ring *ring) {
+    for (uint64_t i = 0; i < OBJECT_COUNT; ++i) {
+        size_t head = ring->head;
+
+        while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head) {
+            sched_yield();
+        }
+
+        thread->allocator->free(ring->slots[head & (RING_CAPACITY - 1)]);
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void hand_over(struct BenchThread *thread) {
+    struct Ring *ring = &rings[thread->index / 2];
+
+    if (thread->index % 2 == 0) {
+        produce(thread, ring);
+    } else {
+        consume(thread, ring);
+    }
+
+    thread->ops = OBJECT_COUNT;
+}
+
+int main(int argc, char **argv) {
+    size_t max_pairs = bench_max_threads(argc, argv) / 2;
+
+    if (max_pairs == 0) {
+        max_pairs = 1;
+    }
+
+    size_t pair_counts[BENCH_MAX_THREADS];
+    size_t run_count = bench_thread_counts(max_pairs, pair_counts);
+
+    bool succeeded = true;
+
+    for (size_t i = 0; i < run_count; ++i) {
+        struct BenchRun run = {
+            .benchmark = "producer_consumer",
+            .params = "sizes=8-256",
+            .thread_count = pair_counts[i] * 2,
+            .thread_func = &hand_over,
+            .shared = NULL,
+            .setup = NULL,
+            .teardown = NULL,
+            .report = NULL,
+        };
+
+        if (!bench_run(&run)) {
+            succeeded = false;
+        }
+    }
+
+    return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,66 @@
+#include "bench.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Every thread grows a buffer by half its size at a time, from MIN_SIZE to
+// MAX_SIZE, the way a vector or a string builder would, touching every new
+// page. One op is one realloc.
+#define GROWTH_ROUNDS 20
+#define MIN_SIZE      64
+#define MAX_SIZE      ((size_t)64 * 1024 * 1024)
+#define TOUCH_STRIDE  4096
+
+static void grow(struct BenchThread *thread) {
+    const struct BenchAllocator *allocator = thread->allocator;
+
+    for (size_t round = 0; round < GROWTH_ROUNDS; ++round) {
+        uint8_t *buffer = NULL;
+        size_t old_size = 0;
+
+        for (size_t size = MIN_SIZE; size <= MAX_SIZE; size += size / 2) {
+            buffer = allocator->realloc(buffer, size);
+
+            if (!buffer) {
+                return;
+            }
+
+            for (size_t i = old_size; i < size; i += TOUCH_STRIDE) {
+                buffer[i] = (uint8_t)i;
+            }
+
+            old_size = size;
+            ++thread->ops;
+        }
+
+        allocator->free(buffer);
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t thread_counts[BENCH_MAX_THREADS];
+    size_t run_count =
+        bench_thread_counts(bench_max_threads(argc, argv), thread_counts);
+
+    bool succeeded = true;
+
+    for (size_t i = 0; i < run_count; ++i) {
+        struct BenchRun run = {
+            .benchmark = "realloc_growth",
+            .params = "sizes=64-67108864",
+            .thread_count = thread_counts[i],
+            .thread_func = &grow,
+            .shared = NULL,
+            .setup = NULL,
+            .teardown = NULL,
+            .report = NULL,
+        };
+
+        if (!bench_run(&run)) {
+            succeeded = false;
+        }
+    }
+
+    return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+}
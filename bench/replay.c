@@ -0,0 +1,294 @@
+#include "bench.h"
+
+#include <trace.h>
+
+#include <sched.h>
+#include <unistd.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Replays a trace recorded with FALLOC_TRACE, given as the only argument,
+// against every allocator. Every thread of the trace gets a thread of its own
+// that makes the same calls in the same order, touching every page it gets. A
+// thread that frees or reallocates a pointer another thread allocated waits
+// until that allocation was replayed, everything else runs as fast as it can.
+// One op is one call.
+//
+// On top of the usual fields, every run reports the memory samples of
+// bench_sampling_report(), where the live bytes are what the replayed calls
+// asked for and didn't free yet, and the baseline includes the trace.
+
+// Records are read in chunks that double in size.
+#define FIRST_READ_RECORDS 4096
+#define TOUCH_STRIDE       4096
+
+struct Trace {
+    // Grouped by thread, each thread's in the order it made the calls.
+    struct FallocTraceRecord *records;
+    // The records of thread i are [thread_begin[i], thread_begin[i + 1]).
+    size_t thread_begin[BENCH_MAX_THREADS + 1];
+    size_t thread_count;
+    // Indexed by id. A pointer is set once its allocation was replayed, and
+    // its size before it.
+    void **ptrs;
+    size_t *sizes;
+    size_t id_count;
+};
+
+static void fail(const char *msg) {
+    (void)fprintf(stderr, "replay: %s\n", msg);
+    _exit(EXIT_FAILURE);
+}
+
+static bool trace_load(const char *path, struct Trace *trace) {
+    FILE *file = fopen(path, "rb");
+
+    if (!file) {
+        perror("fopen() failed in trace_load()");
+        return false;
+    }
+
+    struct FallocTraceHeader header;
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, FALLOC_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != FALLOC_TRACE_VERSION ||
+        header.record_size != sizeof(struct FallocTraceRecord)) {
+        (void)fprintf(stderr, "%s is not a falloc trace\n", path);
+        (void)fclose(file);
+        return false;
+    }
+
+    size_t capacity = 0;
+    size_t count = 0;
+    struct FallocTraceRecord *records = NULL;
+
+    for (;;) {
+        if (count == capacity) {
+            capacity = capacity == 0 ? FIRST_READ_RECORDS : capacity * 2;
+            struct FallocTraceRecord *grown =
+                realloc(records, capacity * sizeof(*records));
+
+            if (!grown) {
+                perror("realloc() failed in trace_load()");
+                free(records);
+                (void)fclose(file);
+                return false;
+            }
+
+            records = grown;
+        }
+
+        size_t read = fread(records + count, sizeof(*records),
+                            capacity - count, file);
+        count += read;
+
+        if (read == 0) {
+            break;
+        }
+    }
+
+    (void)fclose(file);
+
+    memset(trace, 0, sizeof(*trace));
+    size_t max_id = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        const struct FallocTraceRecord *record = &records[i];
+
+        if (record->thread >= BENCH_MAX_THREADS) {
+            (void)fprintf(stderr, "%s has more than %d threads\n", path,
+                          BENCH_MAX_THREADS);
+            free(records);
+            return false;
+        }
+
+        if (record->thread >= trace->thread_count) {
+            trace->thread_count = record->thread + 1;
+        }
+
+        ++trace->thread_begin[record->thread + 1];
+        max_id = record->id > max_id ? record->id : max_id;
+    }
+
+    for (size_t i = 0; i < trace->thread_count; ++i) {
+        trace->thread_begin[i + 1] += trace->thread_begin[i];
+    }
+
+    // Grouping by thread keeps each thread's records in file order.
+    size_t next[BENCH_MAX_THREADS];
+    memcpy(next, trace->thread_begin, sizeof(next));
+
+    trace->records = malloc((count == 0 ? 1 : count) * sizeof(*records));
+    trace->id_count = max_id + 1;
+    trace->ptrs = calloc(trace->id_count, sizeof(*trace->ptrs));
+    trace->sizes = calloc(trace->id_count, sizeof(*trace->sizes));
+
+    if (!trace->records || !trace->ptrs || !trace->sizes) {
+        perror("malloc() failed in trace_load()");
+        free(records);
+        return false;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        trace->records[next[records[i].thread]++] = records[i];
+    }
+
+    free(records);
+
+    return true;
+}
+
+// The tables indexed by id are touched up front, so they count towards the
+// baseline rather than the allocator.
+static void replay_setup(struct BenchRun *run,
+                         const struct BenchAllocator *allocator) {
+    struct Trace *trace = run->shared;
+
+    memset(trace->ptrs, 0, trace->id_count * sizeof(*trace->ptrs));
+    memset(trace->sizes, 0, trace->id_count * sizeof(*trace->sizes));
+
+    bench_sampling_start(run, allocator);
+}
+
+// Waits for the thread that allocates id, if it isn't this one.
+static void *replayed_ptr(struct Trace *trace, uint32_t id) {
+    void *ptr = __atomic_load_n(&trace->ptrs[id], __ATOMIC_ACQUIRE);
+
+    while (!ptr) {
+        sched_yield();
+        ptr = __atomic_load_n(&trace->ptrs[id], __ATOMIC_ACQUIRE);
+    }
+
+    return ptr;
+}
+
+static void publish_ptr(struct Trace *trace, uint32_t id, void *ptr,
+                        size_t size) {
+    trace->sizes[id] = size;
+    __atomic_store_n(&trace->ptrs[id], ptr, __ATOMIC_RELEASE);
+}
+
+static void touch(void *ptr, size_t from, size_t to) {
+    for (size_t i = from; i < to; i += TOUCH_STRIDE) {
+        ((volatile uint8_t *)ptr)[i] = (uint8_t)i;
+    }
+}
+
+// Calls that failed when they were recorded, and frees of pointers allocated
+// before the trace, all have id 0 and are left out.
+static int64_t replay_record(const struct BenchAllocator *allocator,
+                             struct Trace *trace,
+                             const struct FallocTraceRecord *record) {
+    switch ((enum FallocTraceOp)record->op) {
+    case FALLOC_TRACE_ALLOC: {
+        if (record->id == 0) {
+            return 0;
+        }
+
+        void *ptr = allocator->alloc(record->size);
+
+        if (!ptr) {
+            fail("an allocation failed");
+        }
+
+        touch(ptr, 0, record->size);
+        publish_ptr(trace, record->id, ptr, record->size);
+
+        return (int64_t)record->size;
+    }
+    case FALLOC_TRACE_FREE: {
+        if (record->id == 0) {
+            return 0;
+        }
+
+        allocator->free(replayed_ptr(trace, record->id));
+
+        return -(int64_t)trace->sizes[record->id];
+    }
+    case FALLOC_TRACE_REALLOC: {
+        void *old_ptr = NULL;
+        size_t old_size = 0;
+
+        if (record->old_id != 0) {
+            old_ptr = replayed_ptr(trace, record->old_id);
+            old_size = trace->sizes[record->old_id];
+        }
+
+        if (record->size == 0 && old_ptr) {
+            allocator->free(old_ptr);
+            return -(int64_t)old_size;
+        }
+
+        if (record->id == 0) {
+            return 0;
+        }
+
+        void *ptr = allocator->realloc(old_ptr, record->size);
+
+        if (!ptr) {
+            fail("a reallocation failed");
+        }
+
+        touch(ptr, old_size, record->size);
+        publish_ptr(trace, record->id, ptr, record->size);
+
+        return (int64_t)record->size - (int64_t)old_size;
+    }
+    }
+
+    fail("the trace has a record of an unknown kind");
+
+    return 0;
+}
+
+static void replay_thread(struct BenchThread *thread) {
+    struct Trace *trace = thread->shared;
+    size_t begin = trace->thread_begin[thread->index];
+    size_t end = trace->thread_begin[thread->index + 1];
+    int64_t live = 0;
+
+    for (size_t i = begin; i < end; ++i) {
+        live += replay_record(thread->allocator, trace, &trace->records[i]);
+        bench_set_live_bytes(thread->index, live);
+    }
+
+    thread->ops = end - begin;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        (void)fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    static struct Trace trace;
+
+    if (!trace_load(argv[1], &trace)) {
+        return EXIT_FAILURE;
+    }
+
+    struct BenchRun run = {
+        .benchmark = "replay",
+        .params = argv[1],
+        .thread_count = trace.thread_count,
+        .thread_func = &replay_thread,
+        .shared = &trace,
+        .setup = &replay_setup,
+        .teardown = &bench_sampling_stop,
+        .report = &bench_sampling_report,
+    };
+
+    bool succeeded = bench_run(&run);
+
+    free(trace.records);
+    free(trace.ptrs);
+    free(trace.sizes);
+
+    return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+}
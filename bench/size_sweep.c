@@ -0,0 +1,82 @@
+#include "bench.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// The thread scaling churn over a range of size distributions, from single
+// slab classes to big objects, each on one thread and on all of them.
+#define SLOT_COUNT     1024
+#define OPS_PER_THREAD 1000000
+
+struct SizeRange {
+    const char *params;
+    size_t min_size;
+    size_t max_size;
+};
+
+static const struct SizeRange SIZE_RANGES[] = {
+    {.params = "sizes=8-8", .min_size = 8, .max_size = 8},
+    {.params = "sizes=64-64", .min_size = 64, .max_size = 64},
+    {.params = "sizes=256-256", .min_size = 256, .max_size = 256},
+    {.params = "sizes=1024-1024", .min_size = 1024, .max_size = 1024},
+    {.params = "sizes=8-128", .min_size = 8, .max_size = 128},
+    {.params = "sizes=8-1024", .min_size = 8, .max_size = 1024},
+    {.params = "sizes=1025-4096", .min_size = 1025, .max_size = 4096},
+    {.params = "sizes=4096-65536", .min_size = 4096, .max_size = 65536},
+    {.params = "sizes=8-65536", .min_size = 8, .max_size = 65536},
+};
+
+#define SIZE_RANGE_COUNT (sizeof(SIZE_RANGES) / sizeof(SIZE_RANGES[0]))
+
+static void churn(struct BenchThread *thread) {
+    const struct BenchAllocator *allocator = thread->allocator;
+    const struct SizeRange *range = thread->shared;
+    void *slots[SLOT_COUNT] = {NULL};
+    uint64_t state = thread->seed;
+
+    for (uint64_t i = 0; i < OPS_PER_THREAD; ++i) {
+        size_t slot = (size_t)(bench_next_random(&state) % SLOT_COUNT);
+        allocator->free(slots[slot]);
+
+        size_t size =
+            bench_random_size(&state, range->min_size, range->max_size);
+        slots[slot] = allocator->alloc(size);
+        *(uint8_t *)slots[slot] = (uint8_t)i;
+    }
+
+    for (size_t i = 0; i < SLOT_COUNT; ++i) {
+        allocator->free(slots[i]);
+    }
+
+    thread->ops = OPS_PER_THREAD;
+}
+
+int main(int argc, char **argv) {
+    size_t max_threads = bench_max_threads(argc, argv);
+    size_t thread_counts[] = {1, max_threads};
+    size_t run_count = max_threads == 1 ? 1 : 2;
+
+    bool succeeded = true;
+
+    for (size_t i = 0; i < SIZE_RANGE_COUNT; ++i) {
+        for (size_t j = 0; j < run_count; ++j) {
+            struct BenchRun run = {
+                .benchmark = "size_sweep",
+                .params = SIZE_RANGES[i].params,
+                .thread_count = thread_counts[j],
+                .thread_func = &churn,
+                .shared = (void *)&SIZE_RANGES[i],
+                .setup = NULL,
+                .teardown = NULL,
+                .report = NULL,
+            };
+
+            if (!bench_run(&run)) {
+                succeeded = false;
+            }
+        }
+    }
+
+    return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+}
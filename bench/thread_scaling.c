@@ -0,0 +1,61 @@
+#include "bench.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Every thread keeps SLOT_COUNT objects alive, and replaces a random one with
+// a new object of a random small size OPS_PER_THREAD times. Threads never
+// share objects, so this is how far the allocator scales on its own.
+#define SLOT_COUNT     1024
+#define OPS_PER_THREAD 2000000
+#define MIN_SIZE       8
+#define MAX_SIZE       1024
+
+static void churn(struct BenchThread *thread) {
+    const struct BenchAllocator *allocator = thread->allocator;
+    void *slots[SLOT_COUNT] = {NULL};
+    uint64_t state = thread->seed;
+
+    for (uint64_t i = 0; i < OPS_PER_THREAD; ++i) {
+        size_t slot = (size_t)(bench_next_random(&state) % SLOT_COUNT);
+        allocator->free(slots[slot]);
+
+        size_t size = bench_random_size(&state, MIN_SIZE, MAX_SIZE);
+        slots[slot] = allocator->alloc(size);
+        *(uint8_t *)slots[slot] = (uint8_t)i;
+    }
+
+    for (size_t i = 0; i < SLOT_COUNT; ++i) {
+        allocator->free(slots[i]);
+    }
+
+    thread->ops = OPS_PER_THREAD;
+}
+
+int main(int argc, char **argv) {
+    size_t thread_counts[BENCH_MAX_THREADS];
+    size_t run_count =
+        bench_thread_counts(bench_max_threads(argc, argv), thread_counts);
+
+    bool succeeded = true;
+
+    for (size_t i = 0; i < run_count; ++i) {
+        struct BenchRun run = {
+            .benchmark = "thread_scaling",
+            .params = "sizes=8-1024",
+            .thread_count = thread_counts[i],
+            .thread_func = &churn,
+            .shared = NULL,
+            .setup = NULL,
+            .teardown = NULL,
+            .report = NULL,
+        };
+
+        if (!bench_run(&run)) {
+            succeeded = false;
+        }
+    }
+
+    return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+}
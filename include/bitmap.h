@@ -2,6 +2,7 @@
 #define BITMAP_H
 
 #include <limits.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -23,5 +24,6 @@ struct Bitmap bitmap_init(void *mem_size_t_aligned, BitmapSize num_elements);
 BitmapSize bitmap_find_free_and_swap(struct Bitmap *bitmap);
 void bitmap_set_to_0(struct Bitmap *bitmap, BitmapSize bit_index);
 void bitmap_set_to_1(struct Bitmap *bitmap, BitmapSize bit_index);
+bool bitmap_is_set(const struct Bitmap *bitmap, BitmapSize bit_index);
 
 #endif // BITMAP_H
@@ -6,26 +6,86 @@
 
 #include <stdalign.h>
 #include <stddef.h>
+#include <stdint.h>
+
+// Free chunks are kept in a two level segregated fit (TLSF) index. The first
+// level splits chunk sizes by powers of 2, the second splits every power of 2
+// range linearly into FALLBACK_SL_COUNT lists. Chunks smaller than
+// FALLBACK_SMALL_CHUNK_SIZE all share the first level 0, split linearly by
+// FALLBACK_CHUNK_ALIGN.
+#define FALLBACK_SL_LOG2  4
+#define FALLBACK_SL_COUNT (1U << FALLBACK_SL_LOG2)
+
+#define FALLBACK_SMALL_CHUNK_LOG2 (FALLBACK_SL_LOG2 + FALLBACK_CHUNK_ALIGN_LOG2)
+#define FALLBACK_SMALL_CHUNK_SIZE ((size_t)1 << FALLBACK_SMALL_CHUNK_LOG2)
+
+// Chunks need to be smaller than 2^(FALLBACK_MAX_CHUNK_LOG2 + 1) bytes.
+#define FALLBACK_MAX_CHUNK_LOG2 40
+#define FALLBACK_FL_COUNT                                                      \
+    (FALLBACK_MAX_CHUNK_LOG2 - FALLBACK_SMALL_CHUNK_LOG2 + 2)
+
+typedef uint64_t FallbackFlBitmap;
+typedef uint32_t FallbackSlBitmap;
+
+static_assert(FALLBACK_FL_COUNT <= sizeof(FallbackFlBitmap) * 8,
+              "every first level needs a bit in FallbackFlBitmap");
+static_assert(FALLBACK_SL_COUNT <= sizeof(FallbackSlBitmap) * 8,
+              "every second level needs a bit in FallbackSlBitmap");
+
+struct Falloc;
 
 struct FallbackAlloc {
-    struct FallbackChunk *chunk_llist_head;
-    struct FallbackRegion regions[FALLBACK_MAX_REGIONS];
-    size_t total_size;
+    // Bit i is set when sl_bitmaps[i] is non zero.
+    FallbackFlBitmap fl_bitmap;
+    // Bit j of sl_bitmaps[i] is set when free_lists[i][j] is non empty.
+    FallbackSlBitmap sl_bitmaps[FALLBACK_FL_COUNT];
+    struct FallbackChunk *free_lists[FALLBACK_FL_COUNT][FALLBACK_SL_COUNT];
+    struct FallbackRegion *regions;
+    size_t region_capacity;
     size_t region_count;
+    // Regions whose single chunk is free. Only one is kept as a warm spare,
+    // any other region is unmapped once it empties.
+    size_t empty_region_count;
+    size_t total_size;
+    struct FallbackGrowthPolicy growth_policy;
+    struct Falloc *owner;
 };
 
-struct FallbackAlloc fallback_allocator_create(size_t size);
+// The growth policy defaults to regions between size and
+// FALLBACK_DEFAULT_MAX_REGION_SIZE bytes. When the first region can't be
+// mapped the allocator starts out empty, and fallback_alloc() maps one when
+// it's first asked for memory.
+struct FallbackAlloc fallback_allocator_create(size_t size,
+                                               struct Falloc *owner);
 void fallback_allocator_destroy(struct FallbackAlloc *aloc);
+void fallback_allocator_set_growth_policy(struct FallbackAlloc *aloc,
+                                          struct FallbackGrowthPolicy policy);
 
 void *fallback_alloc(struct FallbackAlloc *aloc, size_t size);
 
+// The capacity fallback_alloc() hands out at least for size. The chunk can
+// still be bigger, when what would be left over is too small to be a chunk of
+// its own.
+static inline size_t fallback_good_size(size_t size) {
+    const size_t min_capacity =
+        FALLBACK_MIN_CHUNK_SIZE - sizeof(struct FallbackChunk);
+
+    size = fallback_align_up(size);
+
+    return size > min_capacity ? size : min_capacity;
+}
+
 enum FallbackSplitResult {
     FALLBACK_SPLIT_FAILURE = 0,
     FALLBACK_SPLIT_SUCCESS = 1
 };
-// split_size needs to be aligned by CHUNK_ALIGN.
+// Takes an unused chunk off the free lists and marks it used, with room for
+// split_size bytes. What is left over goes back on the free lists as a new
+// chunk, if it is big enough for one. split_size needs to be aligned by
+// CHUNK_ALIGN.
 enum FallbackSplitResult
-fallback_chunk_split_unused(struct FallbackChunk *chunk, size_t split_size);
+fallback_chunk_split_unused(struct FallbackAlloc *aloc,
+                            struct FallbackChunk *chunk, size_t split_size);
 
 void *fallback_realloc(struct FallbackAlloc *aloc, void *ptr, size_t size);
 void fallback_free(struct FallbackAlloc *aloc, void *ptr);
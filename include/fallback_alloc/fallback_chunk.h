@@ -1,22 +1,55 @@
 #ifndef FALLBACK_CHUNK_H
 #define FALLBACK_CHUNK_H
 
+#include "../integrity.h"
+
+#include <assert.h>
 #include <stdalign.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#define FALLBACK_CHUNK_ALIGN      (alignof(max_align_t))
+#define FALLBACK_CHUNK_ALIGN_LOG2 4
+
+static_assert(((size_t)1 << FALLBACK_CHUNK_ALIGN_LOG2) == FALLBACK_CHUNK_ALIGN,
+              "FALLBACK_CHUNK_ALIGN_LOG2 must match FALLBACK_CHUNK_ALIGN");
 
-#define FALLBACK_CHUNK_ALIGN (alignof(max_align_t))
+struct FallbackAlloc;
 
+// prev and next link the chunks that are next to each other in memory, which
+// are the boundary tags used to merge free chunks.
 struct FallbackChunk {
+#ifdef FALLOC_INTEGRITY_CHECKS
+    // The chunk's own address encoded with falloc_integrity_secret(). Anything
+    // running over the end of the previous chunk's data hits it first, and it
+    // shares a cache line with attr, which frees read anyway.
+    alignas(FALLBACK_CHUNK_ALIGN) uintptr_t canary;
+    // Last bit represents if the chunk is used
+    size_t attr;
+#else
     // Last bit represents if the chunk is used
     alignas(FALLBACK_CHUNK_ALIGN) size_t attr;
+#endif
     struct FallbackChunk *prev;
     struct FallbackChunk *next;
+    // The allocator the chunk was handed out by, set while the chunk is used.
+    struct FallbackAlloc *owner;
+};
+
+// Stored in the data of a free chunk, links it into its free list.
+struct FallbackFreeLinks {
+    struct FallbackChunk *prev_free;
+    struct FallbackChunk *next_free;
 };
 
 #define FALLBACK_MIN_CHUNK_SIZE                                                \
     (sizeof(struct FallbackChunk) + FALLBACK_CHUNK_ALIGN)
 
+static_assert(FALLBACK_MIN_CHUNK_SIZE - sizeof(struct FallbackChunk) >=
+                  sizeof(struct FallbackFreeLinks),
+              "a free chunk must fit its free list links");
+
 #define FALLBACK_CHUNK_USED_BIT  (0x1UL)
 #define FALLBACK_CHUNK_FLAG_BITS (FALLBACK_CHUNK_ALIGN - 1)
 #define FALLBACK_CHUNK_SIZE_BITS (~FALLBACK_CHUNK_FLAG_BITS)
@@ -25,6 +58,15 @@ static inline size_t fallback_align_up(size_t size) {
     return (size + FALLBACK_CHUNK_ALIGN - 1) & ~(FALLBACK_CHUNK_ALIGN - 1);
 }
 
+static inline struct FallbackChunk *fallback_chunk_from_ptr(void *ptr) {
+    return (struct FallbackChunk *)ptr - 1;
+}
+
+static inline struct FallbackFreeLinks *
+fallback_chunk_free_links(struct FallbackChunk *chunk) {
+    return (struct FallbackFreeLinks *)(chunk + 1);
+}
+
 static inline bool fallback_chunk_is_used(const struct FallbackChunk *chunk) {
     return (chunk->attr & FALLBACK_CHUNK_USED_BIT) != 0;
 }
@@ -42,6 +84,12 @@ static inline size_t fallback_chunk_size(const struct FallbackChunk *chunk) {
     return chunk->attr & FALLBACK_CHUNK_SIZE_BITS;
 }
 
+// What the data of a used chunk can hold.
+static inline size_t
+fallback_chunk_capacity(const struct FallbackChunk *chunk) {
+    return fallback_chunk_size(chunk) - sizeof(struct FallbackChunk);
+}
+
 static inline bool fallback_chunk_get_bit(const struct FallbackChunk *chunk,
                                           size_t bit) {
     return (chunk->attr & bit) != 0;
@@ -67,4 +115,23 @@ static inline void fallback_chunk_reset_flags(struct FallbackChunk *chunk) {
     chunk->attr &= ~FALLBACK_CHUNK_FLAG_BITS;
 }
 
+// Every new chunk header is sealed. Headers merged into a neighbour are part of
+// its data from then on and don't need to stay intact.
+static inline void fallback_chunk_seal(struct FallbackChunk *chunk) {
+#ifdef FALLOC_INTEGRITY_CHECKS
+    chunk->canary = (uintptr_t)chunk ^ falloc_integrity_secret();
+#else
+    (void)chunk;
+#endif
+}
+
+static inline bool fallback_chunk_is_intact(const struct FallbackChunk *chunk) {
+#ifdef FALLOC_INTEGRITY_CHECKS
+    return chunk->canary == ((uintptr_t)chunk ^ falloc_integrity_secret());
+#else
+    (void)chunk;
+    return true;
+#endif
+}
+
 #endif // FALLBACK_CHUNK_H
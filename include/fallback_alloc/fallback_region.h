@@ -3,13 +3,30 @@
 
 #include "fallback_chunk.h"
 
+#include "../os_allocator.h"
+
 #include <stddef.h>
 
+// Regions are mapped with the OS_TIER_FALLBACK_REGIONS page kind at the time,
+// and rounded up to its page size.
 struct FallbackRegion {
     struct FallbackChunk *begin;
     size_t size;
+    enum OsPageKind page_kind;
 };
 
-#define FALLBACK_MAX_REGIONS 64UL
+// The region table starts out this big and doubles whenever it fills up.
+#define FALLBACK_REGION_TABLE_INITIAL_CAPACITY 64UL
+
+// Upper bound on how big the growth policy makes new regions by default.
+#define FALLBACK_DEFAULT_MAX_REGION_SIZE ((size_t)64 * 1024 * 1024)
+
+// New regions are as big as the total size of the allocator so far, clamped
+// between min_region_size and max_region_size. A chunk that doesn't fit in that
+// still gets a region of its own, just big enough for it.
+struct FallbackGrowthPolicy {
+    size_t min_region_size;
+    size_t max_region_size;
+};
 
-#endif // FBCK_REGION_H
+#endif // FALLBACK_REGION_H
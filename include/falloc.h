@@ -3,27 +3,142 @@
 
 #include "rtree.h"
 #include "slab_alloc.h"
+#include "trace.h"
 
 #include "fallback_alloc/fallback_alloc.h"
 
 #include <stddef.h>
-
-#include <pthread.h>
+#include <stdint.h>
+#include <threads.h>
 
 struct Falloc {
     struct SlabAlloc slab_alloc;
     struct FallbackAlloc fallback_alloc;
-    struct Rtree rtree;
-    pthread_mutex_t lock;
-    size_t size;
-    void *stack[];
+    // Big allocations freed by other threads, linked through their first word.
+    // Pushed to without locking, drained all at once by the owning thread.
+    void *remote_big_frees;
+    // The same for small objects, which other threads push in whole batches.
+    void *remote_small_frees;
+};
+
+// Freed small objects go on per thread, per class lists first, linked through
+// their first word. falloc() pops from them without leaving the header.
+#define FALLOC_THREAD_CACHE_CAPACITY 64
+
+struct FallocThreadCache {
+    void *free_lists[SLAB_NUM_CLASSES];
+    uint32_t counts[SLAB_NUM_CLASSES];
 };
 
+extern thread_local struct FallocThreadCache falloc_thread_cache
+    __attribute__((tls_model("initial-exec")));
+
+// The same mapping as the slab allocator's lookup table, spelled out so that
+// it folds into a constant when size is one. Checked builds start at
+// SLAB_CHECKED_SIZE_MIN, see falloc_slow().
+static inline enum SlabSizeClass falloc_size_class(size_t size) {
+    if (size <= 32) {
+        if (FALLOC_CHECKS_ENABLED && size <= SLAB_CHECKED_SIZE_MIN) {
+            return SLAB_CLASS_16;
+        }
+
+        return size == 0 ? SLAB_CLASS_8 : (enum SlabSizeClass)((size - 1) / 8);
+    }
+
+    if (size <= 128) {
+        return (enum SlabSizeClass)(SLAB_CLASS_32 + ((size - 17) / 16));
+    }
+
+    return (enum SlabSizeClass)(SLAB_CLASS_128 + ((size - 97) / 32));
+}
+
 void finit(void);
-void *falloc(size_t size);
+// Everything falloc() can't serve from the thread cache.
+void *falloc_slow(size_t size);
 void ffree(void *ptr);
+// ffree() for callers that know the size, anything from what the object was
+// allocated with up to fmemsize(). Like C23's free_sized(), it only checks the
+// size, with an assert, and is no faster than ffree(): small frees never go
+// near the Rtree anyway, and big frees have to remove their entry either way.
+// It gives sized deallocation, such as falloc.hpp's, something to call.
+void ffree_sized(void *ptr, size_t size);
 void *frealloc(void *ptr, size_t size);
+// What the object can hold, which can be more than it was allocated with: the
+// class size of a small object, and the chunk capacity of a big one.
 size_t fmemsize(void *ptr);
+// Puts per CPU caches of small objects in front of the thread local heaps.
+// Returns false and leaves only the thread local heaps in place when the
+// platform doesn't support restartable sequences.
+bool falloc_enable_percpu_cache(void);
 struct Falloc *falloc_get_instance(void);
+// The Rtree of all big allocations, shared by every thread.
+struct Rtree *falloc_get_rtree(void);
+
+// falloc() without the trace hook, for falloc's own use.
+static inline void *falloc_untraced(size_t size) {
+    if (size <= SLAB_CLASS_MAX) {
+        enum SlabSizeClass class = falloc_size_class(size);
+        void *ptr = falloc_thread_cache.free_lists[class];
+
+        if (ptr) {
+            falloc_thread_cache.free_lists[class] = *(void **)ptr;
+            --falloc_thread_cache.counts[class];
+
+            if (FALLOC_CHECKS_ENABLED) {
+                slab_clear_freed_mark(ptr);
+            }
+
+            return ptr;
+        }
+    }
+
+    return falloc_slow(size);
+}
+
+static inline void *falloc(size_t size) {
+    void *ptr = falloc_untraced(size);
+
+    if (FALLOC_TRACE_ENABLED) {
+        falloc_trace_alloc(ptr, size);
+    }
+
+    return ptr;
+}
+
+// What falloc(size) serves, from the size classes and the fallback chunk
+// alignment, without allocating. A big object can end up with a little more,
+// see falloc_at_least().
+static inline size_t fgood_size(size_t size) {
+    if (size <= SLAB_CLASS_MAX) {
+        return SLAB_SIZES[falloc_size_class(size)];
+    }
+
+    return fallback_good_size(size);
+}
+
+// falloc(), which also writes how much the object can actually hold to
+// out_actual, so growing buffers can use the slack instead of reallocating.
+// Writes 0 when the allocation fails.
+static inline void *falloc_at_least(size_t size, size_t *out_actual) {
+    void *ptr = falloc(size);
+
+    if (!ptr) {
+        *out_actual = 0;
+    } else if (size <= SLAB_CLASS_MAX) {
+        *out_actual = SLAB_SIZES[falloc_size_class(size)];
+    } else {
+        *out_actual = fallback_chunk_capacity(fallback_chunk_from_ptr(ptr));
+    }
+
+    return ptr;
+}
+
+// The inline functions above as real ones, for code that can't include this
+// header, such as falloc.hpp.
+void *falloc_noinline(size_t size);
+void *falloc_at_least_noinline(size_t size, size_t *out_actual);
+size_t fgood_size_noinline(size_t size);
+
+#define FALLOC_NEW(T) ((T *)falloc(sizeof(T)))
 
 #endif // FAST_ALLOC_GLOBAL_WRAPPER_H
@@ -0,0 +1,250 @@
+#ifndef FALLOC_HPP
+#define FALLOC_HPP
+
+// Header only C++ adapters: falloc::memory_resource for std::pmr containers,
+// the stateless falloc::allocator<T> for the others, and falloc::heap_resource,
+// a std::pmr resource with a heap of its own. Every deallocation passes the
+// size it knows on to ffree_sized(), which checks it in debug builds.
+//
+// falloc.h itself isn't valid C++, so the few functions needed are declared
+// here.
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+
+extern "C" {
+#include "fallback_alloc/fallback_alloc.h"
+
+void *falloc_noinline(std::size_t size);
+void *falloc_at_least_noinline(std::size_t size, std::size_t *out_actual);
+std::size_t fgood_size_noinline(std::size_t size);
+void ffree_sized(void *ptr, std::size_t size);
+}
+
+namespace falloc {
+
+namespace detail {
+
+// SLAB_CLASS_MAX and SLAB_COLOR_STEP of slab_alloc.h. A slab object whose
+// class size is a multiple of an alignment up to slab_max_align is aligned to
+// it, and every class size above 128 is a multiple of 32.
+inline constexpr std::size_t slab_class_max = 1024;
+inline constexpr std::size_t slab_max_align = 64;
+inline constexpr std::size_t big_max_align = FALLBACK_CHUNK_ALIGN;
+
+inline constexpr std::size_t align_up(std::size_t size, std::size_t align) {
+    return (size + align - 1) & ~(align - 1);
+}
+
+// Whether falloc() aligns objects of size to align by itself. Otherwise the
+// object is allocated with align bytes to spare, see align_past().
+inline constexpr bool is_naturally_aligned(std::size_t size,
+                                           std::size_t align) {
+    return align <= big_max_align ||
+           (align <= slab_max_align && size <= slab_class_max);
+}
+
+// The first address aligned to align after raw, with raw stored right in front
+// of it. raw is at least 16 byte aligned and align at least 32, so there is
+// always room.
+inline void *align_past(void *raw, std::size_t align) {
+    auto addr = reinterpret_cast<std::uintptr_t>(raw);
+    auto *ptr = reinterpret_cast<void **>(align_up(addr + 1, align));
+    ptr[-1] = raw;
+
+    return ptr;
+}
+
+inline void *raw_of(void *ptr) {
+    return static_cast<void **>(ptr)[-1];
+}
+
+inline void *allocate(std::size_t bytes, std::size_t align,
+                      std::size_t *out_actual = nullptr) {
+    std::size_t size = align_up(bytes, align);
+
+    if (is_naturally_aligned(size, align)) {
+        std::size_t actual = 0;
+        void *ptr = falloc_at_least_noinline(size, &actual);
+
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+
+        if (out_actual) {
+            *out_actual = actual;
+        }
+
+        return ptr;
+    }
+
+    void *raw = falloc_noinline(size + align);
+
+    if (!raw) {
+        throw std::bad_alloc();
+    }
+
+    if (out_actual) {
+        *out_actual = size;
+    }
+
+    return align_past(raw, align);
+}
+
+// bytes can be anything from what was asked for up to what was handed out.
+inline void deallocate(void *ptr, std::size_t bytes, std::size_t align) {
+    std::size_t size = align_up(bytes, align);
+
+    if (is_naturally_aligned(size, align)) {
+        ffree_sized(ptr, size);
+        return;
+    }
+
+    ffree_sized(raw_of(ptr), size + align);
+}
+
+} // namespace detail
+
+// Stateless, so all of them are interchangeable and any one can free what
+// another one allocated.
+class memory_resource : public std::pmr::memory_resource {
+  protected:
+    void *do_allocate(std::size_t bytes, std::size_t align) override {
+        return detail::allocate(bytes, align);
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes,
+                       std::size_t align) override {
+        detail::deallocate(ptr, bytes, align);
+    }
+
+    bool do_is_equal(
+        const std::pmr::memory_resource &other) const noexcept override {
+        return dynamic_cast<const memory_resource *>(&other) != nullptr;
+    }
+};
+
+inline memory_resource *get_memory_resource() noexcept {
+    static memory_resource resource;
+    return &resource;
+}
+
+template <typename T> class allocator {
+  public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using propagate_on_container_move_assignment = std::true_type;
+    using is_always_equal = std::true_type;
+
+    allocator() noexcept = default;
+
+    template <typename U>
+    // NOLINTNEXTLINE(google-explicit-constructor)
+    allocator(const allocator<U> & /*other*/) noexcept {}
+
+    [[nodiscard]] T *allocate(std::size_t count) {
+        if (count > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+
+        void *ptr = detail::allocate(count * sizeof(T), alignof(T));
+
+        return static_cast<T *>(ptr);
+    }
+
+#if defined(__cpp_lib_allocate_at_least)
+    [[nodiscard]] std::allocation_result<T *> allocate_at_least(
+        std::size_t count) {
+        if (count > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+
+        std::size_t actual = 0;
+        void *ptr = detail::allocate(count * sizeof(T), alignof(T), &actual);
+
+        return {static_cast<T *>(ptr), actual / sizeof(T)};
+    }
+#endif
+
+    void deallocate(T *ptr, std::size_t count) noexcept {
+        detail::deallocate(ptr, count * sizeof(T), alignof(T));
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const allocator<T> & /*lhs*/,
+                const allocator<U> & /*rhs*/) noexcept {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const allocator<T> & /*lhs*/,
+                const allocator<U> & /*rhs*/) noexcept {
+    return false;
+}
+
+// A heap of its own, which gives all of its memory back when it's destroyed,
+// whatever is still allocated. Like std::pmr::unsynchronized_pool_resource,
+// it's only ever used by one thread at a time.
+class heap_resource : public std::pmr::memory_resource {
+  public:
+    static constexpr std::size_t default_initial_size = 1024 * 1024;
+
+    explicit heap_resource(std::size_t initial_size = default_initial_size)
+        : heap_(fallback_allocator_create(initial_size, nullptr)) {}
+
+    heap_resource(const heap_resource &) = delete;
+    heap_resource &operator=(const heap_resource &) = delete;
+
+    ~heap_resource() override { fallback_allocator_destroy(&heap_); }
+
+  protected:
+    void *do_allocate(std::size_t bytes, std::size_t align) override {
+        // fallback_alloc() takes no zero sizes.
+        std::size_t size = detail::align_up(bytes == 0 ? 1 : bytes, align);
+
+        if (align <= detail::big_max_align) {
+            return checked(fallback_alloc(&heap_, size));
+        }
+
+        void *raw = checked(fallback_alloc(&heap_, size + align));
+
+        return detail::align_past(raw, align);
+    }
+
+    // The chunk header has the size, so there is nothing to look up either
+    // way.
+    void do_deallocate(void *ptr, std::size_t /*bytes*/,
+                       std::size_t align) override {
+        if (align > detail::big_max_align) {
+            ptr = detail::raw_of(ptr);
+        }
+
+        fallback_free(&heap_, ptr);
+    }
+
+    bool do_is_equal(
+        const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+  private:
+    static void *checked(void *ptr) {
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+
+        return ptr;
+    }
+
+    FallbackAlloc heap_;
+};
+
+} // namespace falloc
+
+#endif // FALLOC_HPP
@@ -0,0 +1,56 @@
+#ifndef FCACHE_H
+#define FCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Caches of objects of one exact size, after the kmem_cache model. Their slabs
+// are laid out for the cache's own size instead of the size class above it,
+// and an object is constructed only the first time it's handed out. Freed
+// objects have to go back in their constructed state, and are handed out
+// again as they are. A cache can be used from any thread.
+//
+// The objects live in slab arena spans like any other slab object, but only
+// fcache_free() takes them back. ffree() and frealloc() report them through
+// falloc_report_corruption() as foreign frees and leave them alone, and
+// fmemsize() returns 0 for them.
+
+// Sizes above this go to falloc() instead.
+#define FCACHE_MAX_SIZE  1024
+#define FCACHE_MAX_ALIGN 4096
+// Longer names are cut short.
+#define FCACHE_NAME_SIZE 32
+
+typedef void (*FcacheCtor)(void *obj);
+
+struct Fcache;
+
+struct FcacheStats {
+    const char *name;
+    size_t object_size;
+    // The size rounded up to the alignment, which is what an object takes up.
+    size_t stride;
+    size_t objects_per_slab;
+    size_t slab_count;
+    size_t live_count;
+    uint64_t alloc_count;
+    uint64_t free_count;
+    // Constructor calls. Every other allocation reused a constructed object.
+    uint64_t constructed_count;
+};
+
+// align has to be a power of 2 up to FCACHE_MAX_ALIGN, or 0 for the largest
+// power of 2 dividing size, up to 16. ctor can be null. Sets errno to EINVAL
+// and returns null when size or align is out of range.
+struct Fcache *fcache_create(const char *name, size_t size, size_t align,
+                             FcacheCtor ctor);
+// Every object of the cache goes with it, freed or not.
+void fcache_destroy(struct Fcache *cache);
+
+// Returns null when no memory is left for a new slab.
+void *fcache_alloc(struct Fcache *cache);
+void fcache_free(struct Fcache *cache, void *ptr);
+
+struct FcacheStats fcache_stats(struct Fcache *cache);
+
+#endif // FCACHE_H
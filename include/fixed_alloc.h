@@ -1,43 +1,88 @@
 #ifndef FIXED_ALLOC_H
 #define FIXED_ALLOC_H
 
-#include "stack_declaration.h"
-
 #include "os_allocator.h"
+#include "slab_arena.h"
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-typedef void *FixedAllocCacheElem;
-typedef size_t FixedAllocCacheSizeType;
-
-STACK_DECLARE(FixedAllocCacheElem, FixedAllocCacheSizeType, FixedAllocCache)
-
 #define SLAB_SIZE                  ((size_t)(8 * OS_ALLOC_PAGE_SIZE))
 #define FIXED_ALLOC_BLOCK_CAPACITY 64
 
+// Each new block is twice the size of the previous one, up to this size. With
+// FIXED_ALLOC_BLOCK_CAPACITY blocks, that caps an allocator at about 4 GB.
+#define FIXED_ALLOC_MAX_BLOCK_SIZE ((size_t)(0x4000 * OS_ALLOC_PAGE_SIZE))
+
+// A free unit holds the link to the next free unit, so no unit can be smaller
+// than the link. Smaller unit sizes are rounded up to this.
+#define FIXED_ALLOC_MIN_UNIT_SIZE (sizeof(struct FixedAllocFreeUnit))
+
+struct FixedAllocFreeUnit {
+    struct FixedAllocFreeUnit *next;
+};
+
+// Memory is committed in steps of this size (or of one unit, if bigger) as
+// the bump offset advances.
+#define FIXED_ALLOC_COMMIT_SIZE ((size_t)(0x40 * OS_ALLOC_PAGE_SIZE))
+
+// A block is reserved aligned to the unit size, so all of it is usable for
+// units. Only the first committed_size bytes are backed by memory. Blocks on
+// huge pages are committed a whole huge page at a time, so the faults can
+// actually get one.
 struct FixedAllocBlock {
-    void *os_allocated_mem;
-    void *aligned_up_mem;
-    size_t os_allocated_size;
+    void *mem;
+    enum OsPageKind page_kind;
+    size_t size;
+    size_t committed_size;
     size_t offset;
     size_t unit_size;
-    struct FixedAllocCache cache;
+    size_t capacity;
+    size_t live_count;
+    struct FixedAllocFreeUnit *free_list;
 };
 
+typedef uint64_t FixedAllocBlockMask;
+
+static_assert(FIXED_ALLOC_BLOCK_CAPACITY <= sizeof(FixedAllocBlockMask) * 8,
+              "every block needs a bit in FixedAllocBlockMask");
+
 struct FixedAllocator {
     uint32_t block_count;
     uint32_t unit_size;
+    // Bit i is set when blocks[i] has room for at least one more unit.
+    FixedAllocBlockMask non_full_blocks;
+    // Bit i is set when blocks[i] has no live units. At most one empty block is
+    // kept around, any other block is given back to the OS once it empties.
+    FixedAllocBlockMask empty_blocks;
+    size_t next_block_size;
+    // Indices into blocks, sorted by block address, so the block owning a
+    // pointer can be binary searched.
+    uint8_t blocks_by_addr[FIXED_ALLOC_BLOCK_CAPACITY];
     struct FixedAllocBlock *blocks;
+    // Blocks come from here when set, and straight from the OS otherwise.
+    struct SlabArena *arena;
 };
 
 void *align_up_to_block_size(const void *ptr);
 void *align_down_to_slab_size(const void *ptr);
-// unit_size must be a power of 2.
+// unit_size must be a power of 2. Sizes below FIXED_ALLOC_MIN_UNIT_SIZE are
+// rounded up to it.
 struct FixedAllocator fixed_alloc_init(size_t unit_size);
+// Like fixed_alloc_init(), with every block carved out of arena. unit_size
+// can't be bigger than SLAB_ARENA_ALIGN.
+struct FixedAllocator fixed_alloc_init_in_arena(size_t unit_size,
+                                                struct SlabArena *arena);
 void fixed_alloc_deinit(struct FixedAllocator *fixed_alloc);
+// Returns null with errno set to ENOMEM once all FIXED_ALLOC_BLOCK_CAPACITY
+// blocks are full, or when a new block can't be reserved or the pages for the
+// unit can't be committed.
 void *fixed_alloc(struct FixedAllocator *fixed_alloc);
 void fixed_free(struct FixedAllocator *fixed_alloc, void *ptr);
+// Whether ptr lies in one of the blocks of fixed_alloc.
+bool fixed_alloc_owns(const struct FixedAllocator *fixed_alloc,
+                      const void *ptr);
 
 #endif // FIXED_ALLOC_H
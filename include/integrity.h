@@ -0,0 +1,53 @@
+#ifndef INTEGRITY_H
+#define INTEGRITY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Built with FALLOC_INTEGRITY_CHECKS, frees are checked against the metadata
+// the allocators already keep. Checks are written as
+// if (FALLOC_CHECKS_ENABLED && ...), so they compile away without it.
+//
+// The checks are cheap enough to leave on in production. Small frees still go
+// through the thread and per CPU caches, whose objects are marked freed
+// instead of going back to their slab, see slab_mark_freed().
+#ifdef FALLOC_INTEGRITY_CHECKS
+#define FALLOC_CHECKS_ENABLED true
+#else
+#define FALLOC_CHECKS_ENABLED false
+#endif
+
+enum FallocCorruption {
+    // The object was already freed.
+    FALLOC_CORRUPTION_DOUBLE_FREE,
+    // The pointer is inside a slab, but not at the start of an object.
+    FALLOC_CORRUPTION_MISALIGNED_FREE,
+    // The pointer was never handed out by falloc.
+    FALLOC_CORRUPTION_FOREIGN_FREE,
+    // A fallback chunk header was overwritten.
+    FALLOC_CORRUPTION_CHUNK_HEADER,
+};
+
+typedef void (*FallocCorruptionHandler)(enum FallocCorruption corruption,
+                                        void *ptr);
+
+// The default handler prints what was found and aborts. If a handler returns,
+// the operation that found the corruption leaves the pointer alone. Passing
+// null restores the default.
+void falloc_set_corruption_handler(FallocCorruptionHandler handler);
+void falloc_report_corruption(enum FallocCorruption corruption, void *ptr);
+
+// Zero until falloc_integrity_secret() first picks it, which finit() does, so
+// inline checks that only run after finit() can read it directly.
+extern uintptr_t falloc_secret;
+uintptr_t falloc_integrity_secret_slow(void);
+
+// Random, picked once per process. Fallback chunk canaries and the freed marks
+// of small objects are encoded with it.
+static inline uintptr_t falloc_integrity_secret(void) {
+    uintptr_t secret = __atomic_load_n(&falloc_secret, __ATOMIC_RELAXED);
+
+    return secret ? secret : falloc_integrity_secret_slow();
+}
+
+#endif // INTEGRITY_H
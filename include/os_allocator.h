@@ -4,6 +4,7 @@
 #include <sys/mman.h>
 
 #include <stddef.h>
+#include <stdint.h>
 
 #define OS_ALLOC_PAGE_SIZE 0x1000
 
@@ -19,6 +20,77 @@ static inline void *os_alloc(size_t size) {
     return ptr;
 }
 
+// Reserves address space only, nothing is committed until os_commit(). Sets
+// errno and returns null on error.
+static inline void *os_reserve(size_t size) {
+    void *ptr = mmap(NULL, size, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+
+    return ptr;
+}
+
+// Unmaps everything in the reserved_size bytes at mem except for the size bytes
+// starting at the first multiple of alignment, and returns those. mem must come
+// from a single mapping with room for them.
+static inline void *os_trim_to_aligned(void *mem, size_t reserved_size,
+                                       size_t size, size_t alignment) {
+    uint8_t *begin = (uint8_t *)mem;
+    uint8_t *aligned =
+        (uint8_t *)(((uintptr_t)begin + alignment - 1) & ~(alignment - 1));
+    size_t head_size = aligned - begin;
+    size_t tail_size = reserved_size - head_size - size;
+
+    // Both ranges are page aligned parts of the same mapping, so munmap can't
+    // fail on them.
+    if (head_size != 0) {
+        (void)munmap(begin, head_size);
+    }
+
+    if (tail_size != 0) {
+        (void)munmap(aligned + size, tail_size);
+    }
+
+    return aligned;
+}
+
+// Like os_reserve(), but the returned range starts at a multiple of alignment.
+// Reserves size + alignment and unmaps the unaligned head and the tail, so
+// exactly size bytes stay reserved. alignment must be a power of 2 and size a
+// multiple of OS_ALLOC_PAGE_SIZE.
+static inline void *os_reserve_aligned(size_t size, size_t alignment) {
+    if (alignment <= OS_ALLOC_PAGE_SIZE) {
+        return os_reserve(size);
+    }
+
+    size_t reserved_size = size + alignment - OS_ALLOC_PAGE_SIZE;
+    void *mem = os_reserve(reserved_size);
+
+    if (!mem) {
+        return NULL;
+    }
+
+    return os_trim_to_aligned(mem, reserved_size, size, alignment);
+}
+
+#define OS_COMMIT_OK   0
+#define OS_COMMIT_FAIL 1
+
+// Makes reserved memory usable. ptr and size must be page aligned. Returns
+// error code from mprotect, sets errno on error.
+static inline int os_commit(void *ptr, size_t size) {
+    int ret = mprotect(ptr, size, PROT_READ | PROT_WRITE);
+
+    if (ret == -1) {
+        return OS_COMMIT_FAIL;
+    }
+
+    return OS_COMMIT_OK;
+}
+
 #define OS_FREE_OK   0
 #define OS_FREE_FAIL 1
 
@@ -33,4 +105,85 @@ static inline int os_free(void *ptr, size_t size) {
     return OS_FREE_OK;
 }
 
+// Huge pages
+
+#define OS_HUGE_PAGE_SIZE ((size_t)(0x200 * OS_ALLOC_PAGE_SIZE))
+
+enum OsPageKind {
+    OS_PAGES_SMALL = 0,
+    // 2 MB aligned and madvise(MADV_HUGEPAGE)d. The kernel backs the range with
+    // huge pages where it can, and silently with small ones where it can't.
+    OS_PAGES_TRANSPARENT_HUGE,
+    // MAP_HUGETLB, backed by the reserved hugetlbfs pool. Falls back to
+    // OS_PAGES_TRANSPARENT_HUGE when the pool is empty.
+    OS_PAGES_HUGETLB,
+};
+
+// The kinds of memory the allocator maps, each with its own page kind.
+enum OsTier {
+    // The FixedAllocator blocks slabs are carved out of.
+    OS_TIER_SLAB_BLOCKS = 0,
+    // The regions of the fallback allocator.
+    OS_TIER_FALLBACK_REGIONS,
+    // The Rtree root.
+    OS_TIER_METADATA,
+    OS_TIER_COUNT,
+};
+
+// Every tier starts out with OS_PAGES_SMALL. A new kind only applies to memory
+// mapped after the call.
+void os_set_tier_page_kind(enum OsTier tier, enum OsPageKind kind);
+enum OsPageKind os_tier_page_kind(enum OsTier tier);
+
+// Rounds size up to what os_alloc_pages() maps for kind. Small pages leave the
+// size as is, mmap rounds those itself.
+static inline size_t os_pages_size(size_t size, enum OsPageKind kind) {
+    if (kind == OS_PAGES_SMALL) {
+        return size;
+    }
+
+    return (size + OS_HUGE_PAGE_SIZE - 1) & ~(OS_HUGE_PAGE_SIZE - 1);
+}
+
+// Maps os_pages_size(size, kind) read/write bytes. Huge kinds are aligned to
+// OS_HUGE_PAGE_SIZE. The kind the memory actually got is written to out_kind,
+// and needs to be passed back to os_free_pages(). Sets errno and returns null
+// on error.
+void *os_alloc_pages(size_t size, enum OsPageKind kind,
+                     enum OsPageKind *out_kind);
+
+// Like os_reserve_aligned(), for memory committed piece by piece with
+// os_commit(). Faults in a hugetlb range can't fall back once the pool runs
+// dry, so OS_PAGES_HUGETLB gets transparent huge pages here. Sizes that aren't
+// a multiple of OS_HUGE_PAGE_SIZE always get small pages.
+void *os_reserve_pages(size_t size, size_t alignment, enum OsPageKind kind,
+                       enum OsPageKind *out_kind);
+
+// Applies kind to a range that is already reserved, for carving reservations
+// up further. Follows the same rules as os_reserve_pages() and returns the kind
+// the range got. ptr needs to be aligned to OS_HUGE_PAGE_SIZE for a huge kind.
+enum OsPageKind os_advise_pages(void *ptr, size_t size, enum OsPageKind kind);
+
+// Returns OS_FREE_OK or OS_FREE_FAIL like os_free().
+int os_free_pages(void *ptr, size_t size, enum OsPageKind kind);
+
+// Drops the memory behind a range and leaves it reserved, as it was before
+// os_commit() and os_advise_pages(). Returns OS_FREE_OK or OS_FREE_FAIL.
+int os_decommit_pages(void *ptr, size_t size, enum OsPageKind kind);
+
+struct OsHugePageStats {
+    // Bytes currently mapped from the hugetlbfs pool.
+    size_t hugetlb_bytes;
+    // OS_PAGES_HUGETLB requests that fell back to transparent huge pages.
+    size_t hugetlb_fallback_count;
+    // Bytes currently mapped with MADV_HUGEPAGE.
+    size_t thp_advised_bytes;
+    // Anonymous memory of the whole process the kernel actually backs with
+    // transparent huge pages, from /proc/self/smaps_rollup. 0 if that can't be
+    // read.
+    size_t thp_backed_bytes;
+};
+
+struct OsHugePageStats os_huge_page_stats(void);
+
 #endif // OS_ALLOCATOR_H
@@ -0,0 +1,32 @@
+#ifndef PERCPU_CACHE_H
+#define PERCPU_CACHE_H
+
+#include "slab_alloc.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Small objects freed on a CPU are cached for that CPU, up to this many per
+// size class.
+#define PERCPU_CACHE_CLASS_CAPACITY 32
+
+// One size class of one CPU. Only ever changed inside a restartable sequence
+// on that CPU, so no locking or atomics are needed.
+struct PercpuClassCache {
+    size_t count;
+    void *slots[PERCPU_CACHE_CLASS_CAPACITY];
+};
+
+// Sets up the caches for every configured CPU. Returns false when restartable
+// sequences aren't available, either because the kernel or libc doesn't
+// provide them or because this isn't an x86-64 build. Safe to call more than
+// once.
+bool percpu_cache_init(void);
+bool percpu_cache_is_enabled(void);
+
+// Both return false or null when the current CPU's cache for the class is full
+// or empty, and the caller goes to the thread local heap instead.
+bool percpu_cache_push(enum SlabSizeClass class, void *ptr);
+void *percpu_cache_pop(enum SlabSizeClass class);
+
+#endif // PERCPU_CACHE_H
@@ -1,34 +1,67 @@
 #ifndef RTREE_H
 #define RTREE_H
 
-#include "fixed_alloc.h"
+#include "os_allocator.h"
 
+#include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-#define RTREE_DEPTH (sizeof(void *))
+// Only the low 48 bits of a pointer are used as the key, the top bits are the
+// same for every user space address. The low RTREE_GRANULE_BITS are not used
+// for indexing either, so two keys stored at the same time need to be at least
+// RTREE_GRANULE_SIZE bytes apart. The dropped low bits are kept in the leaf, so
+// lookups are still exact.
+#define RTREE_KEY_BITS     48
+#define RTREE_GRANULE_BITS 10
+#define RTREE_ROOT_BITS    14
+#define RTREE_NODE_BITS    12
+
+#define RTREE_GRANULE_SIZE ((size_t)1 << RTREE_GRANULE_BITS)
+#define RTREE_ROOT_ENTRIES ((size_t)1 << RTREE_ROOT_BITS)
+#define RTREE_NODE_ENTRIES ((size_t)1 << RTREE_NODE_BITS)
+
+// The largest size that can be stored in a leaf.
+#define RTREE_MAX_SIZE (SIZE_MAX >> RTREE_GRANULE_BITS)
+
+static_assert(RTREE_GRANULE_BITS + RTREE_ROOT_BITS + (2 * RTREE_NODE_BITS) ==
+                  RTREE_KEY_BITS,
+              "Rtree levels must cover all the key bits");
+
+// A leaf holds the stored size shifted by RTREE_GRANULE_BITS, with the low
+// bits of the key in the freed up bits. An empty leaf is 0.
+typedef size_t RtreeLeaf;
 
 union RtreeEntry {
     struct RtreeNode *next;
-    size_t *leaf;
+    RtreeLeaf leaf;
 };
 
+// Both the interior and the last level nodes are a power of 2 in size.
 struct RtreeNode {
-    size_t node_count;
-    union RtreeEntry entries[UINT8_MAX + 1];
+    union RtreeEntry entries[RTREE_NODE_ENTRIES];
 };
 
+// A single Rtree can be shared by all threads without locking. Missing nodes
+// are installed with a CAS, and every key is only ever pushed or removed by
+// one thread at a time, so leaves are plain atomic stores.
 struct Rtree {
-    struct RtreeNode *head;
-    struct FixedAllocator node_allocator;
-    struct FixedAllocator leaf_allocator;
+    // RTREE_ROOT_ENTRIES pointers, mapped once and committed by the OS as they
+    // get touched. Uses the OS_TIER_METADATA page kind.
+    struct RtreeNode **root;
+    enum OsPageKind root_page_kind;
 };
 
 struct Rtree rtree_init(void);
 void rtree_deinit(struct Rtree *rtree);
+// allocated_size must be non zero and not greater than RTREE_MAX_SIZE.
 void rtree_push_ptr(struct Rtree *rtree, void *ptr, size_t allocated_size);
 void rtree_remove_ptr(struct Rtree *rtree, void *ptr, size_t *out_stored_leaf);
+// rtree_remove_ptr() for pointers that might not be in the tree. Returns false
+// and changes nothing when ptr isn't.
+bool rtree_remove_ptr_if_contains(struct Rtree *rtree, void *ptr,
+                                  size_t *out_stored_leaf);
 bool rtree_contains(struct Rtree *rtree, void *ptr);
 bool rtree_retrieve_size_if_contains(struct Rtree *rtree, void *ptr,
                                      size_t *out);
@@ -3,10 +3,12 @@
 
 #include "bitmap.h"
 #include "fixed_alloc.h"
+#include "integrity.h"
 #include "stack_declaration.h"
 
 #include <pthread.h>
 
+#include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -119,6 +121,50 @@ static const float SLAB_SIZE_CLASS_RECIPROCALS[SLAB_NUM_CLASSES] = {
     [SLAB_CLASS_1024] = 1.0F / (float)SLAB_SIZES[SLAB_CLASS_1024],
 };
 
+// ceil(2^32 / size). An offset within a slab is a multiple of the size exactly
+// when the low 32 bits of offset * SLAB_SIZE_CLASS_DIVISIBILITY[class] are
+// below SLAB_SIZE_CLASS_DIVISIBILITY[class].
+static const uint32_t SLAB_SIZE_CLASS_DIVISIBILITY[SLAB_NUM_CLASSES] = {
+    [SLAB_CLASS_8] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_8]) + 1,
+    [SLAB_CLASS_16] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_16]) + 1,
+    [SLAB_CLASS_24] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_24]) + 1,
+    [SLAB_CLASS_32] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_32]) + 1,
+    [SLAB_CLASS_48] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_48]) + 1,
+    [SLAB_CLASS_64] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_64]) + 1,
+    [SLAB_CLASS_80] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_80]) + 1,
+    [SLAB_CLASS_96] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_96]) + 1,
+    [SLAB_CLASS_112] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_112]) + 1,
+    [SLAB_CLASS_128] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_128]) + 1,
+    [SLAB_CLASS_160] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_160]) + 1,
+    [SLAB_CLASS_192] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_192]) + 1,
+    [SLAB_CLASS_224] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_224]) + 1,
+    [SLAB_CLASS_256] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_256]) + 1,
+    [SLAB_CLASS_288] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_288]) + 1,
+    [SLAB_CLASS_320] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_320]) + 1,
+    [SLAB_CLASS_352] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_352]) + 1,
+    [SLAB_CLASS_384] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_384]) + 1,
+    [SLAB_CLASS_416] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_416]) + 1,
+    [SLAB_CLASS_448] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_448]) + 1,
+    [SLAB_CLASS_480] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_480]) + 1,
+    [SLAB_CLASS_512] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_512]) + 1,
+    [SLAB_CLASS_544] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_544]) + 1,
+    [SLAB_CLASS_576] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_576]) + 1,
+    [SLAB_CLASS_608] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_608]) + 1,
+    [SLAB_CLASS_640] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_640]) + 1,
+    [SLAB_CLASS_672] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_672]) + 1,
+    [SLAB_CLASS_704] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_704]) + 1,
+    [SLAB_CLASS_736] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_736]) + 1,
+    [SLAB_CLASS_768] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_768]) + 1,
+    [SLAB_CLASS_800] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_800]) + 1,
+    [SLAB_CLASS_832] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_832]) + 1,
+    [SLAB_CLASS_864] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_864]) + 1,
+    [SLAB_CLASS_896] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_896]) + 1,
+    [SLAB_CLASS_928] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_928]) + 1,
+    [SLAB_CLASS_960] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_960]) + 1,
+    [SLAB_CLASS_992] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_992]) + 1,
+    [SLAB_CLASS_1024] = (UINT32_MAX / SLAB_SIZES[SLAB_CLASS_1024]) + 1,
+};
+
 struct SlabAlloc;
 
 typedef uint32_t CacheOffset;
@@ -140,11 +186,51 @@ struct Slab {
     struct SlabAlloc *owner;
 };
 
+// Slabs are colored, so that the headers and the first objects of all slabs
+// don't pile up in the same few cache sets. The color of a span comes from its
+// index, its objects start that many SLAB_COLOR_STEPs into it, and its header
+// ends SLAB_COLOR_COUNT - 1 - color steps before its end. Either way a slab
+// gives up the same SLAB_COLOR_SPACE bytes.
+#define SLAB_COLOR_COUNT 8
+#define SLAB_COLOR_STEP  64
+#define SLAB_COLOR_SPACE ((SLAB_COLOR_COUNT - 1) * SLAB_COLOR_STEP)
+
+// The header starts on a cache line of its own, so everything a free reads from
+// it is on that one line.
+#define SLAB_HEADER_SIZE                                                       \
+    ((sizeof(struct Slab) + SLAB_COLOR_STEP - 1) & ~(SLAB_COLOR_STEP - 1))
+
+static_assert((SLAB_COLOR_COUNT & (SLAB_COLOR_COUNT - 1)) == 0,
+              "the color is masked out of the span index");
+static_assert(offsetof(struct Slab, next_slab) <= SLAB_COLOR_STEP,
+              "the fields a free reads have to share a cache line");
+
+static inline uint32_t slab_color(const void *span) {
+    return (uint32_t)((uintptr_t)span / SLAB_SIZE) & (SLAB_COLOR_COUNT - 1);
+}
+
+static inline uint8_t *slab_objects_in_span(void *span) {
+    return (uint8_t *)span + ((size_t)slab_color(span) * SLAB_COLOR_STEP);
+}
+
+static inline struct Slab *slab_header_in_span(void *span) {
+    size_t tail_steps = SLAB_COLOR_COUNT - 1 - slab_color(span);
+
+    return (struct Slab *)((uint8_t *)span + SLAB_SIZE - SLAB_HEADER_SIZE -
+                           (tail_steps * SLAB_COLOR_STEP));
+}
+
 struct Falloc;
 
+// Empty spans a heap keeps for itself before handing them to the pool shared by
+// all heaps.
+#define SLAB_SPARE_SPAN_CAPACITY 4
+
 struct SlabAlloc {
     struct Slab *slabs[SLAB_NUM_CLASSES];
     struct FixedAllocator fixed_alloc;
+    void *spare_spans[SLAB_SPARE_SPAN_CAPACITY];
+    uint32_t spare_span_count;
     struct Falloc *owner;
 };
 
@@ -152,17 +238,85 @@ struct Slab *slab_from_ptr(void *ptr);
 bool slab_alloc_is_ptr_in_this_instance(const struct SlabAlloc *alloc,
                                         void *ptr);
 
+// size can't be bigger than SLAB_CLASS_MAX. Only valid once a SlabAlloc was
+// initialized.
+enum SlabSizeClass slab_size_class(size_t size);
+
 struct SlabAlloc slab_alloc_init(struct Falloc *owner);
+// Spans of alloc that are pooled or used by other heaps are unmapped as well,
+// so this is only safe once no other heap is running.
 void slab_alloc_deinit(struct SlabAlloc *alloc);
 void *slab_alloc(struct SlabAlloc *alloc, size_t size);
 
 enum FaFreeRet {
     OK,
     PTR_NOT_OWNED_BY_PASSED_ALLOCATOR_INSTANCE,
+    // Only with FALLOC_INTEGRITY_CHECKS, the pointer was reported and left
+    // alone.
+    CORRUPTION_DETECTED,
 };
 
+// Checks ptr is the start of one of the slab's objects. Only reads the slab
+// header fields on the cache line a free reads anyway. Reports through
+// falloc_report_corruption() and returns false otherwise.
+static inline bool slab_is_object_start(const struct Slab *slab, void *ptr) {
+    uint32_t offset = (uint32_t)((uintptr_t)ptr - (uintptr_t)slab->data);
+    uint32_t divisibility = SLAB_SIZE_CLASS_DIVISIBILITY[slab->size_class];
+
+    if ((uintptr_t)ptr < (uintptr_t)slab->data ||
+        offset * divisibility >= divisibility ||
+        (uintptr_t)ptr >= (uintptr_t)slab->bitmap.map) {
+        falloc_report_corruption(FALLOC_CORRUPTION_MISALIGNED_FREE, ptr);
+        return false;
+    }
+
+    return true;
+}
+
+// For a pointer whose slab isn't known to be in use, the header has to look
+// like one in use before the object is checked.
+static inline bool slab_is_valid_object(const struct Slab *slab, void *ptr) {
+    if (!slab->owner || slab->size_class >= SLAB_NUM_CLASSES) {
+        falloc_report_corruption(FALLOC_CORRUPTION_FOREIGN_FREE, ptr);
+        return false;
+    }
+
+    return slab_is_object_start(slab, ptr);
+}
+
+// An object freed into the thread or per CPU cache or a remote batch still
+// looks allocated to its slab, so from its free until it's handed out again,
+// its second word holds a mark, which it keeps in its slab too. Frees then
+// only need to look at the object. The mark includes the address, so copying
+// a freed object doesn't copy it. falloc() never hands out less than
+// SLAB_CHECKED_SIZE_MIN bytes for there to be room.
+#define SLAB_CHECKED_SIZE_MIN 16
+
+static inline uintptr_t slab_freed_mark(const void *ptr) {
+    return falloc_secret ^ (uintptr_t)ptr;
+}
+
+static inline void slab_mark_freed(void *ptr) {
+    ((uintptr_t *)ptr)[1] = slab_freed_mark(ptr);
+}
+
+static inline void slab_clear_freed_mark(void *ptr) {
+    ((uintptr_t *)ptr)[1] = 0;
+}
+
+// Reports a marked object as a double free.
+static inline bool slab_is_marked_freed(void *ptr) {
+    if (((uintptr_t *)ptr)[1] == slab_freed_mark(ptr)) {
+        falloc_report_corruption(FALLOC_CORRUPTION_DOUBLE_FREE, ptr);
+        return true;
+    }
+
+    return false;
+}
+
 enum FaFreeRet slab_free(struct SlabAlloc *alloc, void *ptr);
 void *slab_realloc(struct SlabAlloc *alloc, void *ptr, size_t size);
+// 0 for objects of fcache slabs.
 size_t slab_memsize(void *ptr);
 
 #endif // FAST_ALLOC_H
@@ -0,0 +1,94 @@
+#ifndef SLAB_ARENA_H
+#define SLAB_ARENA_H
+
+#include "os_allocator.h"
+
+#include <pthread.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// All slab spans of the process live in one reserved range of this size, so
+// telling a slab pointer apart from any other is a single range check that
+// doesn't touch memory.
+#define SLAB_ARENA_SIZE ((size_t)64 * 1024 * 1024 * 1024)
+
+// The arena is aligned to this, and hands out ranges in multiples of it.
+#define SLAB_ARENA_ALIGN OS_HUGE_PAGE_SIZE
+
+// Released ranges are disjoint multiples of SLAB_ARENA_ALIGN, so there can
+// never be more of them than this.
+#define SLAB_ARENA_FREE_RANGE_CAPACITY (SLAB_ARENA_SIZE / SLAB_ARENA_ALIGN)
+
+// Empty slab spans are shared between all heaps through a pool in the arena.
+#define SLAB_ARENA_SPAN_SIZE  ((size_t)(8 * OS_ALLOC_PAGE_SIZE))
+#define SLAB_ARENA_SPAN_COUNT (SLAB_ARENA_SIZE / SLAB_ARENA_SPAN_SIZE)
+
+static_assert(SLAB_ARENA_SPAN_COUNT <= UINT32_MAX,
+              "span indices need to fit the free span links");
+
+struct SlabArenaRange {
+    uint8_t *begin;
+    size_t size;
+};
+
+// Ranges are handed out from the smallest released range they fit in, or from
+// a bump pointer. A released range is merged with its released neighbours, and
+// with the bump range when it ends there. Both are rare next to slab
+// allocations, so a lock is fine.
+struct SlabArena {
+    uint8_t *begin;
+    uint8_t *bump;
+    uint8_t *end;
+    pthread_mutex_t lock;
+    size_t free_range_count;
+    // SLAB_ARENA_FREE_RANGE_CAPACITY of them, committed as they're used.
+    struct SlabArenaRange *free_ranges;
+    // The free span pool is a lock free stack. The low 32 bits of the head are
+    // the index of the top span plus one, 0 when the pool is empty, and the
+    // high 32 bits are bumped on every change so a stale head never matches.
+    uint64_t free_span_head;
+    // The next span under each pooled span, indexed the same way as the head.
+    // Keeping the links out of the spans means a span whose memory got given
+    // back to the OS in the meantime is never touched.
+    uint32_t *free_span_links;
+    size_t free_span_count;
+};
+
+// Where the arena lives, set once by slab_arena_get(). size is published last,
+// so a non zero size always comes with a valid begin.
+struct SlabArenaBounds {
+    uint8_t *begin;
+    size_t size;
+};
+
+extern struct SlabArenaBounds slab_arena_bounds;
+
+// Reserves the arena the first time it's called.
+struct SlabArena *slab_arena_get(void);
+
+// size needs to be a multiple of SLAB_ARENA_ALIGN. The range is reserved, not
+// committed, and has the page kind written to out_kind applied. Sets errno and
+// returns null when the arena is exhausted.
+void *slab_arena_reserve(struct SlabArena *arena, size_t size,
+                         enum OsPageKind kind, enum OsPageKind *out_kind);
+void slab_arena_release(struct SlabArena *arena, void *ptr, size_t size,
+                        enum OsPageKind kind);
+
+// span needs to be an empty, SLAB_ARENA_SPAN_SIZE aligned span of the arena.
+// It stays counted as live by the FixedAllocator it came from.
+void slab_arena_push_free_span(struct SlabArena *arena, void *span);
+// Returns null when the pool is empty.
+void *slab_arena_pop_free_span(struct SlabArena *arena);
+// Only a snapshot, other threads can change it at any time.
+size_t slab_arena_free_span_count(const struct SlabArena *arena);
+
+static inline bool slab_arena_contains(const void *ptr) {
+    size_t size = __atomic_load_n(&slab_arena_bounds.size, __ATOMIC_ACQUIRE);
+
+    return (uintptr_t)ptr - (uintptr_t)slab_arena_bounds.begin < size;
+}
+
+#endif // SLAB_ARENA_H
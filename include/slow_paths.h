@@ -0,0 +1,31 @@
+#ifndef SLOW_PATHS_H
+#define SLOW_PATHS_H
+
+#include <stdint.h>
+#include <threads.h>
+
+// The rare paths that make a single allocation or free take far longer than
+// usual, counted by the thread that takes them. They are slow anyway, so the
+// counting is always on.
+enum FallocSlowPath {
+    // slab_init(), setting up a slab on a span.
+    FALLOC_SLOW_PATH_SLAB_INIT,
+    // add_block(), reserving a new FixedAllocator block.
+    FALLOC_SLOW_PATH_FIXED_BLOCK,
+    // add_region(), mapping a new fallback region.
+    FALLOC_SLOW_PATH_FALLBACK_REGION,
+    // node_init(), mapping a new Rtree node.
+    FALLOC_SLOW_PATH_RTREE_NODE,
+    FALLOC_SLOW_PATH_COUNT,
+};
+
+extern thread_local uint64_t falloc_slow_path_counts[FALLOC_SLOW_PATH_COUNT]
+    __attribute__((tls_model("initial-exec")));
+
+static inline void falloc_count_slow_path(enum FallocSlowPath path) {
+    ++falloc_slow_path_counts[path];
+}
+
+const char *falloc_slow_path_name(enum FallocSlowPath path);
+
+#endif // SLOW_PATHS_H
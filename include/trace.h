@@ -0,0 +1,84 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Built with FALLOC_TRACE, every falloc(), ffree() and frealloc() call can be
+// recorded into a trace file, which bench/replay.c runs again against any
+// allocator. Hooks are written as if (FALLOC_TRACE_ENABLED && ...), so they
+// compile away without it.
+#ifdef FALLOC_TRACE
+#define FALLOC_TRACE_ENABLED true
+#else
+#define FALLOC_TRACE_ENABLED false
+#endif
+
+// A trace file is a struct FallocTraceHeader followed by records. Every
+// thread buffers its own records and writes them out in blocks, so records of
+// different threads are interleaved, but the records of one thread are always
+// in the order it made the calls.
+#define FALLOC_TRACE_MAGIC   "FATRACE"
+#define FALLOC_TRACE_VERSION 1
+
+// Read from the environment by finit(). When set, the trace starts with the
+// first heap and stops at exit.
+#define FALLOC_TRACE_FILE_ENV "FALLOC_TRACE_FILE"
+
+enum FallocTraceOp {
+    FALLOC_TRACE_ALLOC = 0,
+    FALLOC_TRACE_FREE,
+    FALLOC_TRACE_REALLOC,
+};
+
+struct FallocTraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+// Pointers are replaced by ids, handed out from 1 in the order the pointers
+// were allocated and never reused, so a replay doesn't depend on addresses.
+// Id 0 stands for null, a failed allocation, or a pointer allocated before the
+// trace started.
+struct FallocTraceRecord {
+    // Nanoseconds since the trace started.
+    uint64_t timestamp;
+    // The requested size, 0 for frees.
+    uint64_t size;
+    // The returned pointer for allocations and reallocations, the freed one
+    // for frees.
+    uint32_t id;
+    // The pointer passed to frealloc(), 0 for everything else.
+    uint32_t old_id;
+    // enum FallocTraceOp.
+    uint32_t op;
+    // Threads are numbered from 0 in the order they first show up in the
+    // trace.
+    uint32_t thread;
+};
+
+// Creates or truncates the file at path and starts recording into it. Returns
+// false if the file can't be created, a trace is already running, or falloc
+// was built without FALLOC_TRACE.
+bool falloc_trace_start(const char *path);
+
+// Writes out what every thread still buffers and closes the file. Calls made
+// by other threads while the trace stops may be left out.
+void falloc_trace_stop(void);
+
+// Starts a trace into the file named by FALLOC_TRACE_FILE_ENV, once per
+// process.
+void falloc_trace_start_from_env(void);
+
+// The hooks. Allocations are recorded once they returned, frees and the
+// pointer passed to frealloc() before the memory can be handed out again.
+void falloc_trace_alloc(void *ptr, size_t size);
+void falloc_trace_free(void *ptr);
+// Returns the id of old_ptr for falloc_trace_realloc_end().
+uint32_t falloc_trace_realloc_begin(void *old_ptr);
+void falloc_trace_realloc_end(uint32_t old_id, void *old_ptr, void *ptr,
+                              size_t size);
+
+#endif // TRACE_H
@@ -1,6 +1,7 @@
 #include <bitmap.h>
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -57,3 +58,8 @@ void bitmap_set_to_1(struct Bitmap *bitmap, BitmapSize bit_index) {
     bitmap->map[bit_index >> LOG2_NUM_BITS_IN_BITMAP_SIZE] |=
         (BitmapSize)1 << (bit_index & (BITMAP_SIZE_BIT_COUNT - 1));
 }
+
+bool bitmap_is_set(const struct Bitmap *bitmap, BitmapSize bit_index) {
+    return (bitmap->map[bit_index >> LOG2_NUM_BITS_IN_BITMAP_SIZE] &
+            ((BitmapSize)1 << (bit_index & (BITMAP_SIZE_BIT_COUNT - 1)))) != 0;
+}
@@ -3,13 +3,18 @@
 #include <fallback_alloc/fallback_chunk.h>
 #include <fallback_alloc/fallback_region.h>
 
-#include <sys/mman.h>
+#include <integrity.h>
+#include <os_allocator.h>
+#include <slow_paths.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 
+#define FALLBACK_MAX_CHUNK_SIZE (((size_t)2 << FALLBACK_MAX_CHUNK_LOG2) - 1)
+
 static inline size_t min_size(size_t a, size_t b) {
     return a < b ? a : b;
 }
@@ -18,82 +23,348 @@ static inline size_t max_size(size_t a, size_t b) {
     return a > b ? a : b;
 }
 
-struct FallbackAlloc fallback_allocator_create(size_t size) {
-    size = fallback_align_up(size);
+static inline size_t chunk_size_for(size_t size) {
+    return max_size(fallback_align_up(size) + sizeof(struct FallbackChunk),
+                    FALLBACK_MIN_CHUNK_SIZE);
+}
+
+static inline size_t most_significant_bit(size_t size) {
+    return (sizeof(size_t) * 8) - 1 - __builtin_clzll(size);
+}
+
+// Finds the lists a free chunk of the given size belongs to.
+static inline void mapping_insert(size_t size, size_t *fl, size_t *sl) {
+    if (size < FALLBACK_SMALL_CHUNK_SIZE) {
+        *fl = 0;
+        *sl = size >> FALLBACK_CHUNK_ALIGN_LOG2;
+        return;
+    }
+
+    size_t msb = most_significant_bit(size);
+
+    *sl = (size >> (msb - FALLBACK_SL_LOG2)) ^ FALLBACK_SL_COUNT;
+    *fl = msb - FALLBACK_SMALL_CHUNK_LOG2 + 1;
+}
+
+// Rounds the size up to the next list boundary, so every chunk in the list
+// mapping_insert() picks for it is big enough.
+static inline size_t mapping_search_round_up(size_t size) {
+    if (size < FALLBACK_SMALL_CHUNK_SIZE) {
+        return size;
+    }
+
+    size_t msb = most_significant_bit(size);
+    size_t round = ((size_t)1 << (msb - FALLBACK_SL_LOG2)) - 1;
+
+    return size + round;
+}
+
+static inline void insert_free_chunk(struct FallbackAlloc *aloc,
+                                     struct FallbackChunk *chunk) {
+    size_t fl = 0;
+    size_t sl = 0;
+    mapping_insert(fallback_chunk_size(chunk), &fl, &sl);
+
+    struct FallbackChunk *head = aloc->free_lists[fl][sl];
+    struct FallbackFreeLinks *links = fallback_chunk_free_links(chunk);
+
+    links->prev_free = NULL;
+    links->next_free = head;
+
+    if (head) {
+        fallback_chunk_free_links(head)->prev_free = chunk;
+    }
+
+    aloc->free_lists[fl][sl] = chunk;
+    aloc->fl_bitmap |= (FallbackFlBitmap)1 << fl;
+    aloc->sl_bitmaps[fl] |= (FallbackSlBitmap)1 << sl;
+}
 
-    struct FallbackChunk *ptr = (struct FallbackChunk *)mmap(
-        NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+static inline void remove_free_chunk(struct FallbackAlloc *aloc,
+                                     struct FallbackChunk *chunk) {
+    size_t fl = 0;
+    size_t sl = 0;
+    mapping_insert(fallback_chunk_size(chunk), &fl, &sl);
 
-    if (ptr == MAP_FAILED) {
-        (void)fprintf(stderr, "mmap call failed, error message: %s\n",
+    struct FallbackFreeLinks *links = fallback_chunk_free_links(chunk);
+
+    if (links->next_free) {
+        fallback_chunk_free_links(links->next_free)->prev_free =
+            links->prev_free;
+    }
+
+    if (links->prev_free) {
+        fallback_chunk_free_links(links->prev_free)->next_free =
+            links->next_free;
+        return;
+    }
+
+    assert(aloc->free_lists[fl][sl] == chunk);
+    aloc->free_lists[fl][sl] = links->next_free;
+
+    if (aloc->free_lists[fl][sl]) {
+        return;
+    }
+
+    aloc->sl_bitmaps[fl] &= ~((FallbackSlBitmap)1 << sl);
+
+    if (aloc->sl_bitmaps[fl] == 0) {
+        aloc->fl_bitmap &= ~((FallbackFlBitmap)1 << fl);
+    }
+}
+
+// Returns the first chunk of the smallest non empty list in which every chunk
+// is at least chunk_size bytes, or null if there is none.
+static inline struct FallbackChunk *
+find_suitable_chunk(struct FallbackAlloc *aloc, size_t chunk_size) {
+    size_t fl = 0;
+    size_t sl = 0;
+    mapping_insert(mapping_search_round_up(chunk_size), &fl, &sl);
+
+    if (fl >= FALLBACK_FL_COUNT) {
+        return NULL;
+    }
+
+    FallbackSlBitmap sl_map =
+        aloc->sl_bitmaps[fl] & (~(FallbackSlBitmap)0 << sl);
+
+    if (sl_map == 0) {
+        FallbackFlBitmap fl_map =
+            aloc->fl_bitmap & (~(FallbackFlBitmap)0 << (fl + 1));
+
+        if (fl_map == 0) {
+            return NULL;
+        }
+
+        fl = __builtin_ctzll(fl_map);
+        sl_map = aloc->sl_bitmaps[fl];
+    }
+
+    sl = __builtin_ctz(sl_map);
+
+    return aloc->free_lists[fl][sl];
+}
+
+static inline void region_chunk_init(struct FallbackChunk *chunk, size_t size) {
+    chunk->attr = 0;
+    fallback_chunk_set_used(chunk, false);
+    fallback_chunk_set_size(chunk, size);
+    chunk->next = NULL;
+    chunk->prev = NULL;
+    chunk->owner = NULL;
+    fallback_chunk_seal(chunk);
+}
+
+static inline struct FallbackRegion *region_table_alloc(size_t capacity) {
+    struct FallbackRegion *table =
+        os_alloc(capacity * sizeof(struct FallbackRegion));
+
+    if (!table) {
+        (void)fprintf(stderr, "os_alloc() failed for the region table: %s\n",
                       strerror(errno));
     }
 
+    return table;
+}
+
+static inline void region_table_free(struct FallbackRegion *table,
+                                     size_t capacity) {
+    if (!table) {
+        return;
+    }
+
+    if (os_free(table, capacity * sizeof(struct FallbackRegion)) ==
+        OS_FREE_FAIL) {
+        (void)fprintf(stderr, "os_free() failed for the region table: %s\n",
+                      strerror(errno));
+    }
+}
+
+// Also makes the first table when fallback_allocator_create() couldn't.
+static bool region_table_grow(struct FallbackAlloc *aloc) {
+    size_t new_capacity = aloc->region_capacity == 0
+                              ? FALLBACK_REGION_TABLE_INITIAL_CAPACITY
+                              : aloc->region_capacity * 2;
+    struct FallbackRegion *new_table = region_table_alloc(new_capacity);
+
+    if (!new_table) {
+        return false;
+    }
+
+    if (aloc->region_count != 0) {
+        memcpy(new_table, aloc->regions,
+               aloc->region_count * sizeof(struct FallbackRegion));
+    }
+
+    region_table_free(aloc->regions, aloc->region_capacity);
+
+    aloc->regions = new_table;
+    aloc->region_capacity = new_capacity;
+
+    return true;
+}
+
+static inline struct FallbackChunk *region_map(size_t size,
+                                               enum OsPageKind *out_kind) {
+    return os_alloc_pages(size, os_tier_page_kind(OS_TIER_FALLBACK_REGIONS),
+                          out_kind);
+}
+
+static inline void region_unmap(struct FallbackRegion region) {
+    if (os_free_pages(region.begin, region.size, region.page_kind) ==
+        OS_FREE_FAIL) {
+        (void)fprintf(stderr,
+                      "fbck_allocator: Error unmaping region with begin = %p\n",
+                      (void *)region.begin);
+        (void)fprintf(stderr, "Error message: %s\n", strerror(errno));
+    }
+}
+
+static inline bool chunk_spans_region(const struct FallbackChunk *chunk) {
+    return chunk->prev == NULL && chunk->next == NULL;
+}
+
+struct FallbackAlloc fallback_allocator_create(size_t size,
+                                               struct Falloc *owner) {
+    enum OsPageKind page_kind = os_tier_page_kind(OS_TIER_FALLBACK_REGIONS);
+    size = os_pages_size(
+        max_size(fallback_align_up(size), FALLBACK_MIN_CHUNK_SIZE), page_kind);
+
     struct FallbackAlloc aloc = {
-        .chunk_llist_head = ptr,
-        .regions[0] = {.begin = ptr, .size = size},
-        .total_size = size,
-        .region_count = 1,
+        .fl_bitmap = 0,
+        .regions = region_table_alloc(FALLBACK_REGION_TABLE_INITIAL_CAPACITY),
+        .region_capacity = FALLBACK_REGION_TABLE_INITIAL_CAPACITY,
+        .region_count = 0,
+        .empty_region_count = 0,
+        .total_size = 0,
+        .growth_policy =
+            {
+                .min_region_size = size,
+                .max_region_size =
+                    max_size(size, FALLBACK_DEFAULT_MAX_REGION_SIZE),
+            },
+        .owner = owner,
     };
 
-    for (size_t i = 1; i < FALLBACK_MAX_REGIONS; ++i) {
-        aloc.regions[i].begin = NULL;
-        aloc.regions[i].size = 0;
+    memset((void *)aloc.sl_bitmaps, 0, sizeof(aloc.sl_bitmaps));
+    memset((void *)aloc.free_lists, 0, sizeof(aloc.free_lists));
+
+    // Without a table or a first region the allocator starts out empty, and
+    // its first allocation tries again through add_region().
+    if (!aloc.regions) {
+        aloc.region_capacity = 0;
+        return aloc;
     }
 
-    aloc.chunk_llist_head->attr = 0;
-    fallback_chunk_set_used(aloc.chunk_llist_head, false);
-    fallback_chunk_set_size(aloc.chunk_llist_head, size);
-    aloc.chunk_llist_head->next = NULL;
-    aloc.chunk_llist_head->prev = NULL;
+    struct FallbackChunk *ptr = region_map(size, &page_kind);
+
+    if (!ptr) {
+        (void)fprintf(stderr, "os_alloc_pages() failed, error message: %s\n",
+                      strerror(errno));
+        return aloc;
+    }
+
+    aloc.regions[0] = (struct FallbackRegion){
+        .begin = ptr,
+        .size = size,
+        .page_kind = page_kind,
+    };
+    aloc.region_count = 1;
+    aloc.empty_region_count = 1;
+    aloc.total_size = size;
+
+    region_chunk_init(ptr, size);
+    insert_free_chunk(&aloc, ptr);
 
     return aloc;
 }
 
 void fallback_allocator_destroy(struct FallbackAlloc *aloc) {
-    for (size_t i = 0; i < FALLBACK_MAX_REGIONS; ++i) {
-        int ret = munmap(aloc->regions[i].begin, aloc->regions[i].size);
-
-        if (ret != 0) {
-            (void)fprintf(
-                stderr,
-                "fbck_allocator_destroy: Error unmaping region with begin "
-                "= %p\n",
-                (void *)aloc->regions[i].begin);
-            (void)fprintf(stderr, "Error message: %s\n", strerror(errno));
-        }
+    for (size_t i = 0; i < aloc->region_count; ++i) {
+        region_unmap(aloc->regions[i]);
     }
+
+    region_table_free(aloc->regions, aloc->region_capacity);
+    aloc->regions = NULL;
+    aloc->region_count = 0;
+}
+
+void fallback_allocator_set_growth_policy(struct FallbackAlloc *aloc,
+                                          struct FallbackGrowthPolicy policy) {
+    assert(policy.min_region_size <= policy.max_region_size);
+
+    aloc->growth_policy = policy;
+}
+
+static inline size_t new_region_size(const struct FallbackAlloc *aloc,
+                                     size_t needed_chunk_size) {
+    const struct FallbackGrowthPolicy *policy = &aloc->growth_policy;
+
+    size_t grown_size = min_size(
+        max_size(aloc->total_size, policy->min_region_size),
+        policy->max_region_size);
+
+    return fallback_align_up(max_size(grown_size, needed_chunk_size));
 }
 
-static bool add_region(struct FallbackAlloc *aloc, size_t needed_size) {
-    if (aloc->region_count >= FALLBACK_MAX_REGIONS) {
+// Returns the free chunk spanning the new region, already on the free lists.
+static struct FallbackChunk *add_region(struct FallbackAlloc *aloc,
+                                        size_t needed_chunk_size) {
+    if (aloc->region_count >= aloc->region_capacity &&
+        !region_table_grow(aloc)) {
         (void)fprintf(
             stderr, "fbck_allocator_add_region: No more regions available.\n");
-        return false;
+        return NULL;
     }
 
+    enum OsPageKind page_kind = os_tier_page_kind(OS_TIER_FALLBACK_REGIONS);
     size_t new_reg_size =
-        max_size(aloc->total_size, needed_size + sizeof(struct FallbackChunk));
-    struct FallbackChunk *ptr =
-        (struct FallbackChunk *)mmap(NULL, new_reg_size, PROT_READ | PROT_WRITE,
-                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        os_pages_size(new_region_size(aloc, needed_chunk_size), page_kind);
 
-    if (ptr == NULL) {
-        return false;
+    if (new_reg_size > FALLBACK_MAX_CHUNK_SIZE) {
+        return NULL;
+    }
+
+    struct FallbackChunk *ptr = region_map(new_reg_size, &page_kind);
+
+    if (!ptr) {
+        return NULL;
     }
 
-    aloc->regions[aloc->region_count].begin = ptr;
-    aloc->regions[aloc->region_count].size = new_reg_size;
+    falloc_count_slow_path(FALLOC_SLOW_PATH_FALLBACK_REGION);
 
-    fallback_chunk_set_size(ptr, new_reg_size);
-    fallback_chunk_set_used(ptr, false);
-    ptr->next = NULL;
-    ptr->prev = NULL;
+    aloc->regions[aloc->region_count] = (struct FallbackRegion){
+        .begin = ptr,
+        .size = new_reg_size,
+        .page_kind = page_kind,
+    };
+
+    region_chunk_init(ptr, new_reg_size);
+    insert_free_chunk(aloc, ptr);
 
     aloc->total_size += new_reg_size;
     ++aloc->region_count;
+    ++aloc->empty_region_count;
 
-    return true;
+    return ptr;
+}
+
+// chunk must span the whole region and already be off the free lists.
+static void remove_region(struct FallbackAlloc *aloc,
+                          struct FallbackChunk *chunk) {
+    size_t i = 0;
+
+    while (aloc->regions[i].begin != chunk) {
+        ++i;
+        assert(i < aloc->region_count);
+    }
+
+    struct FallbackRegion region = aloc->regions[i];
+    region_unmap(region);
+
+    aloc->regions[i] = aloc->regions[aloc->region_count - 1];
+    --aloc->region_count;
+    aloc->total_size -= region.size;
 }
 
 void *fallback_alloc(struct FallbackAlloc *aloc, size_t size) {
@@ -103,90 +374,172 @@ void *fallback_alloc(struct FallbackAlloc *aloc, size_t size) {
 
     size = fallback_align_up(size);
 
-    struct FallbackChunk *chunk = NULL;
+    size_t chunk_size = chunk_size_for(size);
 
-    for (size_t i = 0; i < aloc->region_count; ++i) {
-        chunk = aloc->regions[i].begin;
+    struct FallbackChunk *chunk = find_suitable_chunk(aloc, chunk_size);
 
-        while (chunk != NULL) {
-            if (fallback_chunk_split_unused(chunk, size) ==
-                FALLBACK_SPLIT_FAILURE) {
-                chunk = chunk->next;
-                continue;
-            }
+    // A new region only needs to fit the chunk, it doesn't have to land in
+    // the rounded up list find_suitable_chunk() searches from.
+    if (!chunk) {
+        chunk = add_region(aloc, chunk_size);
+    }
 
-            return (void *)(chunk + 1);
-        }
+    if (!chunk) {
+        return NULL;
     }
 
-    if (!add_region(aloc, size)) {
+    if (fallback_chunk_split_unused(aloc, chunk, size) ==
+        FALLBACK_SPLIT_FAILURE) {
         return NULL;
     }
 
-    chunk = aloc->regions[aloc->region_count - 1].begin;
+    chunk->owner = aloc;
+    return (void *)(chunk + 1);
+}
+
+// Takes the chunk's free successor off the free lists and merges it into the
+// chunk.
+static inline void absorb_next_chunk(struct FallbackAlloc *aloc,
+                                     struct FallbackChunk *chunk) {
+    struct FallbackChunk *next = chunk->next;
+    assert(next != NULL && !fallback_chunk_is_used(next));
 
-    if (fallback_chunk_split_unused(chunk, size) == FALLBACK_SPLIT_SUCCESS) {
-        return (void *)(chunk + 1);
+    remove_free_chunk(aloc, next);
+
+    chunk->next = next->next;
+
+    if (chunk->next != NULL) {
+        chunk->next->prev = chunk;
     }
 
-    return NULL;
+    fallback_chunk_set_size(chunk, fallback_chunk_size(chunk) +
+                                       fallback_chunk_size(next));
+}
+
+// Cuts the chunk down to new_chunk_size and puts the rest on the free lists,
+// merged with the following chunk if that one is free. Does nothing if the
+// rest would be too small for a chunk.
+static void split_off_tail(struct FallbackAlloc *aloc,
+                           struct FallbackChunk *chunk, size_t new_chunk_size) {
+    assert(new_chunk_size <= fallback_chunk_size(chunk));
+
+    if (fallback_chunk_size(chunk) - new_chunk_size < FALLBACK_MIN_CHUNK_SIZE) {
+        return;
+    }
+
+    struct FallbackChunk *tail =
+        (struct FallbackChunk *)((char *)chunk + new_chunk_size);
+    tail->attr = 0;
+    fallback_chunk_set_size(tail, fallback_chunk_size(chunk) - new_chunk_size);
+    tail->next = chunk->next;
+    tail->prev = chunk;
+    tail->owner = NULL;
+    fallback_chunk_seal(tail);
+
+    if (chunk->next != NULL) {
+        chunk->next->prev = tail;
+    }
+
+    fallback_chunk_set_size(chunk, new_chunk_size);
+    chunk->next = tail;
+
+    if (tail->next != NULL && !fallback_chunk_is_used(tail->next)) {
+        absorb_next_chunk(aloc, tail);
+    }
+
+    insert_free_chunk(aloc, tail);
 }
 
 enum FallbackSplitResult
-fallback_chunk_split_unused(struct FallbackChunk *chunk, size_t split_size) {
+fallback_chunk_split_unused(struct FallbackAlloc *aloc,
+                            struct FallbackChunk *chunk, size_t split_size) {
     if (fallback_chunk_is_used(chunk)) {
         return FALLBACK_SPLIT_FAILURE;
     }
 
-    size_t new_chunk_size = split_size + sizeof(struct FallbackChunk);
+    size_t new_chunk_size = chunk_size_for(split_size);
 
     if (new_chunk_size > fallback_chunk_size(chunk)) {
         return FALLBACK_SPLIT_FAILURE;
     }
 
-    if (fallback_chunk_size(chunk) - new_chunk_size < FALLBACK_MIN_CHUNK_SIZE) {
-        fallback_chunk_set_used(chunk, true);
-        return FALLBACK_SPLIT_SUCCESS;
-    }
+    remove_free_chunk(aloc, chunk);
 
-    struct FallbackChunk *curr_chunk_new_location =
-        (struct FallbackChunk *)((char *)chunk + new_chunk_size);
-    fallback_chunk_reset_flags(curr_chunk_new_location);
-    fallback_chunk_set_size(curr_chunk_new_location,
-                            fallback_chunk_size(chunk) - new_chunk_size);
-    curr_chunk_new_location->next = chunk->next;
-    curr_chunk_new_location->prev = chunk;
+    if (chunk_spans_region(chunk)) {
+        --aloc->empty_region_count;
+    }
 
     fallback_chunk_set_used(chunk, true);
-    fallback_chunk_set_size(chunk, new_chunk_size);
-    chunk->next = curr_chunk_new_location;
+    split_off_tail(aloc, chunk, new_chunk_size);
 
     return FALLBACK_SPLIT_SUCCESS;
 }
 
+// Checks the chunk's header, and the header of the chunk after it, which is the
+// first thing an overflow of the chunk's data runs into. Reports what it finds
+// and returns false if the chunk can't be handed back.
+static inline bool chunk_is_live(struct FallbackChunk *chunk) {
+    if (!fallback_chunk_is_intact(chunk) ||
+        (chunk->next != NULL && !fallback_chunk_is_intact(chunk->next))) {
+        falloc_report_corruption(FALLOC_CORRUPTION_CHUNK_HEADER, chunk + 1);
+        return false;
+    }
+
+    if (!fallback_chunk_is_used(chunk)) {
+        falloc_report_corruption(FALLOC_CORRUPTION_DOUBLE_FREE, chunk + 1);
+        return false;
+    }
+
+    return true;
+}
+
+// Shrinking splits the tail off in place, growing first tries to absorb a free
+// successor. The data is only copied when neither works.
 void *fallback_realloc(struct FallbackAlloc *aloc, void *ptr, size_t size) {
     if (aloc == NULL) {
         return NULL;
     }
 
-    struct FallbackChunk *chunk_to_realloc = (struct FallbackChunk *)ptr - 1;
-    size_t chunk_sz =
-        fallback_chunk_size(chunk_to_realloc) - sizeof(struct FallbackChunk);
+    if (ptr == NULL) {
+        return fallback_alloc(aloc, size);
+    }
 
-    if (chunk_sz == size) {
+    if (size == 0) {
+        fallback_free(aloc, ptr);
+        return NULL;
+    }
+
+    struct FallbackChunk *chunk = fallback_chunk_from_ptr(ptr);
+
+    if (FALLOC_CHECKS_ENABLED && !chunk_is_live(chunk)) {
+        return NULL;
+    }
+
+    size_t old_chunk_size = fallback_chunk_size(chunk);
+    size_t new_chunk_size = chunk_size_for(size);
+
+    if (new_chunk_size <= old_chunk_size) {
+        split_off_tail(aloc, chunk, new_chunk_size);
         return ptr;
     }
 
-    size_t data_to_cpy_sz = min_size(chunk_sz, size);
+    struct FallbackChunk *next = chunk->next;
+
+    if (next != NULL && !fallback_chunk_is_used(next) &&
+        old_chunk_size + fallback_chunk_size(next) >= new_chunk_size) {
+        absorb_next_chunk(aloc, chunk);
+        split_off_tail(aloc, chunk, new_chunk_size);
+        return ptr;
+    }
 
-    fallback_free(aloc, ptr);
     void *new_mem = fallback_alloc(aloc, size);
 
-    if (new_mem == ptr) {
-        return new_mem;
+    if (new_mem == NULL) {
+        return NULL;
     }
 
-    memmove(new_mem, ptr, data_to_cpy_sz);
+    memcpy(new_mem, ptr, old_chunk_size - sizeof(struct FallbackChunk));
+    fallback_free(aloc, ptr);
 
     return new_mem;
 }
@@ -196,24 +549,25 @@ void fallback_free(struct FallbackAlloc *aloc, void *ptr) {
         return;
     }
 
-    struct FallbackChunk *chunk = (struct FallbackChunk *)ptr - 1;
+    struct FallbackChunk *chunk = fallback_chunk_from_ptr(ptr);
+
+    if (FALLOC_CHECKS_ENABLED && !chunk_is_live(chunk)) {
+        return;
+    }
+
     struct FallbackChunk *child = chunk->next;
     struct FallbackChunk *parent = chunk->prev;
 
     fallback_chunk_set_used(chunk, false);
+    chunk->owner = NULL;
 
     if (child != NULL && !fallback_chunk_is_used(child)) {
-        chunk->next = child->next;
-
-        if (chunk->next != NULL) {
-            chunk->next->prev = chunk;
-        }
-
-        fallback_chunk_set_size(chunk, fallback_chunk_size(chunk) +
-                                           fallback_chunk_size(child));
+        absorb_next_chunk(aloc, chunk);
     }
 
     if (parent != NULL && !fallback_chunk_is_used(parent)) {
+        remove_free_chunk(aloc, parent);
+
         parent->next = chunk->next;
 
         if (parent->next != NULL) {
@@ -222,5 +576,17 @@ void fallback_free(struct FallbackAlloc *aloc, void *ptr) {
 
         fallback_chunk_set_size(parent, fallback_chunk_size(parent) +
                                             fallback_chunk_size(chunk));
+        chunk = parent;
     }
+
+    if (chunk_spans_region(chunk)) {
+        if (aloc->empty_region_count != 0) {
+            remove_region(aloc, chunk);
+            return;
+        }
+
+        ++aloc->empty_region_count;
+    }
+
+    insert_free_chunk(aloc, chunk);
 }
@@ -2,21 +2,73 @@
 
 #include <error.h>
 #include <fallback_alloc/fallback_alloc.h>
+#include <integrity.h>
 #include <os_allocator.h>
+#include <percpu_cache.h>
 #include <rtree.h>
 #include <slab_alloc.h>
+#include <slab_arena.h>
+#include <trace.h>
 
 #include <assert.h>
 #include <stddef.h>
+#include <string.h>
 #include <threads.h>
 
 #define FALLBACK_ALLOC_DEFAULT_SIZE ((size_t)(10 * 1024 * 1024))
 
+#define FALLOC_INSTANCE_SIZE                                                   \
+    ((sizeof(struct Falloc) + FA_PAGE_SIZE - 1) & ~((size_t)FA_PAGE_SIZE - 1))
+
+// Small objects freed for another heap are collected per owner, for up to
+// REMOTE_BATCH_OWNERS owners at a time, and handed over REMOTE_BATCH_SIZE at a
+// time.
+#define REMOTE_BATCH_OWNERS 8
+#define REMOTE_BATCH_SIZE   32
+
+// The objects of a batch are linked through their first word, from head to
+// tail, so the whole batch goes onto the owner's list with a single CAS.
+struct RemoteBatch {
+    struct Falloc *owner;
+    void *head;
+    void *tail;
+    uint32_t count;
+};
+
+typedef uint32_t RemoteBatchMask;
+
+static_assert(REMOTE_BATCH_OWNERS <= sizeof(RemoteBatchMask) * 8,
+              "every batch needs a bit in RemoteBatchMask");
+
+// Two big allocations are always more than SLAB_CLASS_MAX bytes apart, so they
+// never share an Rtree granule.
+static_assert(RTREE_GRANULE_SIZE <= SLAB_CLASS_MAX,
+              "big allocations would collide in the Rtree");
+
+static_assert(SLAB_CLASS_MIN >= sizeof(void *),
+              "thread cache links don't fit in the smallest objects");
+
 thread_local struct Falloc *allocator = NULL;
 
-static inline void cache_init(struct Falloc *alloc) {
-    pthread_mutex_init(&alloc->lock, NULL);
-    alloc->size = 0;
+thread_local struct FallocThreadCache falloc_thread_cache
+    __attribute__((tls_model("initial-exec"))) = {
+        .free_lists = {NULL},
+        .counts = {0},
+};
+
+static thread_local struct RemoteBatch remote_batches[REMOTE_BATCH_OWNERS];
+// Bit i is set when remote_batches[i] holds objects.
+static thread_local RemoteBatchMask pending_remote_batches = 0;
+static thread_local bool thread_exit_registered = false;
+
+static tss_t thread_exit_key;
+static once_flag thread_exit_key_once = ONCE_FLAG_INIT;
+
+static struct Rtree big_allocs;
+static once_flag big_allocs_once = ONCE_FLAG_INIT;
+
+static void big_allocs_init(void) {
+    big_allocs = rtree_init();
 }
 
 static inline void *alloc_big(struct Falloc *alloc, size_t size) {
@@ -27,77 +79,284 @@ static inline void *alloc_big(struct Falloc *alloc, size_t size) {
         return NULL;
     }
 
-    rtree_push_ptr(&alloc->rtree, ptr, size);
+    rtree_push_ptr(&big_allocs, ptr, size);
 
     return ptr;
 }
 
-static inline void free_big(struct Falloc *alloc, void *ptr) {
-    size_t allocated_size = 0;
-    rtree_remove_ptr(&alloc->rtree, ptr, &allocated_size);
-    // os_free(ptr, allocated_size);
-    fallback_free(&alloc->fallback_alloc, ptr);
+static inline struct Falloc *big_alloc_owner(void *ptr) {
+    return fallback_chunk_from_ptr(ptr)->owner->owner;
+}
+
+// Only used with FALLOC_INTEGRITY_CHECKS. Reports and returns false when ptr
+// isn't a big allocation, or its chunk header was overwritten.
+static inline bool big_alloc_is_live(void *ptr) {
+    if (!rtree_contains(&big_allocs, ptr)) {
+        falloc_report_corruption(FALLOC_CORRUPTION_FOREIGN_FREE, ptr);
+        return false;
+    }
+
+    if (!fallback_chunk_is_intact(fallback_chunk_from_ptr(ptr))) {
+        falloc_report_corruption(FALLOC_CORRUPTION_CHUNK_HEADER, ptr);
+        return false;
+    }
+
+    return true;
+}
+
+// big_alloc_is_live() for frees, which takes the Rtree entry out on the same
+// lookup. The entry stays when the free is reported.
+static inline bool big_alloc_take_live(void *ptr) {
+    size_t size = 0;
+
+    if (!rtree_remove_ptr_if_contains(&big_allocs, ptr, &size)) {
+        falloc_report_corruption(FALLOC_CORRUPTION_FOREIGN_FREE, ptr);
+        return false;
+    }
+
+    if (!fallback_chunk_is_intact(fallback_chunk_from_ptr(ptr))) {
+        rtree_push_ptr(&big_allocs, ptr, size);
+        falloc_report_corruption(FALLOC_CORRUPTION_CHUNK_HEADER, ptr);
+        return false;
+    }
+
+    return true;
+}
+
+// Pushes the chain from head to tail, already linked through the first words,
+// onto a remote free list.
+static inline void remote_list_push(void **list, void *head, void *tail) {
+    void **link = (void **)tail;
+    *link = __atomic_load_n(list, __ATOMIC_RELAXED);
+
+    while (!__atomic_compare_exchange_n(list, link, head, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
 }
 
-static inline void cross_thread_cache_push(struct Falloc *diff_thread_alloc,
-                                           void *ptr) {
-    int err_code = pthread_mutex_lock(&diff_thread_alloc->lock);
-    assert(err_code == 0);
+// Takes the whole list at once, so there is no ABA to worry about. Returns
+// null when the list is empty.
+static inline void *remote_list_take(void **list) {
+    if (!__atomic_load_n(list, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
 
-    diff_thread_alloc->stack[diff_thread_alloc->size] = ptr;
-    ++diff_thread_alloc->size;
+    return __atomic_exchange_n(list, NULL, __ATOMIC_ACQUIRE);
+}
 
-    err_code = pthread_mutex_unlock(&diff_thread_alloc->lock);
-    assert(err_code == 0);
+static inline void remote_big_free_push(struct Falloc *owner, void *ptr) {
+    remote_list_push(&owner->remote_big_frees, ptr, ptr);
 }
 
-static inline void *cross_thread_cache_pop(struct Falloc *alloc) {
-    void *ret;
+// Gives the chunks back to the fallback allocator, which merges the
+// neighbours.
+static inline void drain_remote_big_frees(struct Falloc *alloc) {
+    void *ptr = remote_list_take(&alloc->remote_big_frees);
 
-    int err_code = pthread_mutex_lock(&alloc->lock);
-    assert(err_code == 0);
+    while (ptr) {
+        void *next = *(void **)ptr;
+        fallback_free(&alloc->fallback_alloc, ptr);
+        ptr = next;
+    }
+}
 
-    --alloc->size;
-    assert(alloc->size >= 0);
+// The Rtree entry is removed by whichever thread frees the pointer, the chunk
+// itself only ever goes back to the heap that allocated it.
+static inline void free_big(void *ptr) {
+    if (FALLOC_CHECKS_ENABLED) {
+        if (!big_alloc_take_live(ptr)) {
+            return;
+        }
+    } else {
+        rtree_remove_ptr(&big_allocs, ptr, NULL);
+    }
 
-    ret = alloc->stack[alloc->size];
+    struct Falloc *owner = big_alloc_owner(ptr);
 
-    err_code = pthread_mutex_unlock(&alloc->lock);
-    assert(err_code == 0);
+    if (owner != allocator) {
+        remote_big_free_push(owner, ptr);
+        return;
+    }
 
-    return ret;
+    fallback_free(&owner->fallback_alloc, ptr);
 }
 
-static inline size_t get_cross_thread_cache_size(struct Falloc *alloc) {
-    int err_code = pthread_mutex_lock(&alloc->lock);
-    assert(err_code == 0);
+// Only called by the owning thread. The Rtree entry is taken out while the
+// chunk is resized, and put back with whatever size it ends up with.
+static inline void *realloc_big(struct Falloc *alloc, void *ptr, size_t size) {
+    drain_remote_big_frees(alloc);
+
+    size_t old_size = 0;
+    rtree_remove_ptr(&big_allocs, ptr, &old_size);
 
-    size_t size = alloc->size;
+    void *new_ptr = fallback_realloc(&alloc->fallback_alloc, ptr, size);
+
+    if (!new_ptr) {
+        rtree_push_ptr(&big_allocs, ptr, old_size);
+        return NULL;
+    }
+
+    rtree_push_ptr(&big_allocs, new_ptr, size);
+
+    return new_ptr;
+}
+
+static inline bool thread_cache_push(enum SlabSizeClass class, void *ptr) {
+    if (falloc_thread_cache.counts[class] >= FALLOC_THREAD_CACHE_CAPACITY) {
+        return false;
+    }
 
-    err_code = pthread_mutex_unlock(&alloc->lock);
-    assert(err_code == 0);
+    *(void **)ptr = falloc_thread_cache.free_lists[class];
+    falloc_thread_cache.free_lists[class] = ptr;
+    ++falloc_thread_cache.counts[class];
 
-    return size;
+    return true;
+}
+
+static inline void remote_batch_flush(uint32_t index) {
+    struct RemoteBatch *batch = &remote_batches[index];
+
+    remote_list_push(&batch->owner->remote_small_frees, batch->head,
+                     batch->tail);
+
+    *batch = (struct RemoteBatch){
+        .owner = NULL,
+        .head = NULL,
+        .tail = NULL,
+        .count = 0,
+    };
+    pending_remote_batches &= ~((RemoteBatchMask)1 << index);
+}
+
+static inline void remote_batches_flush_all(void) {
+    while (pending_remote_batches != 0) {
+        remote_batch_flush(__builtin_ctz(pending_remote_batches));
+    }
+}
+
+// Gives the objects on the thread cache back to their slabs. Only the thread's
+// own heap can take them, so nothing else would ever hand them out again.
+static inline void thread_cache_flush(void) {
+    for (size_t class = 0; class < SLAB_NUM_CLASSES; ++class) {
+        void *ptr = falloc_thread_cache.free_lists[class];
+
+        while (ptr) {
+            void *next = *(void **)ptr;
+            slab_free(&allocator->slab_alloc, ptr);
+            ptr = next;
+        }
+
+        falloc_thread_cache.free_lists[class] = NULL;
+        falloc_thread_cache.counts[class] = 0;
+    }
+}
+
+static void on_thread_exit(void *arg) {
+    (void)arg;
+
+    remote_batches_flush_all();
+
+    if (allocator) {
+        thread_cache_flush();
+    }
+}
+
+static void thread_exit_key_init(void) {
+    int ret = tss_create(&thread_exit_key, &on_thread_exit);
+    assert(ret == thrd_success);
+    (void)ret;
+}
+
+// The destructor of a tss key only runs for threads that set a value for it,
+// which every thread with a heap or with remote batches does.
+static inline void thread_exit_register(void) {
+    call_once(&thread_exit_key_once, &thread_exit_key_init);
+
+    int ret = tss_set(thread_exit_key, &remote_batches);
+    assert(ret == thrd_success);
+    (void)ret;
+
+    thread_exit_registered = true;
+}
+
+// Finds the batch collecting for owner, or a free one. When every batch
+// collects for some other owner, the one owner hashes to is flushed and reused.
+static inline uint32_t remote_batch_index(struct Falloc *owner) {
+    uint32_t free_index = REMOTE_BATCH_OWNERS;
+
+    for (uint32_t i = 0; i < REMOTE_BATCH_OWNERS; ++i) {
+        if (remote_batches[i].owner == owner) {
+            return i;
+        }
+
+        if (!remote_batches[i].owner && free_index == REMOTE_BATCH_OWNERS) {
+            free_index = i;
+        }
+    }
+
+    if (free_index != REMOTE_BATCH_OWNERS) {
+        return free_index;
+    }
+
+    uint32_t index =
+        (uint32_t)(((uintptr_t)owner / FA_PAGE_SIZE) % REMOTE_BATCH_OWNERS);
+    remote_batch_flush(index);
+
+    return index;
 }
 
-// TODO: Check if the cross thread cache is full.
 static inline void cross_thread_free(void *ptr) {
-    struct Slab *metadata = slab_from_ptr(ptr);
-    cross_thread_cache_push(metadata->owner->owner, ptr);
+    if (!thread_exit_registered) {
+        thread_exit_register();
+    }
+
+    struct Falloc *owner = slab_from_ptr(ptr)->owner->owner;
+    uint32_t index = remote_batch_index(owner);
+    struct RemoteBatch *batch = &remote_batches[index];
+
+    *(void **)ptr = batch->head;
+    batch->head = ptr;
+
+    if (!batch->tail) {
+        batch->tail = ptr;
+        batch->owner = owner;
+        pending_remote_batches |= (RemoteBatchMask)1 << index;
+    }
+
+    ++batch->count;
+
+    if (batch->count == REMOTE_BATCH_SIZE) {
+        remote_batch_flush(index);
+    }
 }
 
 static inline void clear_cross_thread_cache(struct Falloc *alloc) {
-    while (get_cross_thread_cache_size(alloc) != 0) {
-        enum FaFreeRet ret =
-            slab_free(&alloc->slab_alloc, cross_thread_cache_pop(alloc));
+    void *ptr = remote_list_take(&alloc->remote_small_frees);
+
+    while (ptr) {
+        void *next = *(void **)ptr;
+        enum FaFreeRet ret = slab_free(&alloc->slab_alloc, ptr);
         assert(ret != PTR_NOT_OWNED_BY_PASSED_ALLOCATOR_INSTANCE);
+        (void)ret;
+        ptr = next;
     }
 }
 
 void finit(void) {
     assert(!allocator);
 
-    allocator = (struct Falloc *)os_alloc((size_t)2 * FA_PAGE_SIZE);
+    call_once(&big_allocs_once, &big_allocs_init);
+
+    // Sets falloc_secret for the freed marks.
+    if (FALLOC_CHECKS_ENABLED) {
+        falloc_integrity_secret();
+    }
+
+    if (FALLOC_TRACE_ENABLED) {
+        falloc_trace_start_from_env();
+    }
+
+    allocator = (struct Falloc *)os_alloc(FALLOC_INSTANCE_SIZE);
 
     if (!allocator) {
         fa_print_error("os_alloc() faield in falloc()");
@@ -107,62 +366,243 @@ void finit(void) {
     *allocator = (struct Falloc){
         .slab_alloc = slab_alloc_init(allocator),
         .fallback_alloc =
-            fallback_allocator_create(FALLBACK_ALLOC_DEFAULT_SIZE),
-        .rtree = rtree_init(),
+            fallback_allocator_create(FALLBACK_ALLOC_DEFAULT_SIZE, allocator),
+        .remote_big_frees = NULL,
+        .remote_small_frees = NULL,
     };
 
-    cache_init(allocator);
+    if (!thread_exit_registered) {
+        thread_exit_register();
+    }
 }
 
-void *falloc(size_t size) {
+void *falloc_slow(size_t size) {
     if (!allocator) {
         finit();
     }
 
+    remote_batches_flush_all();
     clear_cross_thread_cache(allocator);
+    // Drained on every slow path, so a heap that stopped allocating big objects
+    // still gets its chunks back.
+    drain_remote_big_frees(allocator);
 
     if (size > SLAB_CLASS_MAX) {
         return alloc_big(allocator, size);
     }
 
-    return slab_alloc(&allocator->slab_alloc, size);
-}
+    // Leaves room for the freed mark, see slab_mark_freed().
+    if (FALLOC_CHECKS_ENABLED && size < SLAB_CHECKED_SIZE_MIN) {
+        size = SLAB_CHECKED_SIZE_MIN;
+    }
+
+    void *ptr = NULL;
+
+    if (percpu_cache_is_enabled()) {
+        ptr = percpu_cache_pop(slab_size_class(size));
+    }
 
-void ffree(void *ptr) {
     if (!ptr) {
+        ptr = slab_alloc(&allocator->slab_alloc, size);
+    }
+
+    if (FALLOC_CHECKS_ENABLED && ptr) {
+        slab_clear_freed_mark(ptr);
+    }
+
+    return ptr;
+}
+
+static void free_small(void *ptr) {
+    struct Slab *slab = slab_from_ptr(ptr);
+    bool is_own = allocator && slab->owner == &allocator->slab_alloc;
+
+    // A slab owned by this heap is known to be in use.
+    if (FALLOC_CHECKS_ENABLED && !(is_own ? slab_is_object_start(slab, ptr)
+                                          : slab_is_valid_object(slab, ptr))) {
+        return;
+    }
+
+    // Marked until the object is handed out again, whichever cache, batch or
+    // slab it goes to.
+    if (FALLOC_CHECKS_ENABLED) {
+        if (slab_is_marked_freed(ptr)) {
+            return;
+        }
+
+        slab_mark_freed(ptr);
+    }
+
+    // Only this heap's objects go on the thread cache, objects of other heaps
+    // would be lost with it when the thread exits.
+    if (is_own && thread_cache_push(slab->size_class, ptr)) {
         return;
     }
 
-    if (allocator && rtree_contains(&allocator->rtree, ptr)) {
-        free_big(allocator, ptr);
+    // fcache slabs have no owning heap and no size class, and only
+    // fcache_free() takes their objects back.
+    if (!is_own && !slab->owner) {
+        falloc_report_corruption(FALLOC_CORRUPTION_FOREIGN_FREE, ptr);
         return;
     }
 
-    if (!allocator ||
-        !slab_alloc_is_ptr_in_this_instance(&allocator->slab_alloc, ptr)) {
+    // Whichever heap the object came from, it can be handed out again by any
+    // thread on this CPU.
+    if (percpu_cache_is_enabled() &&
+        percpu_cache_push(slab->size_class, ptr)) {
+        return;
+    }
+
+    if (!is_own) {
         cross_thread_free(ptr);
         return;
     }
 
     clear_cross_thread_cache(allocator);
+    drain_remote_big_frees(allocator);
 
     slab_free(&allocator->slab_alloc, ptr);
 }
 
+static void free_untraced(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    // Anything outside the slab arena is a big allocation, so slab objects
+    // never go near the Rtree.
+    if (!slab_arena_contains(ptr)) {
+        free_big(ptr);
+        return;
+    }
+
+    free_small(ptr);
+}
+
+static void *realloc_untraced(void *ptr, size_t size) {
+    if (!ptr) {
+        return falloc_untraced(size);
+    }
+
+    if (size == 0) {
+        free_untraced(ptr);
+        return NULL;
+    }
+
+    if (!allocator) {
+        finit();
+    }
+
+    bool is_big = !slab_arena_contains(ptr);
+
+    if (FALLOC_CHECKS_ENABLED &&
+        !(is_big ? big_alloc_is_live(ptr)
+                : slab_is_valid_object(slab_from_ptr(ptr), ptr))) {
+        return NULL;
+    }
+
+    if (FALLOC_CHECKS_ENABLED && !is_big && slab_is_marked_freed(ptr)) {
+        return NULL;
+    }
+
+    if (!is_big && !slab_from_ptr(ptr)->owner) {
+        falloc_report_corruption(FALLOC_CORRUPTION_FOREIGN_FREE, ptr);
+        return NULL;
+    }
+
+    if (is_big && size > SLAB_CLASS_MAX && big_alloc_owner(ptr) == allocator) {
+        return realloc_big(allocator, ptr, size);
+    }
+
+    if (!is_big && size <= SLAB_CLASS_MAX &&
+        slab_alloc_is_ptr_in_this_instance(&allocator->slab_alloc, ptr)) {
+        clear_cross_thread_cache(allocator);
+        void *new_ptr = slab_realloc(&allocator->slab_alloc, ptr, size);
+
+        // A moved object went back to its slab, see slab_mark_freed().
+        if (FALLOC_CHECKS_ENABLED && new_ptr && new_ptr != ptr) {
+            slab_mark_freed(ptr);
+        }
+
+        return new_ptr;
+    }
+
+    // Moving between the slab and fallback allocators, or out of another
+    // thread's heap, always copies.
+    size_t old_size = fmemsize(ptr);
+    void *new_ptr = falloc_untraced(size);
+
+    if (!new_ptr) {
+        return NULL;
+    }
+
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    free_untraced(ptr);
+
+    return new_ptr;
+}
+
+void ffree(void *ptr) {
+    if (FALLOC_TRACE_ENABLED) {
+        falloc_trace_free(ptr);
+    }
+
+    free_untraced(ptr);
+}
+
+void ffree_sized(void *ptr, size_t size) {
+    assert((!ptr || slab_arena_contains(ptr) == (size <= SLAB_CLASS_MAX)) &&
+           "ffree_sized() got a size the object can't have");
+    (void)size;
+
+    ffree(ptr);
+}
+
 void *frealloc(void *ptr, size_t size) {
-    return slab_realloc(&allocator->slab_alloc, ptr, size);
+    if (!FALLOC_TRACE_ENABLED) {
+        return realloc_untraced(ptr, size);
+    }
+
+    uint32_t old_id = falloc_trace_realloc_begin(ptr);
+    void *new_ptr = realloc_untraced(ptr, size);
+    falloc_trace_realloc_end(old_id, ptr, new_ptr, size);
+
+    return new_ptr;
 }
 
 size_t fmemsize(void *ptr) {
-    size_t size = 0;
+    if (slab_arena_contains(ptr)) {
+        return slab_memsize(ptr);
+    }
 
-    if (rtree_retrieve_size_if_contains(&allocator->rtree, ptr, &size)) {
-        return size;
+    // The Rtree only knows the size the object was allocated with.
+    if (!rtree_contains(&big_allocs, ptr)) {
+        return 0;
     }
 
-    return slab_memsize(ptr);
+    return fallback_chunk_capacity(fallback_chunk_from_ptr(ptr));
+}
+
+void *falloc_noinline(size_t size) {
+    return falloc(size);
+}
+
+void *falloc_at_least_noinline(size_t size, size_t *out_actual) {
+    return falloc_at_least(size, out_actual);
+}
+
+size_t fgood_size_noinline(size_t size) {
+    return fgood_size(size);
+}
+
+bool falloc_enable_percpu_cache(void) {
+    return percpu_cache_init();
 }
 
 struct Falloc *falloc_get_instance(void) {
     return allocator;
 }
+
+struct Rtree *falloc_get_rtree(void) {
+    return &big_allocs;
+}
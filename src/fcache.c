@@ -0,0 +1,412 @@
+#include <fcache.h>
+
+#include <bitmap.h>
+#include <error.h>
+#include <fixed_alloc.h>
+#include <integrity.h>
+#include <os_allocator.h>
+#include <slab_alloc.h>
+#include <slab_arena.h>
+#include <slow_paths.h>
+#include <stack_definition.h>
+
+#include <pthread.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+STACK_DEFINE(CacheOffset, CacheSizeType, CacheStack)
+
+#define SLAB_CACHE_CAPACITY 100
+#define DEFAULT_MAX_ALIGN   16
+
+#define FCACHE_INSTANCE_SIZE                                                   \
+    ((sizeof(struct Fcache) + FA_PAGE_SIZE - 1) & ~((size_t)FA_PAGE_SIZE - 1))
+
+// The slab header of a cache's span is a plain Slab, colored like any other
+// so slab_from_ptr() finds it. Its owner is null and its size class
+// SLAB_CLASS_INVALID, which ffree() and frealloc() report as a foreign free
+// and fmemsize() answers with 0. What the cache needs on top sits right in
+// front of it.
+struct FcacheSlab {
+    struct Fcache *cache;
+    // Objects below this index were constructed. The bitmap always hands out
+    // the lowest free index, so a fresh object is always the next one.
+    uint32_t constructed_count;
+    struct Slab slab;
+};
+
+static_assert(offsetof(struct FcacheSlab, slab) + sizeof(struct Slab) ==
+                  sizeof(struct FcacheSlab),
+              "slab_from_ptr() has to find the Slab of an FcacheSlab");
+
+// Slabs with room to spare are on partial, the others on full, both linked
+// through the Slabs' own next_slab and prev_slab. Everything is behind lock.
+struct Fcache {
+    char name[FCACHE_NAME_SIZE];
+    size_t object_size;
+    size_t align;
+    SlabSize stride;
+    SlabSize objects_per_slab;
+    // ceil(2^32 / stride), the same trick as SLAB_SIZE_CLASS_DIVISIBILITY.
+    uint64_t divisibility;
+    FcacheCtor ctor;
+    pthread_mutex_t lock;
+    struct Slab *partial;
+    struct Slab *full;
+    size_t slab_count;
+    size_t live_count;
+    uint64_t alloc_count;
+    uint64_t free_count;
+    uint64_t constructed_count;
+    // Spans come from the shared pool first and from here otherwise. Only the
+    // spans of this one go back to it, the rest go back to the pool.
+    struct FixedAllocator fixed_alloc;
+};
+
+static inline size_t align_up(size_t val, size_t align) {
+    return (val + align - 1) & ~(align - 1);
+}
+
+static inline size_t default_align(size_t size) {
+    size_t align = size & -size;
+    return align < DEFAULT_MAX_ALIGN ? align : DEFAULT_MAX_ALIGN;
+}
+
+// As many objects as fit next to their bitmap, the offset stack and the
+// header.
+static inline SlabSize objects_per_slab(SlabSize stride) {
+    const size_t buff_size =
+        SLAB_SIZE - SLAB_COLOR_SPACE -
+        (SLAB_CACHE_CAPACITY * sizeof(CacheOffset)) - SLAB_HEADER_SIZE -
+        offsetof(struct FcacheSlab, slab);
+    const size_t bits_per_word = BITMAP_SIZE_BIT_COUNT;
+
+    size_t count = buff_size / stride;
+
+    while (align_up(count * stride, sizeof(BitmapSize)) +
+               (align_up(count, bits_per_word) / 8) >
+           buff_size) {
+        --count;
+    }
+
+    return (SlabSize)count;
+}
+
+static inline struct FcacheSlab *fcache_slab_of(struct Slab *slab) {
+    return (struct FcacheSlab *)((uint8_t *)slab -
+                                 offsetof(struct FcacheSlab, slab));
+}
+
+static inline size_t object_index(const struct Fcache *cache, SlabSize offset) {
+    return (size_t)(((uint64_t)offset * cache->divisibility) >> 32);
+}
+
+static inline void list_push(struct Slab **list, struct Slab *slab) {
+    slab->prev_slab = NULL;
+    slab->next_slab = *list;
+
+    if (*list) {
+        (*list)->prev_slab = slab;
+    }
+
+    *list = slab;
+}
+
+static inline void list_remove(struct Slab **list, struct Slab *slab) {
+    if (slab->prev_slab == NULL) {
+        *list = slab->next_slab;
+    } else {
+        slab->prev_slab->next_slab = slab->next_slab;
+    }
+
+    if (slab->next_slab != NULL) {
+        slab->next_slab->prev_slab = slab->prev_slab;
+    }
+}
+
+static inline void *take_span(struct Fcache *cache) {
+    void *span = slab_arena_pop_free_span(cache->fixed_alloc.arena);
+
+    if (span) {
+        return span;
+    }
+
+    return fixed_alloc(&cache->fixed_alloc);
+}
+
+static inline void give_back_span(struct Fcache *cache, void *span) {
+    if (fixed_alloc_owns(&cache->fixed_alloc, span)) {
+        fixed_free(&cache->fixed_alloc, span);
+        return;
+    }
+
+    slab_arena_push_free_span(cache->fixed_alloc.arena, span);
+}
+
+// Returns null when no span is left for the slab.
+static inline struct Slab *fcache_slab_init(struct Fcache *cache) {
+    falloc_count_slow_path(FALLOC_SLOW_PATH_SLAB_INIT);
+
+    uint8_t *mem = (uint8_t *)take_span(cache);
+
+    if (!mem) {
+        return NULL;
+    }
+
+    struct FcacheSlab *header = fcache_slab_of(slab_header_in_span(mem));
+    CacheOffset *cache_data = (CacheOffset *)header - SLAB_CACHE_CAPACITY;
+    // Alignments above SLAB_COLOR_STEP round the color offset down to
+    // themselves, which keeps it inside SLAB_COLOR_SPACE.
+    size_t color_offset =
+        (size_t)(slab_objects_in_span(mem) - mem) & ~(cache->align - 1);
+    uint8_t *data = mem + color_offset;
+    size_t objects_size = (size_t)cache->objects_per_slab * cache->stride;
+    BitmapSize *bitmap_data =
+        (BitmapSize *)(data + align_up(objects_size, sizeof(BitmapSize)));
+
+    *header = (struct FcacheSlab){
+        .cache = cache,
+        .constructed_count = 0,
+        .slab =
+            {
+                .data = data,
+                .total_alloc_count = 0,
+                .max_alloc_count = 0,
+                .size_class = SLAB_CLASS_INVALID,
+                .bitmap = bitmap_init(bitmap_data, cache->objects_per_slab),
+                .cache = CacheStack_init(cache_data, SLAB_CACHE_CAPACITY),
+                .next_slab = NULL,
+                .prev_slab = NULL,
+                .owner = NULL,
+            },
+    };
+
+    ++cache->slab_count;
+
+    return &header->slab;
+}
+
+// Only with FALLOC_INTEGRITY_CHECKS. Reports and returns false unless ptr is
+// a live object of cache.
+static inline bool is_live_object(const struct Fcache *cache, void *ptr) {
+    if (!slab_arena_contains(ptr)) {
+        falloc_report_corruption(FALLOC_CORRUPTION_FOREIGN_FREE, ptr);
+        return false;
+    }
+
+    struct Slab *slab = slab_from_ptr(ptr);
+
+    if (slab->owner || slab->size_class != SLAB_CLASS_INVALID ||
+        fcache_slab_of(slab)->cache != cache) {
+        falloc_report_corruption(FALLOC_CORRUPTION_FOREIGN_FREE, ptr);
+        return false;
+    }
+
+    SlabSize offset = (uint8_t *)ptr - slab->data;
+
+    if ((uintptr_t)ptr < (uintptr_t)slab->data ||
+        (uint32_t)(offset * cache->divisibility) >= cache->divisibility ||
+        (uintptr_t)ptr >= (uintptr_t)slab->bitmap.map) {
+        falloc_report_corruption(FALLOC_CORRUPTION_MISALIGNED_FREE, ptr);
+        return false;
+    }
+
+    if (!bitmap_is_set(&slab->bitmap, object_index(cache, offset))) {
+        falloc_report_corruption(FALLOC_CORRUPTION_DOUBLE_FREE, ptr);
+        return false;
+    }
+
+    return true;
+}
+
+struct Fcache *fcache_create(const char *name, size_t size, size_t align,
+                             FcacheCtor ctor) {
+    if (align == 0) {
+        align = default_align(size);
+    }
+
+    if (size == 0 || size > FCACHE_MAX_SIZE || (align & (align - 1)) != 0 ||
+        align > FCACHE_MAX_ALIGN) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct Fcache *cache = (struct Fcache *)os_alloc(FCACHE_INSTANCE_SIZE);
+
+    if (!cache) {
+        fa_print_errno("os_alloc() failed in fcache_create()");
+        return NULL;
+    }
+
+    SlabSize stride = (SlabSize)align_up(size, align);
+
+    *cache = (struct Fcache){
+        .name = {0},
+        .object_size = size,
+        .align = align,
+        .stride = stride,
+        .objects_per_slab = objects_per_slab(stride),
+        .divisibility = ((uint64_t)UINT32_MAX / stride) + 1,
+        .ctor = ctor,
+        .partial = NULL,
+        .full = NULL,
+        .slab_count = 0,
+        .live_count = 0,
+        .alloc_count = 0,
+        .free_count = 0,
+        .constructed_count = 0,
+        .fixed_alloc = fixed_alloc_init_in_arena(SLAB_SIZE, slab_arena_get()),
+    };
+
+    if (name) {
+        strncpy(cache->name, name, FCACHE_NAME_SIZE - 1);
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return cache;
+}
+
+void fcache_destroy(struct Fcache *cache) {
+    if (!cache) {
+        return;
+    }
+
+    struct Slab *lists[] = {cache->partial, cache->full};
+
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); ++i) {
+        struct Slab *slab = lists[i];
+
+        while (slab) {
+            struct Slab *next = slab->next_slab;
+            void *span = align_down_to_slab_size(slab->data);
+            give_back_span(cache, span);
+            slab = next;
+        }
+    }
+
+    fixed_alloc_deinit(&cache->fixed_alloc);
+    pthread_mutex_destroy(&cache->lock);
+    os_free(cache, FCACHE_INSTANCE_SIZE);
+}
+
+void *fcache_alloc(struct Fcache *cache) {
+    assert(cache != NULL);
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (!cache->partial) {
+        struct Slab *new_slab = fcache_slab_init(cache);
+
+        if (!new_slab) {
+            pthread_mutex_unlock(&cache->lock);
+            return NULL;
+        }
+
+        list_push(&cache->partial, new_slab);
+    }
+
+    struct Slab *slab = cache->partial;
+    size_t index = 0;
+
+    if (slab->cache.size != 0) {
+        index = object_index(cache, CacheStack_pop(&slab->cache));
+        bitmap_set_to_1(&slab->bitmap, index);
+    } else {
+        index = bitmap_find_free_and_swap(&slab->bitmap);
+        assert(index != BITMAP_NOT_FOUND);
+    }
+
+    void *ptr = slab->data + (index * cache->stride);
+    struct FcacheSlab *header = fcache_slab_of(slab);
+    assert(index <= header->constructed_count);
+
+    if (index == header->constructed_count) {
+        if (cache->ctor) {
+            cache->ctor(ptr);
+        }
+
+        ++header->constructed_count;
+        ++cache->constructed_count;
+    }
+
+    if (++slab->total_alloc_count == cache->objects_per_slab) {
+        list_remove(&cache->partial, slab);
+        list_push(&cache->full, slab);
+    }
+
+    ++cache->live_count;
+    ++cache->alloc_count;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return ptr;
+}
+
+void fcache_free(struct Fcache *cache, void *ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    assert(cache != NULL);
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (FALLOC_CHECKS_ENABLED && !is_live_object(cache, ptr)) {
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+
+    struct Slab *slab = slab_from_ptr(ptr);
+    assert(fcache_slab_of(slab)->cache == cache);
+
+    SlabSize offset = (uint8_t *)ptr - slab->data;
+    bitmap_set_to_0(&slab->bitmap, object_index(cache, offset));
+    CacheStack_try_push(&slab->cache, (CacheOffset)offset);
+
+    if (slab->total_alloc_count-- == cache->objects_per_slab) {
+        list_remove(&cache->full, slab);
+        list_push(&cache->partial, slab);
+    }
+
+    // One empty slab is kept, so a cache that keeps emptying and refilling a
+    // slab doesn't construct its objects over and over.
+    if (slab->total_alloc_count == 0 &&
+        (slab->prev_slab || slab->next_slab)) {
+        list_remove(&cache->partial, slab);
+        give_back_span(cache, align_down_to_slab_size(slab->data));
+        --cache->slab_count;
+    }
+
+    --cache->live_count;
+    ++cache->free_count;
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+struct FcacheStats fcache_stats(struct Fcache *cache) {
+    assert(cache != NULL);
+
+    pthread_mutex_lock(&cache->lock);
+
+    struct FcacheStats stats = {
+        .name = cache->name,
+        .object_size = cache->object_size,
+        .stride = cache->stride,
+        .objects_per_slab = cache->objects_per_slab,
+        .slab_count = cache->slab_count,
+        .live_count = cache->live_count,
+        .alloc_count = cache->alloc_count,
+        .free_count = cache->free_count,
+        .constructed_count = cache->constructed_count,
+    };
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return stats;
+}
@@ -2,43 +2,32 @@
 
 #include <error.h>
 #include <os_allocator.h>
-#include <stack_definition.h>
+#include <slab_arena.h>
+#include <slow_paths.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-STACK_DEFINE(FixedAllocCacheElem, FixedAllocCacheSizeType, FixedAllocCache)
-
-#define GET_NUM_OF_ELEMS(FIXED_ALLOC_VAR) ((FIXED_ALLOC_VAR).cache.capacity)
-
 #define DEFAULT_ALLOC_SIZE ((size_t)(0x800 * OS_ALLOC_PAGE_SIZE))
 
 static inline bool is_full(struct FixedAllocBlock *block) {
-    size_t fixed_alloc_buff_size =
-        (GET_NUM_OF_ELEMS(*block)) * block->unit_size;
-
-    return block->offset >= fixed_alloc_buff_size - block->unit_size &&
-           block->cache.size == 0;
+    return block->offset == block->capacity * block->unit_size &&
+           block->free_list == NULL;
 }
 
-static inline bool is_ptr_in_block(struct FixedAllocBlock *block, void *ptr) {
-    uint8_t *block_begin = (uint8_t *)block->aligned_up_mem;
-    uint8_t *block_end =
-        block_begin + (GET_NUM_OF_ELEMS(*block) * block->unit_size);
-    uint8_t *byte_ptr = (uint8_t *)ptr;
+static inline bool is_ptr_in_block(const struct FixedAllocBlock *block,
+                                   const void *ptr) {
+    const uint8_t *block_begin = (const uint8_t *)block->mem;
+    const uint8_t *block_end =
+        block_begin + (block->capacity * block->unit_size);
+    const uint8_t *byte_ptr = (const uint8_t *)ptr;
 
     return byte_ptr >= block_begin && byte_ptr < block_end;
 }
 
-static inline void *align_up_to_unit_size(const void *ptr, size_t unit_size) {
-    uintptr_t intptr = (uintptr_t)ptr;
-    uintptr_t bias = ((intptr + (unit_size - 1)) & ~(unit_size - 1)) - intptr;
-
-    return (char *)ptr + bias;
-}
-
 void *align_up_to_block_size(const void *ptr) {
     uintptr_t intptr = (uintptr_t)ptr;
     uintptr_t bias = ((intptr + (SLAB_SIZE - 1)) & ~(SLAB_SIZE - 1)) - intptr;
@@ -53,98 +42,328 @@ void *align_down_to_slab_size(const void *ptr) {
     return (char *)ptr - bias;
 }
 
-static inline struct FixedAllocBlock block_init(size_t unit_size,
-                                                size_t block_size) {
-    // num_of_elems * unit_size + num_of_elems * sizeof(CacheElem) = buff_size
-    // num_of_elems * (unit_size + sizeof(CacheElem)) = buff_size
-    // num_of_elems = buff_size / (unit_size + sizeof(CacheElem))
+static inline size_t round_up(size_t val, size_t align) {
+    return (val + align - 1) & ~(align - 1);
+}
 
-    void *mem = os_alloc(block_size);
+static inline void *block_reserve(struct SlabArena *arena, size_t unit_size,
+                                  size_t block_size,
+                                  enum OsPageKind *out_kind) {
+    enum OsPageKind kind = os_tier_page_kind(OS_TIER_SLAB_BLOCKS);
 
-    if (!mem) {
-        fa_print_errno("os_alloc() failed in fixed_alloc_init()");
-        assert(false);
+    if (arena) {
+        return slab_arena_reserve(arena, block_size, kind, out_kind);
     }
 
-    void *aligned_up_mem = align_up_to_unit_size(mem, unit_size);
+    return os_reserve_pages(block_size, unit_size, kind, out_kind);
+}
+
+// Returns false when the block can't be reserved.
+static inline bool block_init(struct SlabArena *arena, size_t unit_size,
+                              size_t block_size,
+                              struct FixedAllocBlock *out_block) {
+    assert(block_size % unit_size == 0);
 
-    size_t unused_mem_size = (char *)aligned_up_mem - (char *)mem;
-    size_t buff_size = block_size - unused_mem_size;
-    size_t num_of_elems = buff_size / (unit_size + sizeof(FixedAllocCacheElem));
+    enum OsPageKind page_kind = OS_PAGES_SMALL;
+    void *mem = block_reserve(arena, unit_size, block_size, &page_kind);
 
-    void *cache_mem = (char *)aligned_up_mem + (num_of_elems * unit_size);
+    if (!mem) {
+        fa_print_errno("Reserving memory failed in block_init()");
+        return false;
+    }
 
-    struct FixedAllocBlock block = {
-        .os_allocated_mem = mem,
-        .aligned_up_mem = aligned_up_mem,
-        .os_allocated_size = block_size,
+    *out_block = (struct FixedAllocBlock){
+        .mem = mem,
+        .page_kind = page_kind,
+        .size = block_size,
+        .committed_size = 0,
         .offset = 0,
         .unit_size = unit_size,
-        .cache = FixedAllocCache_init(cache_mem, num_of_elems),
+        .capacity = block_size / unit_size,
+        .live_count = 0,
+        .free_list = NULL,
     };
 
-    return block;
+    return true;
 }
 
-static inline void block_deinit(struct FixedAllocBlock *block) {
-    int ret = os_free(block->os_allocated_mem, block->os_allocated_size);
+static inline void block_deinit(struct SlabArena *arena,
+                                struct FixedAllocBlock *block) {
+    if (arena) {
+        slab_arena_release(arena, block->mem, block->size, block->page_kind);
+        return;
+    }
+
+    int ret = os_free_pages(block->mem, block->size, block->page_kind);
 
     if (ret == OS_FREE_FAIL) {
-        fa_print_errno("os_free() failed in fixed_alloc_deinit()");
+        fa_print_errno("os_free_pages() failed in fixed_alloc_deinit()");
         assert(false);
     }
 }
 
-static inline void add_block(struct FixedAllocator *alloc) {
-    assert(alloc->block_count > 0 &&
-           alloc->block_count < FIXED_ALLOC_BLOCK_CAPACITY);
+// Commits enough of the block for the unit at the bump offset. Returns false
+// when the pages can't be committed.
+static inline bool block_commit_next_unit(struct FixedAllocBlock *block) {
+    size_t needed_size = block->offset + block->unit_size;
+
+    if (needed_size <= block->committed_size) {
+        return true;
+    }
+
+    size_t step = block->page_kind == OS_PAGES_SMALL ? FIXED_ALLOC_COMMIT_SIZE
+                                                     : OS_HUGE_PAGE_SIZE;
+
+    if (block->unit_size > step) {
+        step = block->unit_size;
+    }
+    size_t new_committed_size = round_up(needed_size, step);
+
+    if (new_committed_size > block->size) {
+        new_committed_size = block->size;
+    }
+
+    int ret = os_commit((uint8_t *)block->mem + block->committed_size,
+                        new_committed_size - block->committed_size);
+
+    if (ret == OS_COMMIT_FAIL) {
+        fa_print_errno("os_commit() failed in block_commit_next_unit()");
+        return false;
+    }
+
+    block->committed_size = new_committed_size;
+    return true;
+}
+
+static inline FixedAllocBlockMask block_bit(uint32_t block_index) {
+    return (FixedAllocBlockMask)1 << block_index;
+}
+
+static inline void insert_block_by_addr(struct FixedAllocator *alloc,
+                                        uint32_t block_index) {
+    uint8_t *begin = alloc->blocks[block_index].mem;
+    uint32_t pos = block_index;
+
+    for (; pos > 0; --pos) {
+        uint32_t prev = alloc->blocks_by_addr[pos - 1];
+
+        if ((uint8_t *)alloc->blocks[prev].mem < begin) {
+            break;
+        }
+
+        alloc->blocks_by_addr[pos] = (uint8_t)prev;
+    }
+
+    alloc->blocks_by_addr[pos] = (uint8_t)block_index;
+}
+
+// Binary search for how many blocks begin at or before ptr, at most
+// log2(FIXED_ALLOC_BLOCK_CAPACITY) steps.
+static inline uint32_t count_blocks_up_to(const struct FixedAllocator *alloc,
+                                          const void *ptr) {
+    uint32_t low = 0;
+    uint32_t high = alloc->block_count;
+
+    while (low < high) {
+        uint32_t mid = low + ((high - low) / 2);
+        const struct FixedAllocBlock *block =
+            &alloc->blocks[alloc->blocks_by_addr[mid]];
+
+        if ((const uint8_t *)block->mem <= (const uint8_t *)ptr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+// The last block beginning at or before ptr.
+static inline uint32_t find_block_index(const struct FixedAllocator *alloc,
+                                        const void *ptr) {
+    uint32_t count = count_blocks_up_to(alloc, ptr);
+
+    assert(count > 0 && "ptr not allocated with this FixedAllocator instance");
+
+    return alloc->blocks_by_addr[count - 1];
+}
+
+static inline size_t grow_block_size(size_t block_size) {
+    size_t doubled = block_size * 2;
 
-    alloc->blocks[alloc->block_count] =
-        block_init(alloc->unit_size,
-                   alloc->blocks[alloc->block_count - 1].os_allocated_size * 2);
+    return doubled < FIXED_ALLOC_MAX_BLOCK_SIZE ? doubled
+                                                : FIXED_ALLOC_MAX_BLOCK_SIZE;
+}
+
+// Returns false with errno set to ENOMEM when the block table is full or the
+// block can't be reserved.
+static inline bool add_block(struct FixedAllocator *alloc) {
+    assert(alloc->block_count > 0);
+
+    if (alloc->block_count == FIXED_ALLOC_BLOCK_CAPACITY) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    falloc_count_slow_path(FALLOC_SLOW_PATH_FIXED_BLOCK);
+
+    uint32_t block_index = alloc->block_count;
+
+    if (!block_init(alloc->arena, alloc->unit_size, alloc->next_block_size,
+                    &alloc->blocks[block_index])) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    alloc->next_block_size = grow_block_size(alloc->next_block_size);
+
+    insert_block_by_addr(alloc, block_index);
+    alloc->non_full_blocks |= block_bit(block_index);
+    alloc->empty_blocks |= block_bit(block_index);
 
     ++alloc->block_count;
+
+    return true;
+}
+
+static inline FixedAllocBlockMask move_bit(FixedAllocBlockMask mask,
+                                           uint32_t from, uint32_t to) {
+    FixedAllocBlockMask from_bit = mask & block_bit(from);
+    mask &= ~(block_bit(from) | block_bit(to));
+
+    return from_bit ? mask | block_bit(to) : mask;
+}
+
+// Unmaps the block and moves the last block into its slot, so the block
+// indices stay dense.
+static inline void remove_block(struct FixedAllocator *alloc,
+                                uint32_t block_index) {
+    assert(alloc->block_count > 1);
+
+    block_deinit(alloc->arena, &alloc->blocks[block_index]);
+
+    uint32_t last_index = alloc->block_count - 1;
+    uint32_t write_pos = 0;
+
+    for (uint32_t read_pos = 0; read_pos < alloc->block_count; ++read_pos) {
+        uint8_t index = alloc->blocks_by_addr[read_pos];
+
+        if (index == block_index) {
+            continue;
+        }
+
+        alloc->blocks_by_addr[write_pos++] =
+            index == last_index ? (uint8_t)block_index : index;
+    }
+
+    // The removed block's bits go first, or they would survive when it is the
+    // last block itself and nothing is moved into its slot.
+    alloc->non_full_blocks &= ~block_bit(block_index);
+    alloc->empty_blocks &= ~block_bit(block_index);
+
+    alloc->blocks[block_index] = alloc->blocks[last_index];
+    alloc->non_full_blocks =
+        move_bit(alloc->non_full_blocks, last_index, block_index);
+    alloc->empty_blocks =
+        move_bit(alloc->empty_blocks, last_index, block_index);
+
+    --alloc->block_count;
+}
+
+// Starting over from an empty bump offset drops the free list, which could
+// otherwise span the whole block. The committed memory is kept, since the block
+// stays warm.
+static inline void block_reset(struct FixedAllocBlock *block) {
+    block->offset = 0;
+    block->free_list = NULL;
 }
 
+// Keeps the first block that empties warm and gives every other empty block
+// back to the OS.
+static inline void on_block_emptied(struct FixedAllocator *alloc,
+                                    uint32_t block_index) {
+    if (alloc->empty_blocks != 0) {
+        remove_block(alloc, block_index);
+        return;
+    }
+
+    block_reset(&alloc->blocks[block_index]);
+    alloc->empty_blocks |= block_bit(block_index);
+}
+
+// Returns null when the block is full or the next unit can't be committed.
 static inline void *allocate_from_block(struct FixedAllocBlock *block) {
     if (is_full(block)) {
         return NULL;
     }
 
-    void *ret;
-    enum StackError err = FixedAllocCache_try_pop(&block->cache, &ret);
+    struct FixedAllocFreeUnit *unit = block->free_list;
 
-    if (err == STACK_OK) {
-        return ret;
+    if (unit) {
+        block->free_list = unit->next;
+        ++block->live_count;
+        return unit;
+    }
+
+    if (!block_commit_next_unit(block)) {
+        return NULL;
     }
 
-    ret = block->aligned_up_mem + block->offset;
+    ++block->live_count;
+
+    void *ret = (uint8_t *)block->mem + block->offset;
     block->offset += block->unit_size;
     return ret;
 }
 
 static inline void free_from_block(struct FixedAllocBlock *block, void *ptr) {
-    enum StackError err = FixedAllocCache_try_push(&block->cache, ptr);
-    (void)err;
-    assert(err != STACK_FULL);
+    assert(block->live_count > 0);
+
+    struct FixedAllocFreeUnit *unit = ptr;
+    unit->next = block->free_list;
+    block->free_list = unit;
+
+    --block->live_count;
 }
 
 struct FixedAllocator fixed_alloc_init(size_t unit_size) {
+    return fixed_alloc_init_in_arena(unit_size, NULL);
+}
+
+struct FixedAllocator fixed_alloc_init_in_arena(size_t unit_size,
+                                                struct SlabArena *arena) {
+    assert(unit_size != 0 && (unit_size & (unit_size - 1)) == 0 &&
+           "unit_size must be a power of 2");
+    assert((!arena || unit_size <= SLAB_ARENA_ALIGN) &&
+           "arena blocks are only aligned to SLAB_ARENA_ALIGN");
+
+    if (unit_size < FIXED_ALLOC_MIN_UNIT_SIZE) {
+        unit_size = FIXED_ALLOC_MIN_UNIT_SIZE;
+    }
+
     struct FixedAllocBlock *blocks =
         os_alloc(FIXED_ALLOC_BLOCK_CAPACITY * sizeof(struct FixedAllocBlock));
 
-    blocks[0] = block_init(unit_size, DEFAULT_ALLOC_SIZE);
+    if (!block_init(arena, unit_size, DEFAULT_ALLOC_SIZE, &blocks[0])) {
+        assert(false);
+    }
 
     return (struct FixedAllocator){
         .block_count = 1,
         .unit_size = unit_size,
+        .non_full_blocks = block_bit(0),
+        .empty_blocks = block_bit(0),
+        .next_block_size = grow_block_size(DEFAULT_ALLOC_SIZE),
+        .blocks_by_addr = {0},
         .blocks = blocks,
+        .arena = arena,
     };
 }
 
 void fixed_alloc_deinit(struct FixedAllocator *alloc) {
     for (uint32_t i = 0; i < alloc->block_count; ++i) {
-        block_deinit(&alloc->blocks[i]);
+        block_deinit(alloc->arena, &alloc->blocks[i]);
     }
 
     os_free(alloc->blocks,
@@ -152,28 +371,48 @@ void fixed_alloc_deinit(struct FixedAllocator *alloc) {
 }
 
 void *fixed_alloc(struct FixedAllocator *alloc) {
-    for (uint32_t i = 0; i < alloc->block_count; ++i) {
-        void *ret = allocate_from_block(&alloc->blocks[i]);
+    if (alloc->non_full_blocks == 0 && !add_block(alloc)) {
+        return NULL;
+    }
 
-        if (ret) {
-            return ret;
-        }
+    uint32_t block_index = __builtin_ctzll(alloc->non_full_blocks);
+    struct FixedAllocBlock *block = &alloc->blocks[block_index];
+
+    void *ret = allocate_from_block(block);
+
+    if (!ret) {
+        errno = ENOMEM;
+        return NULL;
     }
 
-    add_block(alloc);
+    alloc->empty_blocks &= ~block_bit(block_index);
 
-    return allocate_from_block(&alloc->blocks[alloc->block_count - 1]);
+    if (is_full(block)) {
+        alloc->non_full_blocks &= ~block_bit(block_index);
+    }
+
+    return ret;
 }
 
 void fixed_free(struct FixedAllocator *alloc, void *ptr) {
-    for (uint32_t i = 0; i < alloc->block_count; ++i) {
-        struct FixedAllocBlock *block = &alloc->blocks[i];
+    uint32_t block_index = find_block_index(alloc, ptr);
+    struct FixedAllocBlock *block = &alloc->blocks[block_index];
 
-        if (is_ptr_in_block(block, ptr)) {
-            free_from_block(block, ptr);
-            return;
-        }
+    assert(is_ptr_in_block(block, ptr) &&
+           "ptr not allocated with this FixedAllocator instance");
+
+    free_from_block(block, ptr);
+    alloc->non_full_blocks |= block_bit(block_index);
+
+    if (block->live_count == 0) {
+        on_block_emptied(alloc, block_index);
     }
+}
+
+bool fixed_alloc_owns(const struct FixedAllocator *alloc, const void *ptr) {
+    uint32_t count = count_blocks_up_to(alloc, ptr);
 
-    assert(false && "ptr not allocated with this FixedAllocator instance");
+    return count > 0 &&
+           is_ptr_in_block(&alloc->blocks[alloc->blocks_by_addr[count - 1]],
+                           ptr);
 }
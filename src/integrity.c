@@ -0,0 +1,76 @@
+#include <integrity.h>
+
+#include <error.h>
+
+#include <sys/random.h>
+#include <threads.h>
+#include <time.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+static FallocCorruptionHandler corruption_handler = NULL;
+
+uintptr_t falloc_secret = 0;
+static once_flag secret_once = ONCE_FLAG_INIT;
+
+static const char *corruption_name(enum FallocCorruption corruption) {
+    switch (corruption) {
+    case FALLOC_CORRUPTION_DOUBLE_FREE:
+        return "double free";
+    case FALLOC_CORRUPTION_MISALIGNED_FREE:
+        return "misaligned free";
+    case FALLOC_CORRUPTION_FOREIGN_FREE:
+        return "free of a foreign pointer";
+    case FALLOC_CORRUPTION_CHUNK_HEADER:
+        return "corrupted chunk header";
+    }
+
+    return "unknown corruption";
+}
+
+static void default_corruption_handler(enum FallocCorruption corruption,
+                                       void *ptr) {
+    fa_print_error("falloc: %s detected at %p\n", corruption_name(corruption),
+                   ptr);
+    abort();
+}
+
+void falloc_set_corruption_handler(FallocCorruptionHandler handler) {
+    __atomic_store_n(&corruption_handler, handler, __ATOMIC_RELEASE);
+}
+
+void falloc_report_corruption(enum FallocCorruption corruption, void *ptr) {
+    FallocCorruptionHandler handler =
+        __atomic_load_n(&corruption_handler, __ATOMIC_ACQUIRE);
+
+    if (!handler) {
+        handler = &default_corruption_handler;
+    }
+
+    handler(corruption, ptr);
+}
+
+// Without getrandom() the secret is at least different between runs, through
+// ASLR and the clock. It's only stored once complete, so readers of
+// falloc_secret see either zero or the final value.
+static void secret_init(void) {
+    uintptr_t secret = 0;
+
+    if (getrandom(&secret, sizeof(secret), 0) != sizeof(secret)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        secret = (uintptr_t)&falloc_secret ^ (uintptr_t)now.tv_nsec ^
+                 ((uintptr_t)now.tv_sec << 32);
+    }
+
+    // A zero secret would leave canaries as plain addresses.
+    __atomic_store_n(&falloc_secret, secret | 1, __ATOMIC_RELEASE);
+}
+
+uintptr_t falloc_integrity_secret_slow(void) {
+    call_once(&secret_once, &secret_init);
+
+    return falloc_secret;
+}
@@ -0,0 +1,221 @@
+#include <os_allocator.h>
+
+#include <sys/mman.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SMAPS_ROLLUP_PATH "/proc/self/smaps_rollup"
+#define SMAPS_THP_FIELD   "AnonHugePages:"
+#define SMAPS_BUFFER_SIZE 4096
+#define SMAPS_KB          1024
+
+static enum OsPageKind tier_page_kinds[OS_TIER_COUNT];
+
+static size_t hugetlb_bytes = 0;
+static size_t hugetlb_fallback_count = 0;
+static size_t thp_advised_bytes = 0;
+
+static inline void counter_add(size_t *counter, size_t val) {
+    __atomic_fetch_add(counter, val, __ATOMIC_RELAXED);
+}
+
+static inline void counter_sub(size_t *counter, size_t val) {
+    __atomic_fetch_sub(counter, val, __ATOMIC_RELAXED);
+}
+
+static inline size_t counter_load(const size_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void os_set_tier_page_kind(enum OsTier tier, enum OsPageKind kind) {
+    assert(tier < OS_TIER_COUNT);
+
+    __atomic_store_n(&tier_page_kinds[tier], kind, __ATOMIC_RELAXED);
+}
+
+enum OsPageKind os_tier_page_kind(enum OsTier tier) {
+    assert(tier < OS_TIER_COUNT);
+
+    return __atomic_load_n(&tier_page_kinds[tier], __ATOMIC_RELAXED);
+}
+
+// Kernels built without THP reject MADV_HUGEPAGE. The memory is still fine to
+// use, it just stays on small pages.
+static inline enum OsPageKind advise_huge(void *ptr, size_t size) {
+    if (madvise(ptr, size, MADV_HUGEPAGE) != 0) {
+        return OS_PAGES_SMALL;
+    }
+
+    counter_add(&thp_advised_bytes, size);
+    return OS_PAGES_TRANSPARENT_HUGE;
+}
+
+static inline void *alloc_transparent_huge(size_t size,
+                                           enum OsPageKind *out_kind) {
+    size_t reserved_size = size + OS_HUGE_PAGE_SIZE - OS_ALLOC_PAGE_SIZE;
+    void *mem = os_alloc(reserved_size);
+
+    if (!mem) {
+        return NULL;
+    }
+
+    void *ptr = os_trim_to_aligned(mem, reserved_size, size, OS_HUGE_PAGE_SIZE);
+    *out_kind = advise_huge(ptr, size);
+
+    return ptr;
+}
+
+// The kernel hands out hugetlb mappings aligned to the huge page size.
+static inline void *alloc_hugetlb(size_t size) {
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+
+    counter_add(&hugetlb_bytes, size);
+    return ptr;
+}
+
+void *os_alloc_pages(size_t size, enum OsPageKind kind,
+                     enum OsPageKind *out_kind) {
+    size = os_pages_size(size, kind);
+
+    switch (kind) {
+    case OS_PAGES_SMALL:
+        *out_kind = OS_PAGES_SMALL;
+        return os_alloc(size);
+
+    case OS_PAGES_HUGETLB: {
+        void *ptr = alloc_hugetlb(size);
+
+        if (ptr) {
+            *out_kind = OS_PAGES_HUGETLB;
+            return ptr;
+        }
+
+        counter_add(&hugetlb_fallback_count, 1);
+        return alloc_transparent_huge(size, out_kind);
+    }
+
+    case OS_PAGES_TRANSPARENT_HUGE:
+        return alloc_transparent_huge(size, out_kind);
+    }
+
+    assert(false && "unknown page kind");
+    return NULL;
+}
+
+static inline bool wants_huge_reservation(size_t size, enum OsPageKind kind) {
+    return kind != OS_PAGES_SMALL && size % OS_HUGE_PAGE_SIZE == 0;
+}
+
+void *os_reserve_pages(size_t size, size_t alignment, enum OsPageKind kind,
+                       enum OsPageKind *out_kind) {
+    if (!wants_huge_reservation(size, kind)) {
+        *out_kind = OS_PAGES_SMALL;
+        return os_reserve_aligned(size, alignment);
+    }
+
+    void *ptr = os_reserve_aligned(
+        size, alignment > OS_HUGE_PAGE_SIZE ? alignment : OS_HUGE_PAGE_SIZE);
+
+    if (!ptr) {
+        return NULL;
+    }
+
+    *out_kind = advise_huge(ptr, size);
+
+    return ptr;
+}
+
+enum OsPageKind os_advise_pages(void *ptr, size_t size, enum OsPageKind kind) {
+    if (!wants_huge_reservation(size, kind)) {
+        return OS_PAGES_SMALL;
+    }
+
+    assert((uintptr_t)ptr % OS_HUGE_PAGE_SIZE == 0);
+
+    return advise_huge(ptr, size);
+}
+
+static inline void forget_pages(size_t size, enum OsPageKind kind) {
+    if (kind == OS_PAGES_HUGETLB) {
+        counter_sub(&hugetlb_bytes, size);
+    } else if (kind == OS_PAGES_TRANSPARENT_HUGE) {
+        counter_sub(&thp_advised_bytes, size);
+    }
+}
+
+int os_free_pages(void *ptr, size_t size, enum OsPageKind kind) {
+    size = os_pages_size(size, kind);
+
+    int ret = os_free(ptr, size);
+
+    if (ret == OS_FREE_OK) {
+        forget_pages(size, kind);
+    }
+
+    return ret;
+}
+
+// Mapping a fresh reservation over the range throws away the old pages and
+// the MADV_HUGEPAGE advice together.
+int os_decommit_pages(void *ptr, size_t size, enum OsPageKind kind) {
+    void *ret = mmap(ptr, size, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                     -1, 0);
+
+    if (ret == MAP_FAILED) {
+        return OS_FREE_FAIL;
+    }
+
+    forget_pages(size, kind);
+
+    return OS_FREE_OK;
+}
+
+// Reads the file with plain syscalls, so nothing here allocates.
+static size_t read_thp_backed_bytes(void) {
+    int fd = open(SMAPS_ROLLUP_PATH, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return 0;
+    }
+
+    char buffer[SMAPS_BUFFER_SIZE];
+    ssize_t len = read(fd, buffer, sizeof(buffer) - 1);
+    (void)close(fd);
+
+    if (len <= 0) {
+        return 0;
+    }
+
+    buffer[len] = '\0';
+
+    const char *field = strstr(buffer, SMAPS_THP_FIELD);
+
+    if (!field) {
+        return 0;
+    }
+
+    return strtoull(field + strlen(SMAPS_THP_FIELD), NULL, 10) * SMAPS_KB;
+}
+
+struct OsHugePageStats os_huge_page_stats(void) {
+    return (struct OsHugePageStats){
+        .hugetlb_bytes = counter_load(&hugetlb_bytes),
+        .hugetlb_fallback_count = counter_load(&hugetlb_fallback_count),
+        .thp_advised_bytes = counter_load(&thp_advised_bytes),
+        .thp_backed_bytes = read_thp_backed_bytes(),
+    };
+}
@@ -0,0 +1,204 @@
+#include <percpu_cache.h>
+
+#include <error.h>
+#include <os_allocator.h>
+#include <slab_alloc.h>
+
+#include <threads.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__linux__) && defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define PERCPU_HAVE_RSEQ 1
+#else
+#define PERCPU_HAVE_RSEQ 0
+#endif
+
+static struct PercpuClassCache *caches = NULL;
+static uint32_t cpu_count = 0;
+static bool enabled = false;
+static once_flag init_once = ONCE_FLAG_INIT;
+
+static inline struct PercpuClassCache *class_cache(uint32_t cpu,
+                                                   enum SlabSizeClass class) {
+    return &caches[((size_t)cpu * SLAB_NUM_CLASSES) + class];
+}
+
+#if PERCPU_HAVE_RSEQ
+
+// The abort handler of every critical section has to be preceded by the
+// signature the thread registered with, which for glibc is RSEQ_SIG.
+#define RSEQ_SIG_STR "0x53053053"
+
+// Labels 1 and 2 mark the start and the commit of the critical section, 3 is
+// its descriptor and 4 the abort handler, which jumps to abort_label. The
+// sections below use 5 for their end, where aborts land as well.
+#define RSEQ_CS_BEGIN(rseq_cs)                                                 \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                                       \
+    ".balign 32\n\t"                                                           \
+    "3:\n\t"                                                                   \
+    ".long 0x0, 0x0\n\t"                                                       \
+    ".quad 1f, (2f - 1f), 4f\n\t"                                              \
+    ".popsection\n\t"                                                          \
+    "leaq 3b(%%rip), %%rax\n\t"                                                \
+    "movq %%rax, " rseq_cs "\n\t"                                              \
+    "1:\n\t"
+
+#define RSEQ_CS_END(abort_label)                                               \
+    "2:\n\t"                                                                   \
+    ".pushsection __rseq_failure, \"ax\"\n\t"                                  \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                                               \
+    ".long " RSEQ_SIG_STR "\n\t"                                               \
+    "4:\n\t"                                                                   \
+    "jmp " abort_label "\n\t"                                                  \
+    ".popsection\n\t"
+
+static_assert(RSEQ_SIG == 0x53053053, "RSEQ_SIG_STR is out of date");
+
+static inline struct rseq *thread_rseq(void) {
+    return (struct rseq *)((uint8_t *)__builtin_thread_pointer() +
+                           __rseq_offset);
+}
+
+// The count store is the commit. If the thread gets preempted, migrated or
+// signaled before it, the kernel sends it to the abort handler and the cache
+// is left as it was. Everything the sections write is an output, the memory
+// clobber only covers the slots.
+static inline bool rseq_push(struct rseq *rseq, uint32_t cpu,
+                             struct PercpuClassCache *cache, void *ptr) {
+    uint32_t pushed = 0;
+
+    __asm__ volatile(RSEQ_CS_BEGIN("%[rseq_cs]")
+                     "cmpl %[cpu], %[cpu_id]\n\t"
+                     "jnz 5f\n\t"
+                     "movq %[count], %%rcx\n\t"
+                     "cmpq %[capacity], %%rcx\n\t"
+                     "jae 5f\n\t"
+                     "movq %[ptr], (%[slots], %%rcx, 8)\n\t"
+                     "incq %%rcx\n\t"
+                     "movq %%rcx, %[count]\n\t"
+                     RSEQ_CS_END("5f")
+                     "movl $1, %[pushed]\n\t"
+                     "5:\n\t"
+                     : [rseq_cs] "+m"(rseq->rseq_cs),
+                       [count] "+m"(cache->count), [pushed] "+r"(pushed)
+                     : [cpu_id] "m"(rseq->cpu_id), [cpu] "r"(cpu),
+                       [capacity] "i"(PERCPU_CACHE_CLASS_CAPACITY),
+                       [ptr] "r"(ptr), [slots] "r"(cache->slots)
+                     : "memory", "cc", "rax", "rcx");
+
+    return pushed != 0;
+}
+
+// The object is only copied to ret past the commit, so an aborted pop returns
+// null.
+static inline void *rseq_pop(struct rseq *rseq, uint32_t cpu,
+                             struct PercpuClassCache *cache) {
+    void *ret = NULL;
+
+    __asm__ volatile(RSEQ_CS_BEGIN("%[rseq_cs]")
+                     "cmpl %[cpu], %[cpu_id]\n\t"
+                     "jnz 5f\n\t"
+                     "movq %[count], %%rcx\n\t"
+                     "testq %%rcx, %%rcx\n\t"
+                     "jz 5f\n\t"
+                     "decq %%rcx\n\t"
+                     "movq (%[slots], %%rcx, 8), %%rax\n\t"
+                     "movq %%rcx, %[count]\n\t"
+                     RSEQ_CS_END("5f")
+                     "movq %%rax, %[ret]\n\t"
+                     "5:\n\t"
+                     : [rseq_cs] "+m"(rseq->rseq_cs),
+                       [count] "+m"(cache->count), [ret] "+r"(ret)
+                     : [cpu_id] "m"(rseq->cpu_id), [cpu] "r"(cpu),
+                       [slots] "r"(cache->slots)
+                     : "memory", "cc", "rax", "rcx");
+
+    return ret;
+}
+
+// glibc registers every thread it creates and leaves __rseq_size at 0 when
+// that failed or was turned off.
+static inline bool rseq_available(void) {
+    return __rseq_size != 0 && (int32_t)thread_rseq()->cpu_id >= 0;
+}
+
+#endif // PERCPU_HAVE_RSEQ
+
+static void init(void) {
+#if PERCPU_HAVE_RSEQ
+    if (!rseq_available()) {
+        return;
+    }
+
+    long configured_cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+    if (configured_cpus <= 0) {
+        return;
+    }
+
+    size_t size = (size_t)configured_cpus * SLAB_NUM_CLASSES *
+                  sizeof(struct PercpuClassCache);
+
+    // Zeroed by the OS, so every cache starts out empty.
+    caches = os_alloc(size);
+
+    if (!caches) {
+        fa_print_errno("os_alloc() failed in percpu_cache_init()");
+        return;
+    }
+
+    cpu_count = (uint32_t)configured_cpus;
+    __atomic_store_n(&enabled, true, __ATOMIC_RELEASE);
+#endif
+}
+
+bool percpu_cache_init(void) {
+    call_once(&init_once, &init);
+
+    return percpu_cache_is_enabled();
+}
+
+bool percpu_cache_is_enabled(void) {
+    return __atomic_load_n(&enabled, __ATOMIC_ACQUIRE);
+}
+
+// The kernel never sets cpu_id for a thread that isn't registered, so the
+// critical section always aborts for it.
+bool percpu_cache_push(enum SlabSizeClass class, void *ptr) {
+#if PERCPU_HAVE_RSEQ
+    struct rseq *rseq = thread_rseq();
+    uint32_t cpu = __atomic_load_n(&rseq->cpu_id_start, __ATOMIC_RELAXED);
+
+    if (cpu >= cpu_count) {
+        return false;
+    }
+
+    return rseq_push(rseq, cpu, class_cache(cpu, class), ptr);
+#else
+    (void)class;
+    (void)ptr;
+    return false;
+#endif
+}
+
+void *percpu_cache_pop(enum SlabSizeClass class) {
+#if PERCPU_HAVE_RSEQ
+    struct rseq *rseq = thread_rseq();
+    uint32_t cpu = __atomic_load_n(&rseq->cpu_id_start, __ATOMIC_RELAXED);
+
+    if (cpu >= cpu_count) {
+        return NULL;
+    }
+
+    return rseq_pop(rseq, cpu, class_cache(cpu, class));
+#else
+    (void)class;
+    return NULL;
+#endif
+}
@@ -1,175 +1,245 @@
 #include <rtree.h>
 
-#include <fixed_alloc.h>
+#include <error.h>
+#include <os_allocator.h>
+#include <slow_paths.h>
 
 #include <assert.h>
 #include <stddef.h>
 #include <stdint.h>
 
-static inline uint8_t get_byte_from_ptr(void *ptr, int byte_index) {
-    union {
-        void *ptr;
-        uint8_t bytes[sizeof(void *)];
-    } converter = {.ptr = ptr};
+#define KEY_MASK     (((uintptr_t)1 << RTREE_KEY_BITS) - 1)
+#define GRANULE_MASK (RTREE_GRANULE_SIZE - 1)
+#define NODE_MASK    (RTREE_NODE_ENTRIES - 1)
 
-    return converter.bytes[sizeof(void *) - 1 - byte_index];
-}
+#define ROOT_SIZE (RTREE_ROOT_ENTRIES * sizeof(struct RtreeNode *))
 
-static inline struct RtreeNode *node_init(struct Rtree *rtree) {
-    assert(rtree->node_allocator.unit_size == sizeof(struct RtreeNode));
+static inline uintptr_t key_from_ptr(const void *ptr) {
+    return ((uintptr_t)ptr & KEY_MASK) >> RTREE_GRANULE_BITS;
+}
 
-    struct RtreeNode *node = fixed_alloc(&rtree->node_allocator);
+static inline size_t root_index(uintptr_t key) {
+    return key >> (2 * RTREE_NODE_BITS);
+}
 
-    for (int i = 0; i <= UINT8_MAX; ++i) {
-        node->entries[i].next = NULL;
-    }
+static inline size_t interior_index(uintptr_t key) {
+    return (key >> RTREE_NODE_BITS) & NODE_MASK;
+}
 
-    node->node_count = 0;
+static inline size_t last_level_index(uintptr_t key) {
+    return key & NODE_MASK;
+}
 
-    return node;
+static inline RtreeLeaf leaf_encode(const void *ptr, size_t size) {
+    return (size << RTREE_GRANULE_BITS) | ((uintptr_t)ptr & GRANULE_MASK);
 }
 
-static inline void node_deinit(struct Rtree *rtree, struct RtreeNode *node) {
-    fixed_free(&rtree->node_allocator, node);
+static inline bool leaf_matches(RtreeLeaf leaf, const void *ptr) {
+    return leaf != 0 &&
+           (leaf & GRANULE_MASK) == ((uintptr_t)ptr & GRANULE_MASK);
 }
 
-static inline size_t *leaf_alloc(struct Rtree *rtree) {
-    return fixed_alloc(&rtree->leaf_allocator);
+static inline size_t leaf_size(RtreeLeaf leaf) {
+    return leaf >> RTREE_GRANULE_BITS;
 }
 
-static inline void leaf_free(struct Rtree *rtree, size_t *leaf) {
-    return fixed_free(&rtree->leaf_allocator, leaf);
+// Nodes come straight from the OS, so they are already zeroed. They are rare
+// enough (a last level node covers 4 MB) for a mapping each to be fine.
+static inline struct RtreeNode *node_init(void) {
+    struct RtreeNode *node = os_alloc(sizeof(struct RtreeNode));
+
+    if (!node) {
+        fa_print_errno("os_alloc() failed in node_init()");
+        assert(false);
+    }
+
+    falloc_count_slow_path(FALLOC_SLOW_PATH_RTREE_NODE);
+
+    return node;
 }
 
-struct Rtree rtree_init(void) {
-    return (struct Rtree){
-        .head = NULL,
-        .node_allocator = fixed_alloc_init(sizeof(struct RtreeNode)),
-        .leaf_allocator = fixed_alloc_init(sizeof(size_t)),
-    };
+static inline void node_deinit(struct RtreeNode *node) {
+    if (os_free(node, sizeof(struct RtreeNode)) == OS_FREE_FAIL) {
+        fa_print_errno("os_free() failed in node_deinit()");
+        assert(false);
+    }
 }
 
-void rtree_deinit(struct Rtree *rtree) {
-    fixed_alloc_deinit(&rtree->node_allocator);
+static inline struct RtreeNode *node_load(struct RtreeNode **slot) {
+    return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
 }
 
-void rtree_push_ptr(struct Rtree *rtree, void *ptr, size_t allocated_size) {
-    if (!rtree->head) {
-        rtree->head = node_init(rtree);
+// If another thread installs a node in the slot first, that one is used.
+static inline struct RtreeNode *node_load_or_create(struct RtreeNode **slot) {
+    struct RtreeNode *node = node_load(slot);
+
+    if (node) {
+        return node;
     }
 
-    struct RtreeNode *curr_entry = rtree->head;
+    struct RtreeNode *new_node = node_init();
 
-    for (int i = 0; i < RTREE_DEPTH - 1; ++i) {
-        uint8_t byte = get_byte_from_ptr(ptr, i);
+    if (__atomic_compare_exchange_n(slot, &node, new_node, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return new_node;
+    }
 
-        if (!curr_entry->entries[byte].next) {
-            curr_entry->entries[byte].next = node_init(rtree);
-            ++curr_entry->node_count;
-        }
+    node_deinit(new_node);
+    return node;
+}
 
-        curr_entry = curr_entry->entries[byte].next;
-    }
+static inline RtreeLeaf leaf_load(const RtreeLeaf *leaf) {
+    return __atomic_load_n(leaf, __ATOMIC_ACQUIRE);
+}
+
+static inline void leaf_store(RtreeLeaf *leaf, RtreeLeaf val) {
+    __atomic_store_n(leaf, val, __ATOMIC_RELEASE);
+}
 
-    uint8_t byte = get_byte_from_ptr(ptr, RTREE_DEPTH - 1);
+// Returns null if there is no last level node covering ptr.
+static inline RtreeLeaf *leaf_lookup(const struct Rtree *rtree,
+                                     const void *ptr) {
+    uintptr_t key = key_from_ptr(ptr);
 
-    assert(!curr_entry->entries[byte].leaf);
+    struct RtreeNode *interior = node_load(&rtree->root[root_index(key)]);
 
-    if (!curr_entry->entries[byte].leaf) {
-        curr_entry->entries[byte].leaf = fixed_alloc(&rtree->leaf_allocator);
-        ++curr_entry->node_count;
+    if (!interior) {
+        return NULL;
     }
 
-    *curr_entry->entries[byte].leaf = allocated_size;
-}
+    struct RtreeNode *last_level =
+        node_load(&interior->entries[interior_index(key)].next);
 
-void rtree_remove_ptr(struct Rtree *rtree, void *ptr, size_t *out_stored_leaf) {
-    struct RtreeNode *nodes[RTREE_DEPTH];
+    if (!last_level) {
+        return NULL;
+    }
 
-    nodes[0] = rtree->head;
+    return &last_level->entries[last_level_index(key)].leaf;
+}
 
-    for (int i = 1; i < RTREE_DEPTH; ++i) {
-        assert(nodes[i - 1]);
+static inline RtreeLeaf *leaf_lookup_or_create(struct Rtree *rtree,
+                                               const void *ptr) {
+    uintptr_t key = key_from_ptr(ptr);
 
-        uint8_t byte = get_byte_from_ptr(ptr, i - 1);
+    struct RtreeNode *interior =
+        node_load_or_create(&rtree->root[root_index(key)]);
 
-        nodes[i] = nodes[i - 1]->entries[byte].next;
-    }
+    struct RtreeNode *last_level =
+        node_load_or_create(&interior->entries[interior_index(key)].next);
 
-    uint8_t byte = get_byte_from_ptr(ptr, RTREE_DEPTH - 1);
+    return &last_level->entries[last_level_index(key)].leaf;
+}
 
-    assert(nodes[RTREE_DEPTH - 1]->entries[byte].leaf);
+struct Rtree rtree_init(void) {
+    enum OsPageKind root_page_kind = OS_PAGES_SMALL;
+    struct RtreeNode **root = os_alloc_pages(
+        ROOT_SIZE, os_tier_page_kind(OS_TIER_METADATA), &root_page_kind);
 
-    if (out_stored_leaf) {
-        *out_stored_leaf = *nodes[RTREE_DEPTH - 1]->entries[byte].leaf;
+    if (!root) {
+        fa_print_errno("os_alloc_pages() failed in rtree_init()");
+        assert(false);
     }
 
-    leaf_free(rtree, nodes[RTREE_DEPTH - 1]->entries[byte].leaf);
+    return (struct Rtree){
+        .root = root,
+        .root_page_kind = root_page_kind,
+    };
+}
 
-    nodes[RTREE_DEPTH - 1]->entries[byte].leaf = NULL;
-    --nodes[RTREE_DEPTH - 1]->node_count;
+// Nodes are never released before this point. Big allocations keep reusing the
+// same address ranges, so the nodes covering them get reused as well. This also
+// means a node can never be pulled from under a concurrent lookup.
+void rtree_deinit(struct Rtree *rtree) {
+    for (size_t i = 0; i < RTREE_ROOT_ENTRIES; ++i) {
+        struct RtreeNode *interior = rtree->root[i];
 
-    for (int i = RTREE_DEPTH - 1; i > 0; --i) {
-        if (nodes[i]->node_count != 0) {
+        if (!interior) {
             continue;
         }
 
-        uint8_t byte = get_byte_from_ptr(ptr, i - 1);
+        for (size_t j = 0; j < RTREE_NODE_ENTRIES; ++j) {
+            if (interior->entries[j].next) {
+                node_deinit(interior->entries[j].next);
+            }
+        }
 
-        node_deinit(rtree, nodes[i]);
-        nodes[i - 1]->entries[byte].next = NULL;
-        --nodes[i - 1]->node_count;
+        node_deinit(interior);
     }
 
-    if (rtree->head->node_count == 0) {
-        node_deinit(rtree, rtree->head);
+    if (os_free_pages(rtree->root, ROOT_SIZE, rtree->root_page_kind) ==
+        OS_FREE_FAIL) {
+        fa_print_errno("os_free_pages() failed in rtree_deinit()");
+        assert(false);
     }
+
+    rtree->root = NULL;
 }
 
-bool rtree_contains(struct Rtree *rtree, void *ptr) {
-    struct RtreeNode *node = rtree->head;
+void rtree_push_ptr(struct Rtree *rtree, void *ptr, size_t allocated_size) {
+    assert(allocated_size != 0 && allocated_size <= RTREE_MAX_SIZE);
 
-    if (!node) {
-        return false;
-    }
+    RtreeLeaf *leaf = leaf_lookup_or_create(rtree, ptr);
 
-    for (int i = 0; i < RTREE_DEPTH - 1; ++i) {
-        union RtreeEntry entry = node->entries[get_byte_from_ptr(ptr, i)];
+    assert(leaf_load(leaf) == 0 &&
+           "another key is stored in the same granule");
 
-        if (!entry.next) {
-            return false;
-        }
+    leaf_store(leaf, leaf_encode(ptr, allocated_size));
+}
+
+void rtree_remove_ptr(struct Rtree *rtree, void *ptr, size_t *out_stored_leaf) {
+    RtreeLeaf *leaf = leaf_lookup(rtree, ptr);
+    assert(leaf);
+
+    RtreeLeaf stored = leaf_load(leaf);
+    assert(leaf_matches(stored, ptr));
 
-        node = entry.next;
+    if (out_stored_leaf) {
+        *out_stored_leaf = leaf_size(stored);
     }
 
-    return node->entries[get_byte_from_ptr(ptr, RTREE_DEPTH - 1)].leaf != NULL;
+    leaf_store(leaf, 0);
 }
 
-bool rtree_retrieve_size_if_contains(struct Rtree *rtree, void *ptr,
-                                     size_t *out) {
-    struct RtreeNode *node = rtree->head;
+bool rtree_remove_ptr_if_contains(struct Rtree *rtree, void *ptr,
+                                  size_t *out_stored_leaf) {
+    RtreeLeaf *leaf = leaf_lookup(rtree, ptr);
 
-    if (!node) {
+    if (!leaf) {
         return false;
     }
 
-    for (int i = 0; i < RTREE_DEPTH - 1; ++i) {
-        union RtreeEntry entry = node->entries[get_byte_from_ptr(ptr, i)];
-
-        if (!entry.next) {
-            return false;
-        }
+    RtreeLeaf stored = leaf_load(leaf);
 
-        node = entry.next;
+    if (!leaf_matches(stored, ptr)) {
+        return false;
     }
 
-    size_t *leaf = node->entries[get_byte_from_ptr(ptr, RTREE_DEPTH - 1)].leaf;
+    *out_stored_leaf = leaf_size(stored);
+    leaf_store(leaf, 0);
+
+    return true;
+}
+
+bool rtree_contains(struct Rtree *rtree, void *ptr) {
+    RtreeLeaf *leaf = leaf_lookup(rtree, ptr);
+
+    return leaf && leaf_matches(leaf_load(leaf), ptr);
+}
+
+bool rtree_retrieve_size_if_contains(struct Rtree *rtree, void *ptr,
+                                     size_t *out) {
+    RtreeLeaf *leaf = leaf_lookup(rtree, ptr);
 
     if (!leaf) {
         return false;
     }
 
-    *out = *leaf;
+    RtreeLeaf stored = leaf_load(leaf);
+
+    if (!leaf_matches(stored, ptr)) {
+        return false;
+    }
+
+    *out = leaf_size(stored);
     return true;
 }
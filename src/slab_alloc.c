@@ -3,7 +3,10 @@
 #include <bitmap.h>
 #include <error.h>
 #include <fixed_alloc.h>
+#include <integrity.h>
 #include <os_allocator.h>
+#include <slab_arena.h>
+#include <slow_paths.h>
 #include <stack_definition.h>
 
 #include <pthread.h>
@@ -18,6 +21,13 @@ STACK_DEFINE(CacheOffset, CacheSizeType, CacheStack)
 #define DEFAULT_CACHE_CAPACITY    100
 #define SIZE_TO_CLASS_LOOKUP_SIZE (2UL * FA_PAGE_SIZE)
 
+// Once the shared pool holds this many spans, a heap gives its own spans back
+// to its FixedAllocator instead, so whole blocks can still go back to the OS.
+#define SHARED_SPAN_SOFT_LIMIT 1024
+
+static_assert(SLAB_SIZE == SLAB_ARENA_SPAN_SIZE,
+              "the shared span pool works in slabs");
+
 static SlabSize *size_to_class_lookup = NULL;
 static SlabSize *num_of_elems_per_class_lookup = NULL;
 
@@ -67,8 +77,8 @@ static inline void setup_num_of_elems_per_class_lookup() {
         const float one_eighth = 1.0F / 8.0F;
 
         const SlabSize buff_size =
-            SLAB_SIZE - (DEFAULT_CACHE_CAPACITY * sizeof(CacheOffset)) -
-            sizeof(struct Slab);
+            SLAB_SIZE - SLAB_COLOR_SPACE -
+            (DEFAULT_CACHE_CAPACITY * sizeof(CacheOffset)) - SLAB_HEADER_SIZE;
         const float bits_per_byte = 8.0F;
         const float bitmap_elem_size = 1 / bits_per_byte;
 
@@ -107,12 +117,25 @@ static inline bool decrement_alloc_counter(struct Slab *slab) {
 }
 
 struct Slab *slab_from_ptr(void *ptr) {
-    char *ptr_down_aligned = (char *)align_down_to_slab_size(ptr);
+    return slab_header_in_span(align_down_to_slab_size(ptr));
+}
 
-    struct Slab *slab_metadata =
-        (struct Slab *)(ptr_down_aligned + SLAB_SIZE - sizeof(struct Slab));
+// An object whose bit is already 0 went back to its slab before.
+static inline bool is_live_object(struct Slab *slab, void *ptr) {
+    if (!slab_is_valid_object(slab, ptr)) {
+        return false;
+    }
 
-    return slab_metadata;
+    SlabSize offset = (uint8_t *)ptr - slab->data;
+    size_t bitmap_index =
+        (size_t)((float)offset * SLAB_SIZE_CLASS_RECIPROCALS[slab->size_class]);
+
+    if (!bitmap_is_set(&slab->bitmap, bitmap_index)) {
+        falloc_report_corruption(FALLOC_CORRUPTION_DOUBLE_FREE, ptr);
+        return false;
+    }
+
+    return true;
 }
 
 bool slab_alloc_is_ptr_in_this_instance(const struct SlabAlloc *alloc,
@@ -120,6 +143,11 @@ bool slab_alloc_is_ptr_in_this_instance(const struct SlabAlloc *alloc,
     assert(alloc != NULL);
     assert(ptr != NULL);
 
+    // Only pointers inside the arena have slab metadata to look at.
+    if (!slab_arena_contains(ptr)) {
+        return false;
+    }
+
     struct Slab *slab = slab_from_ptr(ptr);
     return slab->owner == alloc;
 }
@@ -127,7 +155,7 @@ bool slab_alloc_is_ptr_in_this_instance(const struct SlabAlloc *alloc,
 static inline void *slab_buff_end(const struct Slab *slab) {
     assert(slab != NULL);
 
-    return slab->data + SLAB_SIZE - sizeof(struct Slab);
+    return (void *)slab;
 }
 
 static inline bool is_ptr_in_slab(const struct Slab *slab, void *ptr) {
@@ -138,7 +166,46 @@ static inline bool is_ptr_in_slab(const struct Slab *slab, void *ptr) {
     );
 }
 
-static inline void slab_init(struct SlabAlloc *alloc, struct Slab *parent,
+// A heap's own spare spans come first, then the shared pool, and only then its
+// FixedAllocator, which might have to map a new block.
+static inline void *take_span(struct SlabAlloc *alloc) {
+    if (alloc->spare_span_count != 0) {
+        --alloc->spare_span_count;
+        return alloc->spare_spans[alloc->spare_span_count];
+    }
+
+    void *span = slab_arena_pop_free_span(alloc->fixed_alloc.arena);
+
+    if (span) {
+        return span;
+    }
+
+    return fixed_alloc(&alloc->fixed_alloc);
+}
+
+// A span from the pool can belong to any heap, and the FixedAllocator it came
+// from still counts it as live, so only this heap's own spans can ever go back
+// to its FixedAllocator.
+static inline void give_back_span(struct SlabAlloc *alloc, void *span) {
+    if (alloc->spare_span_count < SLAB_SPARE_SPAN_CAPACITY) {
+        alloc->spare_spans[alloc->spare_span_count] = span;
+        ++alloc->spare_span_count;
+        return;
+    }
+
+    struct SlabArena *arena = alloc->fixed_alloc.arena;
+
+    if (slab_arena_free_span_count(arena) >= SHARED_SPAN_SOFT_LIMIT &&
+        fixed_alloc_owns(&alloc->fixed_alloc, span)) {
+        fixed_free(&alloc->fixed_alloc, span);
+        return;
+    }
+
+    slab_arena_push_free_span(arena, span);
+}
+
+// Returns false when no span is left for the slab.
+static inline bool slab_init(struct SlabAlloc *alloc, struct Slab *parent,
                              struct Slab **slab, enum SlabSizeClass class) {
     // static int counts[SLAB_NUM_CLASSES];
     // ++counts[class];
@@ -149,22 +216,28 @@ static inline void slab_init(struct SlabAlloc *alloc, struct Slab *parent,
     // assert(slab != NULL);
     // assert(*slab == NULL && "Slab already initialized.");
 
-    uint8_t *mem = (uint8_t *)fixed_alloc(&alloc->fixed_alloc);
-    assert(mem != NULL);
+    falloc_count_slow_path(FALLOC_SLOW_PATH_SLAB_INIT);
 
-    *slab = (struct Slab *)(mem + SLAB_SIZE) - 1;
+    uint8_t *mem = (uint8_t *)take_span(alloc);
+
+    if (!mem) {
+        return false;
+    }
+
+    *slab = slab_header_in_span(mem);
+    uint8_t *data = slab_objects_in_span(mem);
 
     SlabSize num_of_elems = num_of_elems_per_class_lookup[class];
 
     SlabSize *bitmap_data =
-        (SlabSize *)(mem + (size_t)(num_of_elems * SLAB_SIZES[class]));
+        (SlabSize *)(data + (size_t)(num_of_elems * SLAB_SIZES[class]));
 
     CacheOffset *cache_data = (CacheOffset *)(*slab) - DEFAULT_CACHE_CAPACITY;
 
     assert(is_aligned((uintptr_t)bitmap_data, sizeof(BitmapSize)));
 
     **slab = (struct Slab){
-        .data = mem,
+        .data = data,
         .total_alloc_count = 0,
         .max_alloc_count = 0,
         .bitmap = bitmap_init(bitmap_data, num_of_elems),
@@ -174,6 +247,8 @@ static inline void slab_init(struct SlabAlloc *alloc, struct Slab *parent,
         .prev_slab = parent,
         .owner = alloc,
     };
+
+    return true;
 }
 
 static inline void slab_deinit(struct SlabAlloc *alloc, struct Slab *slab) {
@@ -187,7 +262,13 @@ static inline void slab_deinit(struct SlabAlloc *alloc, struct Slab *slab) {
         slab->next_slab->prev_slab = slab->prev_slab;
     }
 
-    fixed_free(&alloc->fixed_alloc, slab->data);
+    give_back_span(alloc, align_down_to_slab_size(slab->data));
+}
+
+enum SlabSizeClass slab_size_class(size_t size) {
+    assert(size <= SLAB_CLASS_MAX);
+
+    return size_to_class_lookup[size];
 }
 
 struct SlabAlloc slab_alloc_init(struct Falloc *owner) {
@@ -199,11 +280,13 @@ struct SlabAlloc slab_alloc_init(struct Falloc *owner) {
         setup_num_of_elems_per_class_lookup();
     }
 
-    struct FixedAllocator fixed_alloc = fixed_alloc_init(SLAB_SIZE);
+    struct FixedAllocator fixed_alloc =
+        fixed_alloc_init_in_arena(SLAB_SIZE, slab_arena_get());
 
     struct SlabAlloc alloc;
     memset((void *)alloc.slabs, 0, sizeof(alloc.slabs));
     alloc.fixed_alloc = fixed_alloc;
+    alloc.spare_span_count = 0;
     alloc.owner = owner;
 
     return alloc;
@@ -220,8 +303,9 @@ void *slab_alloc(struct SlabAlloc *alloc, size_t size) {
 
     enum SlabSizeClass class = size_to_class_lookup[size];
 
-    if (!alloc->slabs[class]) {
-        slab_init(alloc, NULL, &alloc->slabs[class], class);
+    if (!alloc->slabs[class] &&
+        !slab_init(alloc, NULL, &alloc->slabs[class], class)) {
+        return NULL;
     }
 
     struct Slab *slab = alloc->slabs[class];
@@ -248,8 +332,9 @@ void *slab_alloc(struct SlabAlloc *alloc, size_t size) {
             return (char *)slab->data + (size_t)(free_slot * SLAB_SIZES[class]);
         }
 
-        if (!slab->next_slab) {
-            slab_init(alloc, slab, &slab->next_slab, class);
+        if (!slab->next_slab &&
+            !slab_init(alloc, slab, &slab->next_slab, class)) {
+            return NULL;
         }
 
         slab = slab->next_slab;
@@ -258,6 +343,11 @@ void *slab_alloc(struct SlabAlloc *alloc, size_t size) {
 
 enum FaFreeRet slab_free(struct SlabAlloc *alloc, void *ptr) {
     struct Slab *slab = slab_from_ptr(ptr);
+
+    if (FALLOC_CHECKS_ENABLED && !is_live_object(slab, ptr)) {
+        return CORRUPTION_DETECTED;
+    }
+
     assert((uint8_t *)ptr >= slab->data);
 
     SlabSize offset = (uint8_t *)ptr - slab->data;
@@ -269,11 +359,12 @@ enum FaFreeRet slab_free(struct SlabAlloc *alloc, void *ptr) {
 
     CacheStack_try_push(&slab->cache, (CacheOffset)offset);
 
-    (void)alloc;
-    // if (slab->prev_slab &&
-    //     handle_decrementing_alloc_counter(slab) == SHOULD_DESTROY_SLAB) {
-    //     slab_deinit(alloc, slab);
-    // }
+    // The first slab of each class is kept, so a class that keeps emptying and
+    // refilling one slab doesn't go back to the FixedAllocator every time.
+    if (decrement_alloc_counter(slab) == SHOULD_DESTROY_SLAB &&
+        slab->prev_slab) {
+        slab_deinit(alloc, slab);
+    }
 
     return OK;
 }
@@ -310,5 +401,11 @@ void *slab_realloc(struct SlabAlloc *alloc, void *ptr, size_t size) {
 
 size_t slab_memsize(void *ptr) {
     struct Slab *slab = slab_from_ptr(ptr);
+
+    // An fcache slab, whose objects have no size class.
+    if (slab->size_class == SLAB_CLASS_INVALID) {
+        return 0;
+    }
+
     return SLAB_SIZES[slab->size_class];
 }
@@ -0,0 +1,255 @@
+#include <slab_arena.h>
+
+#include <error.h>
+#include <os_allocator.h>
+
+#include <pthread.h>
+#include <threads.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct SlabArenaBounds slab_arena_bounds = {
+    .begin = NULL,
+    .size = 0,
+};
+
+#define FREE_SPAN_LINKS_SIZE (SLAB_ARENA_SPAN_COUNT * sizeof(uint32_t))
+#define FREE_RANGES_SIZE                                                       \
+    (SLAB_ARENA_FREE_RANGE_CAPACITY * sizeof(struct SlabArenaRange))
+
+#define SPAN_HEAD_INDEX_BITS 32
+#define SPAN_HEAD_INDEX_MASK (((uint64_t)1 << SPAN_HEAD_INDEX_BITS) - 1)
+
+static struct SlabArena arena;
+static once_flag arena_once = ONCE_FLAG_INIT;
+
+static void arena_init(void) {
+    uint8_t *begin = os_reserve_aligned(SLAB_ARENA_SIZE, SLAB_ARENA_ALIGN);
+
+    if (!begin) {
+        fa_print_errno("os_reserve_aligned() failed in arena_init()");
+        assert(false);
+    }
+
+    // Only the links of spans that actually get pooled are ever committed.
+    uint32_t *free_span_links = os_alloc(FREE_SPAN_LINKS_SIZE);
+
+    struct SlabArenaRange *free_ranges = os_alloc(FREE_RANGES_SIZE);
+
+    if (!free_span_links || !free_ranges) {
+        fa_print_errno("os_alloc() failed in arena_init()");
+        assert(false);
+    }
+
+    pthread_mutex_init(&arena.lock, NULL);
+    arena.begin = begin;
+    arena.bump = begin;
+    arena.end = begin + SLAB_ARENA_SIZE;
+    arena.free_range_count = 0;
+    arena.free_ranges = free_ranges;
+    arena.free_span_head = 0;
+    arena.free_span_links = free_span_links;
+    arena.free_span_count = 0;
+
+    slab_arena_bounds.begin = begin;
+    __atomic_store_n(&slab_arena_bounds.size, SLAB_ARENA_SIZE,
+                     __ATOMIC_RELEASE);
+}
+
+struct SlabArena *slab_arena_get(void) {
+    call_once(&arena_once, &arena_init);
+
+    return &arena;
+}
+
+static inline void remove_free_range(struct SlabArena *arena, size_t index) {
+    --arena->free_range_count;
+    arena->free_ranges[index] = arena->free_ranges[arena->free_range_count];
+}
+
+// Best fit, split from the front when the range is bigger than size.
+static inline void *take_free_range(struct SlabArena *arena, size_t size) {
+    size_t best = arena->free_range_count;
+
+    for (size_t i = 0; i < arena->free_range_count; ++i) {
+        size_t range_size = arena->free_ranges[i].size;
+
+        if (range_size >= size &&
+            (best == arena->free_range_count ||
+             range_size < arena->free_ranges[best].size)) {
+            best = i;
+        }
+    }
+
+    if (best == arena->free_range_count) {
+        return NULL;
+    }
+
+    struct SlabArenaRange *range = &arena->free_ranges[best];
+    uint8_t *ptr = range->begin;
+
+    if (range->size == size) {
+        remove_free_range(arena, best);
+    } else {
+        range->begin += size;
+        range->size -= size;
+    }
+
+    return ptr;
+}
+
+// Released ranges never touch each other, so only the ranges right before and
+// right after the new one can merge with it.
+static inline void add_free_range(struct SlabArena *arena, uint8_t *begin,
+                                  size_t size) {
+    uint8_t *end = begin + size;
+    size_t i = 0;
+
+    while (i < arena->free_range_count) {
+        struct SlabArenaRange range = arena->free_ranges[i];
+
+        if (range.begin + range.size == begin) {
+            begin = range.begin;
+        } else if (range.begin == end) {
+            end = range.begin + range.size;
+        } else {
+            ++i;
+            continue;
+        }
+
+        remove_free_range(arena, i);
+    }
+
+    if (end == arena->bump) {
+        arena->bump = begin;
+        return;
+    }
+
+    assert(arena->free_range_count < SLAB_ARENA_FREE_RANGE_CAPACITY);
+
+    arena->free_ranges[arena->free_range_count] = (struct SlabArenaRange){
+        .begin = begin,
+        .size = (size_t)(end - begin),
+    };
+    ++arena->free_range_count;
+}
+
+static inline void *take_bump_range(struct SlabArena *arena, size_t size) {
+    if ((size_t)(arena->end - arena->bump) < size) {
+        return NULL;
+    }
+
+    void *ptr = arena->bump;
+    arena->bump += size;
+
+    return ptr;
+}
+
+void *slab_arena_reserve(struct SlabArena *arena, size_t size,
+                         enum OsPageKind kind, enum OsPageKind *out_kind) {
+    assert(size != 0 && size % SLAB_ARENA_ALIGN == 0);
+
+    int err_code = pthread_mutex_lock(&arena->lock);
+    assert(err_code == 0);
+
+    void *ptr = take_free_range(arena, size);
+
+    if (!ptr) {
+        ptr = take_bump_range(arena, size);
+    }
+
+    err_code = pthread_mutex_unlock(&arena->lock);
+    assert(err_code == 0);
+    (void)err_code;
+
+    if (!ptr) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    *out_kind = os_advise_pages(ptr, size, kind);
+
+    return ptr;
+}
+
+void slab_arena_release(struct SlabArena *arena, void *ptr, size_t size,
+                        enum OsPageKind kind) {
+    assert(slab_arena_contains(ptr));
+
+    if (os_decommit_pages(ptr, size, kind) == OS_FREE_FAIL) {
+        fa_print_errno("os_decommit_pages() failed in slab_arena_release()");
+        assert(false);
+    }
+
+    int err_code = pthread_mutex_lock(&arena->lock);
+    assert(err_code == 0);
+
+    add_free_range(arena, ptr, size);
+
+    err_code = pthread_mutex_unlock(&arena->lock);
+    assert(err_code == 0);
+    (void)err_code;
+}
+
+static inline uint32_t span_index(const struct SlabArena *arena,
+                                  const void *span) {
+    return (uint32_t)(((const uint8_t *)span - arena->begin) /
+                      SLAB_ARENA_SPAN_SIZE);
+}
+
+static inline uint64_t span_head(uint64_t prev_head, uint32_t link) {
+    uint64_t tag = (prev_head >> SPAN_HEAD_INDEX_BITS) + 1;
+
+    return (tag << SPAN_HEAD_INDEX_BITS) | link;
+}
+
+static inline uint32_t span_head_link(uint64_t head) {
+    return (uint32_t)(head & SPAN_HEAD_INDEX_MASK);
+}
+
+void slab_arena_push_free_span(struct SlabArena *arena, void *span) {
+    assert(slab_arena_contains(span));
+    assert((uintptr_t)span % SLAB_ARENA_SPAN_SIZE == 0);
+
+    uint32_t index = span_index(arena, span);
+    uint32_t *link = &arena->free_span_links[index];
+    uint64_t head = __atomic_load_n(&arena->free_span_head, __ATOMIC_RELAXED);
+
+    // Counted before the span shows up, so a pop can never take the count
+    // below zero.
+    __atomic_fetch_add(&arena->free_span_count, 1, __ATOMIC_RELAXED);
+
+    do {
+        __atomic_store_n(link, span_head_link(head), __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&arena->free_span_head, &head,
+                                          span_head(head, index + 1), true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// The link of a span that another thread pops first can be overwritten under
+// us, but then the head changed as well and the CAS fails.
+void *slab_arena_pop_free_span(struct SlabArena *arena) {
+    uint64_t head = __atomic_load_n(&arena->free_span_head, __ATOMIC_ACQUIRE);
+
+    while (span_head_link(head) != 0) {
+        uint32_t index = span_head_link(head) - 1;
+        uint32_t next =
+            __atomic_load_n(&arena->free_span_links[index], __ATOMIC_RELAXED);
+
+        if (__atomic_compare_exchange_n(&arena->free_span_head, &head,
+                                        span_head(head, next), true,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            __atomic_fetch_sub(&arena->free_span_count, 1, __ATOMIC_RELAXED);
+            return arena->begin + ((size_t)index * SLAB_ARENA_SPAN_SIZE);
+        }
+    }
+
+    return NULL;
+}
+
+size_t slab_arena_free_span_count(const struct SlabArena *arena) {
+    return __atomic_load_n(&arena->free_span_count, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,24 @@
+#include <slow_paths.h>
+
+#include <stdint.h>
+#include <threads.h>
+
+thread_local uint64_t falloc_slow_path_counts[FALLOC_SLOW_PATH_COUNT]
+    __attribute__((tls_model("initial-exec"))) = {0};
+
+const char *falloc_slow_path_name(enum FallocSlowPath path) {
+    switch (path) {
+    case FALLOC_SLOW_PATH_SLAB_INIT:
+        return "slab_init";
+    case FALLOC_SLOW_PATH_FIXED_BLOCK:
+        return "fixed_block";
+    case FALLOC_SLOW_PATH_FALLBACK_REGION:
+        return "fallback_region";
+    case FALLOC_SLOW_PATH_RTREE_NODE:
+        return "rtree_node";
+    case FALLOC_SLOW_PATH_COUNT:
+        break;
+    }
+
+    return "unknown";
+}
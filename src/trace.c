@@ -0,0 +1,591 @@
+#include <trace.h>
+
+#include <error.h>
+#include <os_allocator.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <threads.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Every thread buffers up to TRACE_BUFFER_RECORDS records before it writes
+// them out.
+#define TRACE_BUFFER_RECORDS 4096
+
+// Live pointers are mapped to their ids by ID_MAP_SHARDS open addressing
+// tables, each behind its own lock, so threads rarely wait for each other.
+#define ID_MAP_SHARD_BITS    6
+#define ID_MAP_SHARDS        (1U << ID_MAP_SHARD_BITS)
+#define ID_MAP_MIN_CAPACITY  1024
+#define ID_MAP_HASH_MULTIPLE 0x9E3779B97F4A7C15ULL
+#define ID_MAP_INDEX_SHIFT   32
+
+#define NS_PER_SEC 1000000000ULL
+
+#define TRACE_FILE_MODE 0644
+
+struct IdMapEntry {
+    // 0 for a free entry.
+    uintptr_t ptr;
+    uint32_t id;
+};
+
+struct IdMapShard {
+    pthread_mutex_t lock;
+    struct IdMapEntry *entries;
+    // A power of 2, never more than half full.
+    size_t capacity;
+    size_t count;
+};
+
+struct TraceBuffer {
+    // Taken by the owning thread for every record, and by
+    // falloc_trace_stop() to write out what is left.
+    pthread_mutex_t lock;
+    struct TraceBuffer *prev;
+    struct TraceBuffer *next;
+    // The trace the records belong to. A buffer left over from an earlier
+    // trace starts over, with a new thread number.
+    uint64_t session;
+    uint32_t thread;
+    uint32_t count;
+    struct FallocTraceRecord records[TRACE_BUFFER_RECORDS];
+};
+
+static bool active = false;
+static uint64_t session = 0;
+static int trace_fd = -1;
+static struct timespec start_time;
+static uint32_t next_id = 1;
+static uint32_t next_thread = 0;
+
+// Taken by start and stop, and for the list of buffers. Always before the
+// lock of a buffer, which is always before file_lock.
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct TraceBuffer *buffers = NULL;
+
+static struct IdMapShard id_map[ID_MAP_SHARDS];
+static once_flag id_map_once = ONCE_FLAG_INIT;
+
+static thread_local struct TraceBuffer *thread_buffer = NULL;
+static tss_t thread_buffer_key;
+static once_flag thread_buffer_key_once = ONCE_FLAG_INIT;
+
+static once_flag env_once = ONCE_FLAG_INIT;
+
+static inline void lock(pthread_mutex_t *mutex) {
+    int err_code = pthread_mutex_lock(mutex);
+    assert(err_code == 0);
+    (void)err_code;
+}
+
+static inline void unlock(pthread_mutex_t *mutex) {
+    int err_code = pthread_mutex_unlock(mutex);
+    assert(err_code == 0);
+    (void)err_code;
+}
+
+static inline bool trace_is_active(void) {
+    return __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+}
+
+// Pointer to id map
+
+static void id_map_init(void) {
+    for (size_t i = 0; i < ID_MAP_SHARDS; ++i) {
+        pthread_mutex_init(&id_map[i].lock, NULL);
+        id_map[i].entries = NULL;
+        id_map[i].capacity = 0;
+        id_map[i].count = 0;
+    }
+}
+
+static inline uint64_t id_map_hash(uintptr_t ptr) {
+    return (uint64_t)ptr * ID_MAP_HASH_MULTIPLE;
+}
+
+static inline struct IdMapShard *id_map_shard(uintptr_t ptr) {
+    return &id_map[id_map_hash(ptr) >> (64 - ID_MAP_SHARD_BITS)];
+}
+
+static inline size_t id_map_home(const struct IdMapShard *shard,
+                                 uintptr_t ptr) {
+    return (size_t)(id_map_hash(ptr) >> ID_MAP_INDEX_SHIFT) &
+           (shard->capacity - 1);
+}
+
+static inline void id_map_place(struct IdMapShard *shard,
+                                struct IdMapEntry entry) {
+    size_t mask = shard->capacity - 1;
+    size_t i = id_map_home(shard, entry.ptr);
+
+    while (shard->entries[i].ptr != 0) {
+        i = (i + 1) & mask;
+    }
+
+    shard->entries[i] = entry;
+    ++shard->count;
+}
+
+static bool id_map_grow(struct IdMapShard *shard) {
+    size_t old_capacity = shard->capacity;
+    struct IdMapEntry *old_entries = shard->entries;
+    size_t capacity =
+        old_capacity == 0 ? ID_MAP_MIN_CAPACITY : old_capacity * 2;
+
+    struct IdMapEntry *entries = os_alloc(capacity * sizeof(*entries));
+
+    if (!entries) {
+        fa_print_errno("os_alloc() failed in id_map_grow()");
+        return false;
+    }
+
+    shard->entries = entries;
+    shard->capacity = capacity;
+    shard->count = 0;
+
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (old_entries[i].ptr != 0) {
+            id_map_place(shard, old_entries[i]);
+        }
+    }
+
+    if (old_entries &&
+        os_free(old_entries, old_capacity * sizeof(*old_entries)) ==
+            OS_FREE_FAIL) {
+        fa_print_errno("os_free() failed in id_map_grow()");
+    }
+
+    return true;
+}
+
+// Returns false when the shard can't grow.
+static bool id_map_put(uintptr_t ptr, uint32_t id) {
+    struct IdMapShard *shard = id_map_shard(ptr);
+    bool placed = false;
+
+    lock(&shard->lock);
+
+    if ((shard->count + 1) * 2 <= shard->capacity || id_map_grow(shard)) {
+        id_map_place(shard, (struct IdMapEntry){.ptr = ptr, .id = id});
+        placed = true;
+    }
+
+    unlock(&shard->lock);
+
+    return placed;
+}
+
+// Hands out the next id and maps ptr to it. Returns 0 if it can't.
+static uint32_t id_map_insert(uintptr_t ptr) {
+    uint32_t id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+
+    // Only after 2^32 allocations, which a replay can't tell apart anyway.
+    if (id == 0) {
+        id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    }
+
+    return id_map_put(ptr, id) ? id : 0;
+}
+
+// Takes ptr out of the map and returns its id, or 0 if it isn't there.
+// Entries after it are shifted back into the gap, so lookups never need
+// tombstones.
+static uint32_t id_map_remove(uintptr_t ptr) {
+    struct IdMapShard *shard = id_map_shard(ptr);
+    uint32_t id = 0;
+
+    lock(&shard->lock);
+
+    if (shard->count == 0) {
+        unlock(&shard->lock);
+        return 0;
+    }
+
+    size_t mask = shard->capacity - 1;
+    size_t i = id_map_home(shard, ptr);
+
+    while (shard->entries[i].ptr != 0 && shard->entries[i].ptr != ptr) {
+        i = (i + 1) & mask;
+    }
+
+    if (shard->entries[i].ptr == ptr) {
+        id = shard->entries[i].id;
+
+        for (size_t j = (i + 1) & mask; shard->entries[j].ptr != 0;
+             j = (j + 1) & mask) {
+            size_t home = id_map_home(shard, shard->entries[j].ptr);
+
+            // The entry at j can move to i unless its home lies cyclically
+            // in (i, j].
+            bool stays = i < j ? (home > i && home <= j)
+                               : (home > i || home <= j);
+
+            if (!stays) {
+                shard->entries[i] = shard->entries[j];
+                i = j;
+            }
+        }
+
+        shard->entries[i] = (struct IdMapEntry){.ptr = 0, .id = 0};
+        --shard->count;
+    }
+
+    unlock(&shard->lock);
+
+    return id;
+}
+
+static void id_map_clear(void) {
+    for (size_t i = 0; i < ID_MAP_SHARDS; ++i) {
+        struct IdMapShard *shard = &id_map[i];
+
+        lock(&shard->lock);
+
+        if (shard->entries &&
+            os_free(shard->entries,
+                    shard->capacity * sizeof(*shard->entries)) ==
+                OS_FREE_FAIL) {
+            fa_print_errno("os_free() failed in id_map_clear()");
+        }
+
+        shard->entries = NULL;
+        shard->capacity = 0;
+        shard->count = 0;
+
+        unlock(&shard->lock);
+    }
+}
+
+// Trace file and buffers
+
+static bool write_all(const void *data, size_t size) {
+    const uint8_t *bytes = data;
+
+    while (size != 0) {
+        ssize_t written = write(trace_fd, bytes, size);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            fa_print_errno("write() failed in falloc trace");
+            return false;
+        }
+
+        bytes += written;
+        size -= (size_t)written;
+    }
+
+    return true;
+}
+
+// Called with the buffer's lock held.
+static void buffer_flush(struct TraceBuffer *buffer) {
+    if (buffer->count == 0) {
+        return;
+    }
+
+    lock(&file_lock);
+    (void)write_all(buffer->records, buffer->count * sizeof(*buffer->records));
+    unlock(&file_lock);
+
+    buffer->count = 0;
+}
+
+static void buffer_unlink(struct TraceBuffer *buffer) {
+    if (buffer->prev) {
+        buffer->prev->next = buffer->next;
+    } else {
+        buffers = buffer->next;
+    }
+
+    if (buffer->next) {
+        buffer->next->prev = buffer->prev;
+    }
+}
+
+// Takes the buffer out of the list first, so falloc_trace_stop() can't get to
+// it any more.
+static void buffer_on_thread_exit(void *arg) {
+    struct TraceBuffer *buffer = arg;
+    thread_buffer = NULL;
+
+    lock(&registry_lock);
+    buffer_unlink(buffer);
+
+    if (trace_is_active() &&
+        buffer->session == __atomic_load_n(&session, __ATOMIC_RELAXED)) {
+        buffer_flush(buffer);
+    }
+
+    unlock(&registry_lock);
+
+    pthread_mutex_destroy(&buffer->lock);
+
+    if (os_free(buffer, sizeof(*buffer)) == OS_FREE_FAIL) {
+        fa_print_errno("os_free() failed in buffer_on_thread_exit()");
+    }
+}
+
+static void thread_buffer_key_init(void) {
+    int ret = tss_create(&thread_buffer_key, &buffer_on_thread_exit);
+    assert(ret == thrd_success);
+    (void)ret;
+}
+
+// The buffer lives in its own mapping, falloc can't allocate for its own
+// trace.
+static struct TraceBuffer *thread_buffer_create(void) {
+    struct TraceBuffer *buffer = os_alloc(sizeof(struct TraceBuffer));
+
+    if (!buffer) {
+        fa_print_errno("os_alloc() failed in thread_buffer_create()");
+        return NULL;
+    }
+
+    pthread_mutex_init(&buffer->lock, NULL);
+    buffer->prev = NULL;
+    buffer->session = 0;
+    buffer->thread = 0;
+    buffer->count = 0;
+
+    call_once(&thread_buffer_key_once, &thread_buffer_key_init);
+
+    int ret = tss_set(thread_buffer_key, buffer);
+    assert(ret == thrd_success);
+    (void)ret;
+
+    lock(&registry_lock);
+
+    buffer->next = buffers;
+
+    if (buffers) {
+        buffers->prev = buffer;
+    }
+
+    buffers = buffer;
+
+    unlock(&registry_lock);
+
+    return buffer;
+}
+
+static inline uint64_t trace_timestamp(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((uint64_t)(now.tv_sec - start_time.tv_sec) * NS_PER_SEC) +
+           (uint64_t)now.tv_nsec - (uint64_t)start_time.tv_nsec;
+}
+
+static void trace_append(enum FallocTraceOp op, size_t size, uint32_t id,
+                         uint32_t old_id) {
+    if (!thread_buffer) {
+        thread_buffer = thread_buffer_create();
+
+        if (!thread_buffer) {
+            return;
+        }
+    }
+
+    struct TraceBuffer *buffer = thread_buffer;
+
+    lock(&buffer->lock);
+
+    // falloc_trace_stop() clears active before it goes through the buffers,
+    // so whatever gets in here after it took this buffer is dropped.
+    if (!trace_is_active()) {
+        unlock(&buffer->lock);
+        return;
+    }
+
+    uint64_t current_session = __atomic_load_n(&session, __ATOMIC_RELAXED);
+
+    if (buffer->session != current_session) {
+        buffer->session = current_session;
+        buffer->thread = __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED);
+        buffer->count = 0;
+    }
+
+    buffer->records[buffer->count] = (struct FallocTraceRecord){
+        .timestamp = trace_timestamp(),
+        .size = size,
+        .id = id,
+        .old_id = old_id,
+        .op = op,
+        .thread = buffer->thread,
+    };
+    ++buffer->count;
+
+    if (buffer->count == TRACE_BUFFER_RECORDS) {
+        buffer_flush(buffer);
+    }
+
+    unlock(&buffer->lock);
+}
+
+bool falloc_trace_start(const char *path) {
+    if (!FALLOC_TRACE_ENABLED) {
+        errno = ENOTSUP;
+        return false;
+    }
+
+    call_once(&id_map_once, &id_map_init);
+
+    lock(&registry_lock);
+
+    if (trace_is_active()) {
+        unlock(&registry_lock);
+        errno = EBUSY;
+        return false;
+    }
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    TRACE_FILE_MODE);
+
+    if (trace_fd < 0) {
+        unlock(&registry_lock);
+        return false;
+    }
+
+    struct FallocTraceHeader header = {
+        .magic = FALLOC_TRACE_MAGIC,
+        .version = FALLOC_TRACE_VERSION,
+        .record_size = sizeof(struct FallocTraceRecord),
+    };
+
+    if (!write_all(&header, sizeof(header))) {
+        (void)close(trace_fd);
+        trace_fd = -1;
+        unlock(&registry_lock);
+        return false;
+    }
+
+    id_map_clear();
+    __atomic_store_n(&next_id, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&next_thread, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&session, session + 1, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    __atomic_store_n(&active, true, __ATOMIC_RELEASE);
+
+    unlock(&registry_lock);
+
+    return true;
+}
+
+void falloc_trace_stop(void) {
+    lock(&registry_lock);
+
+    if (!trace_is_active()) {
+        unlock(&registry_lock);
+        return;
+    }
+
+    __atomic_store_n(&active, false, __ATOMIC_RELEASE);
+
+    for (struct TraceBuffer *buffer = buffers; buffer; buffer = buffer->next) {
+        lock(&buffer->lock);
+
+        if (buffer->session == session) {
+            buffer_flush(buffer);
+        }
+
+        unlock(&buffer->lock);
+    }
+
+    lock(&file_lock);
+
+    if (close(trace_fd) != 0) {
+        fa_print_errno("close() failed in falloc_trace_stop()");
+    }
+
+    trace_fd = -1;
+
+    unlock(&file_lock);
+    unlock(&registry_lock);
+}
+
+static void trace_stop_at_exit(void) {
+    falloc_trace_stop();
+}
+
+static void start_from_env(void) {
+    const char *path = getenv(FALLOC_TRACE_FILE_ENV);
+
+    if (!path || path[0] == '\0') {
+        return;
+    }
+
+    if (!falloc_trace_start(path)) {
+        fa_print_errno("falloc_trace_start() failed in finit()");
+        return;
+    }
+
+    if (atexit(&trace_stop_at_exit) != 0) {
+        fa_print_error("atexit() failed in finit(), the trace at %s will be "
+                       "cut short\n",
+                       path);
+    }
+}
+
+void falloc_trace_start_from_env(void) {
+    call_once(&env_once, &start_from_env);
+}
+
+// Hooks
+
+void falloc_trace_alloc(void *ptr, size_t size) {
+    if (!trace_is_active()) {
+        return;
+    }
+
+    uint32_t id = ptr ? id_map_insert((uintptr_t)ptr) : 0;
+    trace_append(FALLOC_TRACE_ALLOC, size, id, 0);
+}
+
+void falloc_trace_free(void *ptr) {
+    if (!ptr || !trace_is_active()) {
+        return;
+    }
+
+    trace_append(FALLOC_TRACE_FREE, 0, id_map_remove((uintptr_t)ptr), 0);
+}
+
+uint32_t falloc_trace_realloc_begin(void *old_ptr) {
+    if (!old_ptr || !trace_is_active()) {
+        return 0;
+    }
+
+    return id_map_remove((uintptr_t)old_ptr);
+}
+
+void falloc_trace_realloc_end(uint32_t old_id, void *old_ptr, void *ptr,
+                              size_t size) {
+    if (!trace_is_active()) {
+        return;
+    }
+
+    uint32_t id = 0;
+
+    if (ptr) {
+        id = id_map_insert((uintptr_t)ptr);
+    } else if (old_id != 0 && size != 0) {
+        // A failed frealloc() leaves the old pointer as it was.
+        (void)id_map_put((uintptr_t)old_ptr, old_id);
+    }
+
+    trace_append(FALLOC_TRACE_REALLOC, size, id, old_id);
+}
@@ -2,6 +2,9 @@
 
 #include "falloc.h"
 
+#include <assert.h>
+#include <string.h>
+
 #define STRING_SIZE     2048
 #define BIG_STRING_SIZE 99999999
 
@@ -26,7 +29,7 @@ int main(void) {
         big_strings[i] = falloc(sizeof(struct BigString));
     }
 
-    print_tree(&falloc_get_instance()->rtree);
+    print_tree(falloc_get_rtree());
 
     puts("Passed.\n\nAllocating a couple of smaller strings...");
 
@@ -34,7 +37,7 @@ int main(void) {
         small_strings[i] = falloc(sizeof(struct BigString));
     }
 
-    print_tree(&falloc_get_instance()->rtree);
+    print_tree(falloc_get_rtree());
 
     puts("Passed.\n\nFreeing the big strings...");
 
@@ -42,7 +45,7 @@ int main(void) {
         ffree(big_strings[i]);
     }
 
-    print_tree(&falloc_get_instance()->rtree);
+    print_tree(falloc_get_rtree());
 
     puts("Passed.\n\nFreeing the small strings...");
 
@@ -50,7 +53,22 @@ int main(void) {
         ffree(small_strings[i]);
     }
 
-    print_tree(&falloc_get_instance()->rtree);
+    print_tree(falloc_get_rtree());
+
+    puts("Passed.\n\nGrowing a small string into a big one...");
+
+    char *str = falloc(STRING_SIZE / 4);
+    memset(str, 'x', STRING_SIZE / 4);
+
+    str = frealloc(str, STRING_SIZE);
+    assert(str[STRING_SIZE / 4 - 1] == 'x');
+    assert(fmemsize(str) >= STRING_SIZE);
+
+    char *grown = frealloc(str, STRING_SIZE * 2);
+    assert(grown[STRING_SIZE / 4 - 1] == 'x');
+    assert(fmemsize(grown) >= STRING_SIZE * 2);
+
+    ffree(grown);
 
     puts("Passed.");
 }
@@ -9,7 +9,7 @@
 int main(void) {
     puts("Creating the allocator...");
     const size_t heap_init_size = 64;
-    struct FallbackAlloc aloc = fallback_allocator_create(heap_init_size);
+    struct FallbackAlloc aloc = fallback_allocator_create(heap_init_size, NULL);
 
     print_allocator_memory_layout(&aloc);
 
@@ -31,20 +31,46 @@ int main(void) {
     print_allocator_memory_layout(&aloc);
 
     puts("Freeing second, then first allocated block, chunks should not merge "
-         "as they are not in the same region.");
+         "as they are not in the same region. The second region is kept as a "
+         "warm spare, the first one should be unmapped once it empties.");
     fallback_free(&aloc, data2);
     fallback_free(&aloc, data1);
+    assert(aloc.region_count == 1);
     print_allocator_memory_layout(&aloc);
 
-    puts("Now finally, we will try to allocate more than the first region can "
-         "hold, and see if the second region will be used, as it should.");
+    puts("Now finally, we will try to allocate more than the first region "
+         "could hold, and see if the spare region will be used, as it should.");
     const size_t large_data_size = 64;
     void *large_data = fallback_alloc(&aloc, large_data_size);
     assert(large_data != NULL);
+    assert(aloc.region_count == 1);
     print_allocator_memory_layout(&aloc);
 
-    puts("Freeing the data, expecting 2 empty regions, each having 1 unused "
-         "chunk");
+    puts("Freeing the data, expecting 1 empty region, having 1 unused chunk");
     fallback_free(&aloc, large_data);
+    assert(aloc.region_count == 1);
     print_allocator_memory_layout(&aloc);
+
+    fallback_allocator_destroy(&aloc);
+
+    puts("Creating an allocator too big to map, expecting it to start out "
+         "empty and map a region once its growth policy allows one.");
+    const size_t unmappable_size = (size_t)1 << 50;
+    struct FallbackAlloc empty =
+        fallback_allocator_create(unmappable_size, NULL);
+    void *unmapped = fallback_alloc(&empty, first_block_size);
+    assert(empty.region_count == 0 && unmapped == NULL);
+    (void)unmapped;
+
+    fallback_allocator_set_growth_policy(
+        &empty, (struct FallbackGrowthPolicy){
+                    .min_region_size = heap_init_size,
+                    .max_region_size = FALLBACK_DEFAULT_MAX_REGION_SIZE,
+                });
+    void *retried = fallback_alloc(&empty, first_block_size);
+    assert(retried != NULL);
+    assert(empty.region_count == 1);
+
+    fallback_free(&empty, retried);
+    fallback_allocator_destroy(&empty);
 }
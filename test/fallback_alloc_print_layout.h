@@ -6,7 +6,7 @@
 #include <stdio.h>
 
 static inline void print_allocator_memory_layout(struct FallbackAlloc *aloc) {
-    printf("\nallocator data addr: %p\n\n", (void *)aloc->chunk_llist_head);
+    printf("\nallocator data addr: %p\n\n", (void *)aloc->regions[0].begin);
 
     for (size_t i = 0; i < aloc->region_count; ++i) {
         printf("\n======Region Number %02zu======\n\n", i);
@@ -43,9 +43,77 @@ void realloc_test(struct FallbackAlloc *aloc) {
     }
 }
 
+int segregated_fit_test(void) {
+    puts("[TEST] Testing that a free chunk in the middle of used ones gets "
+         "reused");
+
+    struct FallbackAlloc aloc = fallback_allocator_create(ALLOCATOR_SIZE, NULL);
+
+    const size_t small_sz = 100;
+    const size_t big_sz = 1000;
+    const size_t fitting_sz = 800;
+
+    void *before = fallback_alloc(&aloc, small_sz);
+    void *middle = fallback_alloc(&aloc, big_sz);
+    void *after = fallback_alloc(&aloc, small_sz);
+
+    fallback_free(&aloc, middle);
+
+    void *reused = fallback_alloc(&aloc, fitting_sz);
+
+    if (reused != middle || aloc.region_count != 1) {
+        puts("[FAIL] The freed chunk was not reused");
+        return 1;
+    }
+
+    puts("[OK] The freed chunk was reused");
+
+    fallback_free(&aloc, before);
+    fallback_free(&aloc, reused);
+    fallback_free(&aloc, after);
+
+    return 0;
+}
+
+int in_place_realloc_test(void) {
+    puts("[TEST] Testing that fallback_realloc resizes in place");
+
+    struct FallbackAlloc aloc = fallback_allocator_create(ALLOCATOR_SIZE, NULL);
+
+    const size_t small_sz = 100;
+    const size_t big_sz = 1000;
+
+    char *buf = fallback_alloc(&aloc, big_sz);
+    void *after = fallback_alloc(&aloc, small_sz);
+
+    memset(buf, 'x', big_sz);
+
+    if (fallback_realloc(&aloc, buf, small_sz) != buf) {
+        puts("[FAIL] Shrinking moved the chunk");
+        return 1;
+    }
+
+    if (fallback_realloc(&aloc, buf, big_sz) != buf) {
+        puts("[FAIL] Growing into the freed tail moved the chunk");
+        return 1;
+    }
+
+    if (buf[small_sz - 1] != 'x') {
+        puts("[FAIL] Resizing lost the contents");
+        return 1;
+    }
+
+    puts("[OK] The chunk was resized in place");
+
+    fallback_free(&aloc, buf);
+    fallback_free(&aloc, after);
+
+    return 0;
+}
+
 int main(void) {
     printf("[TEST] Creating the allocator...\n");
-    struct FallbackAlloc aloc = fallback_allocator_create(ALLOCATOR_SIZE);
+    struct FallbackAlloc aloc = fallback_allocator_create(ALLOCATOR_SIZE, NULL);
     printf("[OK] Created the allocator\n");
 
     printf("[TEST] Allocating for array 0...\n");
@@ -142,5 +210,9 @@ int main(void) {
     fallback_free(&aloc, ptr1);
     fallback_free(&aloc, ptr2);
 
-    return 0;
+    if (segregated_fit_test() != 0) {
+        return 1;
+    }
+
+    return in_place_realloc_test();
 }
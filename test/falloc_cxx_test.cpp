@@ -0,0 +1,114 @@
+#include "falloc.hpp"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+constexpr std::size_t MAX_SIZE = 5000;
+constexpr std::size_t MAX_ALIGN = 4096;
+constexpr int ELEMENT_COUNT = 10000;
+
+struct alignas(128) OverAligned {
+    std::uint64_t value;
+};
+
+[[maybe_unused]] bool is_aligned(const void *ptr, std::size_t align) {
+    return reinterpret_cast<std::uintptr_t>(ptr) % align == 0;
+}
+
+void check_resource(std::pmr::memory_resource *resource) {
+    for (std::size_t align = 1; align <= MAX_ALIGN; align *= 2) {
+        for (std::size_t size = 0; size <= MAX_SIZE; size += size / 4 + 1) {
+            void *ptr = resource->allocate(size, align);
+            assert(is_aligned(ptr, align));
+            std::memset(ptr, 'x', size);
+            resource->deallocate(ptr, size, align);
+        }
+    }
+}
+
+} // namespace
+
+int main() {
+    std::puts("Checking the alignment of every size...");
+
+    check_resource(falloc::get_memory_resource());
+    assert(falloc::get_memory_resource()->is_equal(falloc::memory_resource()));
+
+    std::puts("Passed.\n\nFilling standard containers...");
+
+    {
+        std::vector<int, falloc::allocator<int>> vector;
+        std::map<int, std::string, std::less<>,
+                 falloc::allocator<std::pair<const int, std::string>>>
+            map;
+
+        for (int i = 0; i < ELEMENT_COUNT; ++i) {
+            vector.push_back(i);
+            map.emplace(i, std::to_string(i));
+        }
+
+        for (int i = 0; i < ELEMENT_COUNT; ++i) {
+            assert(vector[static_cast<std::size_t>(i)] == i);
+            assert(map.at(i) == std::to_string(i));
+        }
+
+        std::vector<OverAligned, falloc::allocator<OverAligned>> aligned(
+            ELEMENT_COUNT);
+
+        for (const OverAligned &element : aligned) {
+            assert(is_aligned(&element, alignof(OverAligned)));
+            (void)element;
+        }
+    }
+
+    std::puts("Passed.\n\nFilling pmr containers...");
+
+    {
+        std::pmr::vector<std::pmr::string> strings(
+            falloc::get_memory_resource());
+        std::pmr::unordered_map<int, int> map(falloc::get_memory_resource());
+
+        for (int i = 0; i < ELEMENT_COUNT; ++i) {
+            // Long enough not to fit in the string itself.
+            strings.emplace_back(std::to_string(i) + std::string(40, 'y'));
+            map[i] = i;
+        }
+
+        assert(strings.back().get_allocator().resource() ==
+               falloc::get_memory_resource());
+        assert(map.size() == ELEMENT_COUNT);
+    }
+
+    std::puts("Passed.\n\nUsing a heap of its own...");
+
+    {
+        falloc::heap_resource heap;
+        falloc::heap_resource other_heap;
+
+        check_resource(&heap);
+        assert(heap.is_equal(heap) && !heap.is_equal(other_heap));
+
+        std::pmr::map<int, std::pmr::string> map(&heap);
+
+        for (int i = 0; i < ELEMENT_COUNT; ++i) {
+            map.emplace(i, std::to_string(i) + std::string(40, 'z'));
+        }
+
+        // Left for the heap to take back along with the rest.
+        void *leaked = heap.allocate(MAX_SIZE, MAX_ALIGN);
+        assert(is_aligned(leaked, MAX_ALIGN));
+        (void)leaked;
+    }
+
+    std::puts("Passed.");
+}
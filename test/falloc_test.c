@@ -14,6 +14,37 @@ static const char STR[STR_SIZE] = "The quick brown fox runs slowly";
 #define STR_1_SIZE 32
 static const char STR_1[STR_1_SIZE] = "The quick green fox runs slowly";
 
+struct Point {
+    double x;
+    double y;
+    double z;
+};
+
+void inline_size_class_test(void) {
+    puts("Checking the inline size classes against the lookup table...");
+
+    for (size_t size = 0; size <= SLAB_CLASS_MAX; ++size) {
+        // Checked builds hand out no less than SLAB_CHECKED_SIZE_MIN bytes.
+        size_t served = FALLOC_CHECKS_ENABLED && size < SLAB_CHECKED_SIZE_MIN
+                            ? SLAB_CHECKED_SIZE_MIN
+                            : size;
+        assert(falloc_size_class(size) == slab_size_class(served));
+        (void)served;
+    }
+
+    puts("Passed.\n\nAllocating with FALLOC_NEW, freeing and allocating "
+         "again...");
+
+    struct Point *point = FALLOC_NEW(struct Point);
+    *point = (struct Point){.x = 1, .y = 2, .z = 3};
+    ffree(point);
+
+    assert(FALLOC_NEW(struct Point) == point);
+    ffree(point);
+
+    puts("Passed, the freed object came back from the thread cache.");
+}
+
 int main(void) {
     const int allocs = 100;
     const int ptr_to_free_index = 22;
@@ -70,4 +101,6 @@ int main(void) {
     slab_alloc_print_layout(&falloc_get_instance()->slab_alloc);
 
     print_bitmap(falloc_get_instance()->slab_alloc.slabs[class]);
+
+    inline_size_class_test();
 }
@@ -0,0 +1,216 @@
+#include "falloc.h"
+#include "fcache.h"
+#include "integrity.h"
+#include "slab_alloc.h"
+
+#include <pthread.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define OBJECT_SIZE    40
+#define ODD_SIZE       260
+#define OBJECT_COUNT   5000
+#define THREAD_COUNT   8
+#define ROUNDS         200
+#define THREAD_OBJECTS 100
+#define CONSTRUCTED    0xC0FFEEU
+#define ALIGNED_COUNT  2000
+
+struct Object {
+    uint32_t magic;
+    uint32_t uses;
+    uint8_t payload[OBJECT_SIZE - (2 * sizeof(uint32_t))];
+};
+
+static_assert(sizeof(struct Object) == OBJECT_SIZE, "no padding expected");
+
+static size_t foreign_free_count = 0;
+
+static void count_foreign_free(enum FallocCorruption corruption, void *ptr) {
+    assert(corruption == FALLOC_CORRUPTION_FOREIGN_FREE);
+    (void)corruption;
+    (void)ptr;
+
+    ++foreign_free_count;
+}
+
+static void construct(void *obj) {
+    struct Object *object = obj;
+    object->magic = CONSTRUCTED;
+    object->uses = 0;
+}
+
+static void *use_cache_thread(void *arg) {
+    struct Fcache *cache = arg;
+    struct Object *objects[THREAD_OBJECTS];
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (int i = 0; i < THREAD_OBJECTS; ++i) {
+            objects[i] = fcache_alloc(cache);
+            assert(objects[i]->magic == CONSTRUCTED);
+            objects[i]->magic = 0;
+        }
+
+        for (int i = 0; i < THREAD_OBJECTS; ++i) {
+            objects[i]->magic = CONSTRUCTED;
+            fcache_free(cache, objects[i]);
+        }
+    }
+
+    return NULL;
+}
+
+int main(void) {
+    puts("Checking that bad sizes and alignments are refused...");
+
+    assert(!fcache_create("empty", 0, 0, NULL) && errno == EINVAL);
+    assert(!fcache_create("huge", FCACHE_MAX_SIZE + 1, 0, NULL));
+    assert(!fcache_create("odd_align", OBJECT_SIZE, 12, NULL));
+    assert(!fcache_create("big_align", OBJECT_SIZE, FCACHE_MAX_ALIGN * 2,
+                          NULL));
+
+    puts("Passed.\n\nChecking that objects take up their exact size...");
+
+    struct Fcache *cache = fcache_create("object", OBJECT_SIZE, 0, &construct);
+    assert(cache);
+
+    struct FcacheStats stats = fcache_stats(cache);
+    assert(strcmp(stats.name, "object") == 0);
+    assert(stats.object_size == OBJECT_SIZE);
+    assert(stats.stride == OBJECT_SIZE);
+    assert(stats.objects_per_slab * OBJECT_SIZE > SLAB_SIZE * 9 / 10);
+
+    static struct Object *objects[OBJECT_COUNT];
+
+    for (int i = 0; i < OBJECT_COUNT; ++i) {
+        objects[i] = fcache_alloc(cache);
+        assert((uintptr_t)objects[i] % 8 == 0);
+        assert(objects[i]->magic == CONSTRUCTED && objects[i]->uses == 0);
+
+        if (i > 0 && slab_from_ptr(objects[i]) == slab_from_ptr(objects[0])) {
+            assert((uint8_t *)objects[i] - (uint8_t *)objects[i - 1] ==
+                   OBJECT_SIZE);
+        }
+
+        ++objects[i]->uses;
+    }
+
+    stats = fcache_stats(cache);
+    assert(stats.live_count == OBJECT_COUNT);
+    assert(stats.constructed_count == OBJECT_COUNT);
+    assert(stats.slab_count ==
+           (OBJECT_COUNT + stats.objects_per_slab - 1) /
+               stats.objects_per_slab);
+
+    puts("Passed.\n\nChecking that freed objects come back constructed...");
+
+    for (int i = 0; i < OBJECT_COUNT; ++i) {
+        fcache_free(cache, objects[i]);
+    }
+
+    stats = fcache_stats(cache);
+    assert(stats.live_count == 0);
+    assert(stats.free_count == OBJECT_COUNT);
+    assert(stats.slab_count == 1);
+
+    // Only the last slab is kept, with the objects handed out from it so far
+    // still constructed and used once.
+    size_t reused = OBJECT_COUNT % stats.objects_per_slab;
+
+    for (size_t i = 0; i < reused; ++i) {
+        objects[i] = fcache_alloc(cache);
+        assert(objects[i]->magic == CONSTRUCTED && objects[i]->uses == 1);
+    }
+
+    stats = fcache_stats(cache);
+    assert(stats.constructed_count == OBJECT_COUNT);
+    assert(stats.alloc_count == OBJECT_COUNT + reused);
+
+    objects[reused] = fcache_alloc(cache);
+    assert(objects[reused]->uses == 0);
+    assert(fcache_stats(cache).constructed_count == OBJECT_COUNT + 1);
+
+    for (size_t i = 0; i <= reused; ++i) {
+        fcache_free(cache, objects[i]);
+    }
+
+    puts("Passed.\n\nChecking an odd size...");
+
+    struct Fcache *odd_cache = fcache_create("odd", ODD_SIZE, 0, NULL);
+    assert(odd_cache);
+    assert(fcache_stats(odd_cache).stride == ODD_SIZE);
+
+    uint8_t *first = fcache_alloc(odd_cache);
+    uint8_t *second = fcache_alloc(odd_cache);
+    assert(second - first == ODD_SIZE);
+    memset(first, 1, ODD_SIZE);
+    memset(second, 2, ODD_SIZE);
+    assert(first[ODD_SIZE - 1] == 1);
+
+    fcache_free(odd_cache, first);
+    fcache_free(odd_cache, second);
+    fcache_destroy(odd_cache);
+
+    puts("Passed.\n\nChecking that falloc leaves the objects alone...");
+
+    struct Object *object = fcache_alloc(cache);
+    falloc_set_corruption_handler(&count_foreign_free);
+
+    assert(fmemsize(object) == 0);
+    ffree(object);
+    assert(frealloc(object, OBJECT_SIZE * 2) == NULL);
+    assert(foreign_free_count == 2);
+
+    falloc_set_corruption_handler(NULL);
+    assert(object->magic == CONSTRUCTED);
+    fcache_free(cache, object);
+
+    puts("Passed.\n\nChecking alignments above the color step...");
+
+    static void *aligned[ALIGNED_COUNT];
+
+    for (size_t align = SLAB_COLOR_STEP * 2; align <= FCACHE_MAX_ALIGN;
+         align *= 2) {
+        struct Fcache *aligned_cache =
+            fcache_create("aligned", ODD_SIZE, align, NULL);
+        assert(aligned_cache);
+
+        for (size_t i = 0; i < ALIGNED_COUNT; ++i) {
+            aligned[i] = fcache_alloc(aligned_cache);
+            assert((uintptr_t)aligned[i] % align == 0);
+        }
+
+        for (size_t i = 0; i < ALIGNED_COUNT; ++i) {
+            fcache_free(aligned_cache, aligned[i]);
+        }
+
+        fcache_destroy(aligned_cache);
+    }
+
+    puts("Passed.\n\nSharing a cache between threads...");
+
+    pthread_t threads[THREAD_COUNT];
+
+    for (int i = 0; i < THREAD_COUNT; ++i) {
+        int err_code =
+            pthread_create(&threads[i], NULL, &use_cache_thread, cache);
+        assert(err_code == 0);
+        (void)err_code;
+    }
+
+    for (int i = 0; i < THREAD_COUNT; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    stats = fcache_stats(cache);
+    assert(stats.live_count == 0);
+    assert(stats.alloc_count == stats.free_count);
+
+    fcache_destroy(cache);
+
+    puts("Passed.");
+}
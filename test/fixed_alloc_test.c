@@ -1,18 +1,17 @@
 #include "fixed_alloc.h"
 
+#include <errno.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 
-#define GET_NUM_OF_ELEMS(FIXED_ALLOC_VAR) ((FIXED_ALLOC_VAR).cache.capacity)
+#define BIG_UNIT_SIZE ((size_t)(0x800 * OS_ALLOC_PAGE_SIZE))
 
 static inline bool is_full(struct FixedAllocBlock *block) {
-    size_t fixed_alloc_buff_size =
-        (GET_NUM_OF_ELEMS(*block)) * block->unit_size;
-
-    return block->offset >= fixed_alloc_buff_size - block->unit_size &&
-           block->cache.size == 0;
+    return block->offset == block->capacity * block->unit_size &&
+           block->free_list == NULL;
 }
 
 int main(void) {
@@ -51,5 +50,131 @@ int main(void) {
         }
     }
 
+    puts("Passed.\n\nExpecting all the emptied blocks but one to be given "
+         "back to the OS...");
+
+    if (alloc.block_count != 1) {
+        printf("%u blocks left. Test failed, aborting...\n", alloc.block_count);
+        return 1;
+    }
+
+    fixed_alloc_deinit(&alloc);
+
+    puts("Passed.\n\nAllocating units smaller than a pointer, expecting them "
+         "to be rounded up to FIXED_ALLOC_MIN_UNIT_SIZE...");
+
+    struct FixedAllocator small_alloc = fixed_alloc_init(1);
+    char *first = fixed_alloc(&small_alloc);
+    char *second = fixed_alloc(&small_alloc);
+
+    if (small_alloc.unit_size != FIXED_ALLOC_MIN_UNIT_SIZE ||
+        second - first != (ptrdiff_t)FIXED_ALLOC_MIN_UNIT_SIZE) {
+        puts("Units were not rounded up. Test failed, aborting...");
+        return 1;
+    }
+
+    fixed_free(&small_alloc, first);
+
+    if (fixed_alloc(&small_alloc) != first) {
+        puts("Freed unit was not reused. Test failed, aborting...");
+        return 1;
+    }
+
+    fixed_alloc_deinit(&small_alloc);
+
+    puts("Passed.\n\nEmptying the last block while the first one is kept "
+         "warm, expecting it not to be handed out again...");
+
+    struct FixedAllocator last_alloc = fixed_alloc_init(unit_size);
+    size_t first_capacity = last_alloc.blocks[0].capacity;
+
+    for (size_t i = 0; i < first_capacity; ++i) {
+        ptrs[i] = fixed_alloc(&last_alloc);
+    }
+
+    void *in_last_block = fixed_alloc(&last_alloc);
+
+    for (size_t i = 0; i < first_capacity; ++i) {
+        fixed_free(&last_alloc, ptrs[i]);
+    }
+
+    fixed_free(&last_alloc, in_last_block);
+
+    if (last_alloc.block_count != 1 ||
+        (last_alloc.non_full_blocks | last_alloc.empty_blocks) != 1) {
+        puts("The removed block is still marked. Test failed, aborting...");
+        return 1;
+    }
+
+    for (size_t i = 0; i <= first_capacity; ++i) {
+        void *ptr = fixed_alloc(&last_alloc);
+
+        if (!fixed_alloc_owns(&last_alloc, ptr)) {
+            puts("A unit outside the blocks was handed out. Test failed, "
+                 "aborting...");
+            return 1;
+        }
+
+        memset(ptr, 0, unit_size);
+    }
+
+    fixed_alloc_deinit(&last_alloc);
+
+    puts("Passed.\n\nFilling every block, expecting null instead of a block "
+         "past the table...");
+
+    struct FixedAllocator full_alloc = fixed_alloc_init(BIG_UNIT_SIZE);
+    size_t unit_count = 0;
+
+    while (fixed_alloc(&full_alloc)) {
+        ++unit_count;
+    }
+
+    if (full_alloc.block_count != FIXED_ALLOC_BLOCK_CAPACITY ||
+        unit_count * BIG_UNIT_SIZE < FIXED_ALLOC_MAX_BLOCK_SIZE * 32) {
+        printf("%zu units in %u blocks. Test failed, aborting...\n",
+               unit_count, full_alloc.block_count);
+        return 1;
+    }
+
+    fixed_alloc_deinit(&full_alloc);
+
+    puts("Passed.\n\nUnmapping the uncommitted rest of a block, expecting null "
+         "once the committed units run out...");
+
+    struct FixedAllocator commit_alloc = fixed_alloc_init(unit_size);
+    struct FixedAllocBlock *block = &commit_alloc.blocks[0];
+    size_t committed_count = 1;
+
+    ptrs[0] = fixed_alloc(&commit_alloc);
+
+    if (block->committed_size == block->size) {
+        puts("The whole block was committed. Test failed, aborting...");
+        return 1;
+    }
+
+    // Committing pages that aren't mapped fails.
+    munmap((char *)block->mem + block->committed_size,
+           block->size - block->committed_size);
+
+    while (block->offset + unit_size <= block->committed_size) {
+        ptrs[committed_count++] = fixed_alloc(&commit_alloc);
+    }
+
+    errno = 0;
+
+    if (fixed_alloc(&commit_alloc) || errno != ENOMEM ||
+        block->live_count != committed_count) {
+        puts("A unit past the committed pages was handed out. Test failed, "
+             "aborting...");
+        return 1;
+    }
+
+    for (size_t i = 0; i < committed_count; ++i) {
+        fixed_free(&commit_alloc, ptrs[i]);
+    }
+
+    fixed_alloc_deinit(&commit_alloc);
+
     puts("Passed.");
 }
@@ -0,0 +1,63 @@
+#include "falloc.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BIG_SIZE     5000
+#define GROWN_SIZE   100000
+#define SIZE_TO_FILL 130
+// Checked builds leave room for the freed mark in every object.
+#define SMALLEST_SIZE (FALLOC_CHECKS_ENABLED ? SLAB_CHECKED_SIZE_MIN : 8)
+
+int main(void) {
+    puts("Checking the good sizes of small objects...");
+
+    assert(fgood_size(0) == SMALLEST_SIZE);
+    assert(fgood_size(1) == SMALLEST_SIZE);
+    assert(fgood_size(40) == 48);
+    assert(fgood_size(72) == 80);
+    assert(fgood_size(260) == 288);
+    assert(fgood_size(SLAB_CLASS_MAX) == SLAB_CLASS_MAX);
+
+    for (size_t size = 1; size <= SLAB_CLASS_MAX; ++size) {
+        size_t actual = 0;
+        void *ptr = falloc_at_least(size, &actual);
+
+        assert(actual == fgood_size(size));
+        assert(actual >= size);
+        assert(fmemsize(ptr) == actual);
+
+        ffree(ptr);
+    }
+
+    puts("Passed.\n\nChecking the good sizes of big objects...");
+
+    assert(fgood_size(BIG_SIZE) >= BIG_SIZE);
+    assert(fgood_size(BIG_SIZE + 1) >= BIG_SIZE + 1);
+
+    size_t actual = 0;
+    char *big = falloc_at_least(BIG_SIZE + 1, &actual);
+
+    assert(actual >= fgood_size(BIG_SIZE + 1));
+    assert(fmemsize(big) == actual);
+
+    // All of it is usable, and survives growing.
+    memset(big, 'x', actual);
+    big = frealloc(big, GROWN_SIZE);
+    assert(big[actual - 1] == 'x');
+    assert(fmemsize(big) >= GROWN_SIZE);
+
+    ffree(big);
+
+    puts("Passed.\n\nFilling the slack of a small object...");
+
+    char *buff = falloc_at_least(SIZE_TO_FILL, &actual);
+    assert(actual > SIZE_TO_FILL);
+    memset(buff, 'y', actual);
+    assert(frealloc(buff, actual) == buff);
+    ffree(buff);
+
+    puts("Passed.");
+}
@@ -0,0 +1,153 @@
+#include "fallback_alloc/fallback_chunk.h"
+#include "falloc.h"
+#include "integrity.h"
+#include "slab_alloc.h"
+
+#include <pthread.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SMALL_SIZE 64
+#define BIG_SIZE   (SLAB_CLASS_MAX * 4)
+
+#ifdef FALLOC_INTEGRITY_CHECKS
+static size_t report_count = 0;
+static enum FallocCorruption last_corruption;
+static void *last_ptr = NULL;
+
+static void record_corruption(enum FallocCorruption corruption, void *ptr) {
+    ++report_count;
+    last_corruption = corruption;
+    last_ptr = ptr;
+}
+
+static void expect_report(enum FallocCorruption corruption, void *ptr) {
+    assert(report_count == 1);
+    assert(last_corruption == corruption);
+    assert(last_ptr == ptr);
+    (void)corruption;
+    (void)ptr;
+
+    report_count = 0;
+    last_ptr = NULL;
+}
+
+// Frees objects[0], objects[1] and objects[0] again, from a thread that
+// doesn't own them, so they go through a remote batch.
+static void *free_remotely(void *arg) {
+    void **objects = arg;
+
+    ffree(objects[0]);
+    ffree(objects[1]);
+    ffree(objects[0]);
+
+    return NULL;
+}
+
+#endif
+
+int main(void) {
+#ifndef FALLOC_INTEGRITY_CHECKS
+    puts("Built without FALLOC_INTEGRITY_CHECKS, skipping.");
+#else
+    falloc_set_corruption_handler(&record_corruption);
+
+    puts("Checking that interior pointers are caught...");
+
+    uint8_t *small = falloc(SMALL_SIZE);
+    ffree(small + sizeof(void *));
+    expect_report(FALLOC_CORRUPTION_MISALIGNED_FREE, small + sizeof(void *));
+
+    ffree(small);
+    assert(report_count == 0);
+
+    puts("Passed.\n\nChecking that double frees are caught...");
+
+    // Freed twice in a row.
+    void *cached = falloc(SMALL_SIZE);
+    ffree(cached);
+    ffree(cached);
+    expect_report(FALLOC_CORRUPTION_DOUBLE_FREE, cached);
+
+    // Freed again after another object of its class, so it isn't the last
+    // object freed anymore.
+    void *first_freed = falloc(SMALL_SIZE);
+    void *second_freed = falloc(SMALL_SIZE);
+    ffree(first_freed);
+    ffree(second_freed);
+    ffree(first_freed);
+    expect_report(FALLOC_CORRUPTION_DOUBLE_FREE, first_freed);
+    assert(falloc(SMALL_SIZE) != falloc(SMALL_SIZE));
+
+    // Back in its slab, the object's bit is already 0.
+    struct SlabAlloc *heap = &falloc_get_instance()->slab_alloc;
+    void *returned = slab_alloc(heap, SMALL_SIZE);
+
+    enum FaFreeRet first = slab_free(heap, returned);
+    enum FaFreeRet second = slab_free(heap, returned);
+    assert(first == OK && second == CORRUPTION_DETECTED);
+    (void)first;
+    (void)second;
+    expect_report(FALLOC_CORRUPTION_DOUBLE_FREE, returned);
+
+    // Freed again from another thread while the first free still waits in
+    // the remote batch, behind another object.
+    void *remote[2] = {falloc(SMALL_SIZE), falloc(SMALL_SIZE)};
+    pthread_t thread;
+    pthread_create(&thread, NULL, &free_remotely, remote);
+    pthread_join(thread, NULL);
+    expect_report(FALLOC_CORRUPTION_DOUBLE_FREE, remote[0]);
+
+    // The slow path takes both back to their slab, neither was lost.
+    ffree(falloc(BIG_SIZE));
+    first = slab_free(heap, remote[0]);
+    expect_report(FALLOC_CORRUPTION_DOUBLE_FREE, remote[0]);
+    second = slab_free(heap, remote[1]);
+    expect_report(FALLOC_CORRUPTION_DOUBLE_FREE, remote[1]);
+    assert(first == CORRUPTION_DETECTED && second == CORRUPTION_DETECTED);
+
+    // Back in its slab, the object is still marked, so it never reaches a
+    // cache again.
+    ffree(remote[1]);
+    expect_report(FALLOC_CORRUPTION_DOUBLE_FREE, remote[1]);
+
+    // Moved by frealloc(), which freed it into its slab.
+    void *moved = falloc(SMALL_SIZE);
+    void *grown = frealloc(moved, SMALL_SIZE * 4);
+    assert(grown != moved);
+    ffree(moved);
+    expect_report(FALLOC_CORRUPTION_DOUBLE_FREE, moved);
+    ffree(grown);
+
+    puts("Passed.\n\nChecking that foreign pointers are caught...");
+
+    int on_stack = 0;
+    ffree(&on_stack);
+    expect_report(FALLOC_CORRUPTION_FOREIGN_FREE, &on_stack);
+
+    void *big = falloc(BIG_SIZE);
+    ffree(big);
+    ffree(big);
+    expect_report(FALLOC_CORRUPTION_FOREIGN_FREE, big);
+
+    puts("Passed.\n\nChecking that overwritten chunk headers are caught...");
+
+    big = falloc(BIG_SIZE);
+    struct FallbackChunk *chunk = fallback_chunk_from_ptr(big);
+    uintptr_t canary = chunk->canary;
+
+    chunk->canary = 0;
+    ffree(big);
+    expect_report(FALLOC_CORRUPTION_CHUNK_HEADER, big);
+
+    chunk->canary = canary;
+    ffree(big);
+    assert(report_count == 0);
+
+    puts("Passed.");
+
+    falloc_set_corruption_handler(NULL);
+#endif
+}
@@ -57,6 +57,35 @@ void *free_ptr_from_main_thread(void *ptr) {
     return NULL;
 }
 
+#define REMOTE_FREE_COUNT 100
+
+void *free_ptrs_from_main_thread(void *ptrs) {
+    for (int i = 0; i < REMOTE_FREE_COUNT; ++i) {
+        ffree(((void **)ptrs)[i]);
+    }
+
+    return NULL;
+}
+
+#define CACHED_COUNT 10
+
+// Leaves its objects on the thread cache and exits.
+void *free_to_thread_cache(void *arg) {
+    (void)arg;
+
+    void *ptrs[CACHED_COUNT];
+
+    for (int i = 0; i < CACHED_COUNT; ++i) {
+        ptrs[i] = falloc(SLAB_CLASS_MAX);
+    }
+
+    for (int i = 0; i < CACHED_COUNT; ++i) {
+        ffree(ptrs[i]);
+    }
+
+    return slab_from_ptr(ptrs[0]);
+}
+
 int main(void) {
     void *(*func_ptr)(void *) = &alloc_then_free_thread_safe;
 
@@ -93,4 +122,74 @@ int main(void) {
          "correctly.");
 
     ffree(ptr2);
+
+    puts("\nDoing the same with a big allocation. The freed chunk should be "
+         "given back to the main thread's heap on its next big allocation...");
+
+    const size_t big_sz_to_alloc = 0x10000;
+    void *big_ptr = falloc(big_sz_to_alloc);
+    memset(big_ptr, 0, big_sz_to_alloc);
+    pthread_create(&thr1, NULL, &free_ptr_from_main_thread, big_ptr);
+    pthread_join(thr1, NULL);
+    void *big_ptr2 = falloc(big_sz_to_alloc);
+    assert(big_ptr == big_ptr2);
+
+    puts("Big allocation freed from another thread was reused, cross thread "
+         "freeing of big allocations is working correctly.");
+
+    ffree(big_ptr2);
+
+    puts("\nFreeing a lot of small objects from another thread. They are "
+         "handed over in batches, and all of them should be back once the "
+         "thread exits...");
+
+    const enum SlabSizeClass remote_class = SLAB_CLASS_64;
+    void *remote_ptrs[REMOTE_FREE_COUNT];
+
+    for (int i = 0; i < REMOTE_FREE_COUNT; ++i) {
+        remote_ptrs[i] = falloc(SLAB_SIZES[remote_class]);
+    }
+
+    pthread_create(&thr1, NULL, &free_ptrs_from_main_thread, remote_ptrs);
+    pthread_join(thr1, NULL);
+
+    void *after_remote = falloc(SLAB_SIZES[remote_class]);
+    struct Slab *remote_slab = slab_from_ptr(after_remote);
+    assert(remote_slab->total_alloc_count == 1);
+    (void)remote_slab;
+
+    puts("Every batch made it back to the owning heap.");
+
+    ffree(after_remote);
+
+    puts("\nLeaving objects on a thread's cache, expecting them back in their "
+         "slab once the thread exits...");
+
+    struct Slab *cached_slab = NULL;
+
+    pthread_create(&thr1, NULL, &free_to_thread_cache, NULL);
+    pthread_join(thr1, (void **)&cached_slab);
+
+    assert(cached_slab->total_alloc_count == 0);
+    (void)cached_slab;
+
+    puts("The thread cache was flushed.");
+
+    puts("\nFreeing a big allocation from another thread, expecting a small "
+         "allocation to drain it...");
+
+    void *remote_big = falloc(SLAB_CLASS_MAX * 4);
+    pthread_create(&thr1, NULL, &free_ptr_from_main_thread, remote_big);
+    pthread_join(thr1, NULL);
+
+    assert(falloc_get_instance()->remote_big_frees == remote_big);
+
+    // Nothing of this class was freed on this thread, so it takes the slow
+    // path.
+    void *small = falloc(SLAB_CLASS_MAX);
+    assert(falloc_get_instance()->remote_big_frees == NULL);
+
+    ffree(small);
+
+    puts("The big allocation was drained.");
 }
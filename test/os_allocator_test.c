@@ -0,0 +1,61 @@
+#include "os_allocator.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define REGION_SIZE ((size_t)(3 * OS_HUGE_PAGE_SIZE))
+
+static void touch_and_free(void *ptr, size_t size, enum OsPageKind kind) {
+    assert(ptr);
+    assert((uintptr_t)ptr % OS_HUGE_PAGE_SIZE == 0);
+
+    memset(ptr, 0xAB, size);
+
+    int ret = os_free_pages(ptr, size, kind);
+    assert(ret == OS_FREE_OK);
+    (void)ret;
+}
+
+int main(void) {
+    puts("Mapping transparent huge pages...");
+
+    enum OsPageKind kind = OS_PAGES_SMALL;
+    void *thp = os_alloc_pages(REGION_SIZE, OS_PAGES_TRANSPARENT_HUGE, &kind);
+    struct OsHugePageStats stats = os_huge_page_stats();
+
+    printf("Got page kind %d, %zu bytes advised, %zu bytes backed\n", kind,
+           stats.thp_advised_bytes, stats.thp_backed_bytes);
+
+    assert(kind != OS_PAGES_TRANSPARENT_HUGE ||
+           stats.thp_advised_bytes == REGION_SIZE);
+
+    touch_and_free(thp, REGION_SIZE, kind);
+    assert(os_huge_page_stats().thp_advised_bytes == 0);
+
+    puts("Passed.\n\nMapping hugetlb pages, falling back if the pool is "
+         "empty...");
+
+    void *hugetlb = os_alloc_pages(REGION_SIZE, OS_PAGES_HUGETLB, &kind);
+    stats = os_huge_page_stats();
+
+    printf("Got page kind %d, %zu hugetlb bytes, %zu fallbacks\n", kind,
+           stats.hugetlb_bytes, stats.hugetlb_fallback_count);
+
+    assert(kind == OS_PAGES_HUGETLB ? stats.hugetlb_bytes == REGION_SIZE
+                                    : stats.hugetlb_fallback_count == 1);
+
+    touch_and_free(hugetlb, REGION_SIZE, kind);
+    assert(os_huge_page_stats().hugetlb_bytes == 0);
+
+    puts("Passed.\n\nSizes get rounded up to whole huge pages...");
+
+    assert(os_pages_size(1, OS_PAGES_SMALL) == 1);
+    assert(os_pages_size(1, OS_PAGES_TRANSPARENT_HUGE) == OS_HUGE_PAGE_SIZE);
+
+    void *rounded = os_alloc_pages(1, OS_PAGES_TRANSPARENT_HUGE, &kind);
+    touch_and_free(rounded, OS_HUGE_PAGE_SIZE, kind);
+
+    puts("Passed.");
+}
@@ -0,0 +1,76 @@
+#define _GNU_SOURCE
+
+#include "falloc.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define OBJECT_SIZE   64
+#define THREAD_COUNT  8
+#define ROUNDS        200
+#define OBJECTS_COUNT 100
+
+// Each thread tags its objects, so an object handed out twice shows up as a
+// mismatch.
+void *alloc_and_check_thread(void *arg) {
+    uintptr_t tag = (uintptr_t)arg;
+    void *ptrs[OBJECTS_COUNT];
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (int i = 0; i < OBJECTS_COUNT; ++i) {
+            ptrs[i] = falloc(OBJECT_SIZE);
+            memset(ptrs[i], (int)tag, OBJECT_SIZE);
+        }
+
+        for (int i = 0; i < OBJECTS_COUNT; ++i) {
+            assert(*(uint8_t *)ptrs[i] == (uint8_t)tag);
+            ffree(ptrs[i]);
+        }
+    }
+
+    return NULL;
+}
+
+int main(void) {
+    if (!falloc_enable_percpu_cache()) {
+        puts("Restartable sequences aren't available, nothing to test.");
+        return 0;
+    }
+
+    puts("Pinning to one CPU, a freed object should come right back...");
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(sched_getcpu(), &cpus);
+
+    int err_code = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    assert(err_code == 0);
+    (void)err_code;
+
+    void *ptr = falloc(OBJECT_SIZE);
+    ffree(ptr);
+    assert(falloc(OBJECT_SIZE) == ptr);
+    ffree(ptr);
+
+    puts("Passed.\n\nSharing the caches between threads...");
+
+    pthread_t threads[THREAD_COUNT];
+
+    for (uintptr_t i = 0; i < THREAD_COUNT; ++i) {
+        err_code = pthread_create(&threads[i], NULL, &alloc_and_check_thread,
+                                  (void *)(i + 1));
+        assert(err_code == 0);
+    }
+
+    for (int i = 0; i < THREAD_COUNT; ++i) {
+        err_code = pthread_join(threads[i], NULL);
+        assert(err_code == 0);
+    }
+
+    puts("Passed.");
+}
@@ -2,28 +2,50 @@
 
 #include <stdio.h>
 
-static inline void print_node(struct RtreeNode *node, int depth) {
-    if (depth >= (int)sizeof(void *)) {
-        return;
+static inline void print_indent(int depth) {
+    for (int i = 0; i < depth; ++i) {
+        printf("  ");
     }
+}
 
-    for (int i = 0; i <= UINT8_MAX; ++i) {
-        if (node->entries[i].next == NULL) {
+static inline void print_last_level(struct RtreeNode *node, int depth) {
+    for (size_t i = 0; i < RTREE_NODE_ENTRIES; ++i) {
+        RtreeLeaf leaf = node->entries[i].leaf;
+
+        if (leaf == 0) {
             continue;
         }
 
-        for (int j = 0; j < depth; ++j) {
-            printf("  ");
+        print_indent(depth);
+        printf("%03zx: size %zu\n", i, leaf >> RTREE_GRANULE_BITS);
+    }
+}
+
+static inline void print_interior(struct RtreeNode *node, int depth) {
+    for (size_t i = 0; i < RTREE_NODE_ENTRIES; ++i) {
+        if (node->entries[i].next == NULL) {
+            continue;
         }
 
-        printf("%02x\n", i);
+        print_indent(depth);
+        printf("%03zx\n", i);
 
-        print_node(node->entries[i].next, depth + 1);
+        print_last_level(node->entries[i].next, depth + 1);
     }
 }
 
 static inline void print_tree(struct Rtree *rtree) {
     puts("\nPrinting the tree...\n");
-    print_node(rtree->head, 0);
+
+    for (size_t i = 0; i < RTREE_ROOT_ENTRIES; ++i) {
+        if (rtree->root[i] == NULL) {
+            continue;
+        }
+
+        printf("%04zx\n", i);
+
+        print_interior(rtree->root[i], 1);
+    }
+
     puts("\nDone printing the tree.\n");
 }
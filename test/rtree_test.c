@@ -5,7 +5,10 @@
 #include <inttypes.h>
 #include <stdio.h>
 
-typedef int ArrayType;
+// Keys pushed at the same time need to be at least a granule apart.
+typedef struct {
+    char buff[RTREE_GRANULE_SIZE];
+} ArrayType;
 
 int main(void) {
     const int ptr_count = 30;
@@ -4,6 +4,7 @@
 
 #include <assert.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -57,5 +58,27 @@ int main(void) {
 
     slab_alloc_print_layout(&alloc);
 
+    puts("\nChecking that neighbouring slabs are colored differently...");
+
+    void *first = slab_alloc(&alloc, SLAB_CLASS_MAX);
+    void *next = first;
+
+    while (slab_from_ptr(next) == slab_from_ptr(first)) {
+        next = slab_alloc(&alloc, SLAB_CLASS_MAX);
+    }
+
+    void *first_span = align_down_to_slab_size(first);
+    void *next_span = align_down_to_slab_size(next);
+    assert(slab_color(first_span) != slab_color(next_span));
+    assert((uint8_t *)first - (uint8_t *)first_span !=
+           (uint8_t *)next - (uint8_t *)next_span);
+    assert((uintptr_t)slab_from_ptr(first) % SLAB_COLOR_STEP == 0);
+    assert((uintptr_t)slab_from_ptr(first) % FA_PAGE_SIZE !=
+           (uintptr_t)slab_from_ptr(next) % FA_PAGE_SIZE);
+    (void)first_span;
+    (void)next_span;
+
+    puts("Passed.");
+
     slab_alloc_deinit(&alloc);
 }
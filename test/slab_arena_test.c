@@ -0,0 +1,116 @@
+#include "falloc.h"
+#include "slab_arena.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+#define SMALL_SIZE 64
+#define BIG_SIZE   (SLAB_CLASS_MAX * 4)
+#define SPAN_COUNT 8
+// More than the 256 released ranges the arena used to remember.
+#define RANGE_COUNT 300
+
+int main(void) {
+    puts("Checking that slab pointers and only slab pointers are in the "
+         "arena...");
+
+    int on_stack = 0;
+    assert(!slab_arena_contains(&on_stack));
+    (void)on_stack;
+
+    void *small = falloc(SMALL_SIZE);
+    void *big = falloc(BIG_SIZE);
+
+    assert(slab_arena_contains(small));
+    assert(!slab_arena_contains(big));
+    assert(!slab_arena_contains(NULL));
+
+    ffree(small);
+    ffree(big);
+
+    puts("Passed.\n\nChecking that released ranges get reused...");
+
+    struct SlabArena *arena = slab_arena_get();
+    enum OsPageKind kind = OS_PAGES_SMALL;
+
+    void *range = slab_arena_reserve(arena, SLAB_ARENA_ALIGN, kind, &kind);
+    assert(range && slab_arena_contains(range));
+
+    slab_arena_release(arena, range, SLAB_ARENA_ALIGN, kind);
+
+    void *reused = slab_arena_reserve(arena, SLAB_ARENA_ALIGN, kind, &kind);
+    assert(reused == range);
+
+    puts("Passed.\n\nChecking that the free span pool hands spans back...");
+
+    size_t pooled_count = slab_arena_free_span_count(arena);
+
+    for (size_t i = 0; i < SPAN_COUNT; ++i) {
+        void *span = (char *)reused + (i * SLAB_ARENA_SPAN_SIZE);
+        slab_arena_push_free_span(arena, span);
+    }
+
+    assert(slab_arena_free_span_count(arena) == pooled_count + SPAN_COUNT);
+
+    for (size_t i = SPAN_COUNT; i > 0; --i) {
+        void *span = slab_arena_pop_free_span(arena);
+        assert(span == (char *)reused + ((i - 1) * SLAB_ARENA_SPAN_SIZE));
+        (void)span;
+    }
+
+    assert(slab_arena_free_span_count(arena) == pooled_count);
+    (void)pooled_count;
+
+    slab_arena_release(arena, reused, SLAB_ARENA_ALIGN, kind);
+
+    puts("Passed.\n\nChecking that neighbouring released ranges merge...");
+
+    uint8_t *first = slab_arena_reserve(arena, SLAB_ARENA_ALIGN, kind, &kind);
+    uint8_t *middle = slab_arena_reserve(arena, SLAB_ARENA_ALIGN, kind, &kind);
+    uint8_t *last = slab_arena_reserve(arena, SLAB_ARENA_ALIGN, kind, &kind);
+    // Keeps the three off the bump pointer.
+    void *guard = slab_arena_reserve(arena, SLAB_ARENA_ALIGN, kind, &kind);
+    assert(middle == first + SLAB_ARENA_ALIGN);
+    assert(last == middle + SLAB_ARENA_ALIGN);
+
+    slab_arena_release(arena, first, SLAB_ARENA_ALIGN, kind);
+    slab_arena_release(arena, last, SLAB_ARENA_ALIGN, kind);
+    slab_arena_release(arena, middle, SLAB_ARENA_ALIGN, kind);
+
+    void *merged =
+        slab_arena_reserve(arena, SLAB_ARENA_ALIGN * 3, kind, &kind);
+    assert(merged == first);
+    (void)merged;
+
+    slab_arena_release(arena, first, SLAB_ARENA_ALIGN * 3, kind);
+    slab_arena_release(arena, guard, SLAB_ARENA_ALIGN, kind);
+
+    puts("Passed.\n\nReleasing many scattered ranges, expecting all of them "
+         "to be reused...");
+
+    static uint8_t *ranges[RANGE_COUNT * 2];
+
+    for (size_t i = 0; i < RANGE_COUNT * 2; ++i) {
+        ranges[i] = slab_arena_reserve(arena, SLAB_ARENA_ALIGN, kind, &kind);
+    }
+
+    uint8_t *bump = arena->bump;
+
+    for (size_t i = 0; i < RANGE_COUNT * 2; i += 2) {
+        slab_arena_release(arena, ranges[i], SLAB_ARENA_ALIGN, kind);
+    }
+
+    for (size_t i = 0; i < RANGE_COUNT * 2; i += 2) {
+        ranges[i] = slab_arena_reserve(arena, SLAB_ARENA_ALIGN, kind, &kind);
+        assert(ranges[i] < bump);
+    }
+
+    assert(arena->bump == bump);
+    (void)bump;
+
+    for (size_t i = 0; i < RANGE_COUNT * 2; ++i) {
+        slab_arena_release(arena, ranges[i], SLAB_ARENA_ALIGN, kind);
+    }
+
+    puts("Passed.");
+}
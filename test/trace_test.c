@@ -0,0 +1,146 @@
+#include "falloc.h"
+#include "slab_alloc.h"
+#include "trace.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SMALL_SIZE    64
+#define GROWN_SIZE    200
+#define THREAD_SIZE   32
+#define BIG_SIZE      (SLAB_CLASS_MAX * 4)
+#define MAX_RECORDS   16
+#define PATH_TEMPLATE "/tmp/falloc_trace_test_XXXXXX"
+
+#ifdef FALLOC_TRACE
+static void *alloc_on_other_thread(void *arg) {
+    (void)arg;
+
+    return falloc(THREAD_SIZE);
+}
+
+// Reads back every record of the trace at path and returns how many there
+// are.
+static size_t read_trace(const char *path, struct FallocTraceRecord *records) {
+    FILE *file = fopen(path, "rb");
+    assert(file);
+
+    struct FallocTraceHeader header;
+    size_t read = fread(&header, sizeof(header), 1, file);
+    assert(read == 1);
+    assert(memcmp(header.magic, FALLOC_TRACE_MAGIC, sizeof(header.magic)) ==
+           0);
+    assert(header.version == FALLOC_TRACE_VERSION);
+    assert(header.record_size == sizeof(struct FallocTraceRecord));
+    (void)read;
+
+    size_t count = fread(records, sizeof(*records), MAX_RECORDS, file);
+    (void)fclose(file);
+
+    return count;
+}
+
+static void expect_record(const struct FallocTraceRecord *record,
+                          enum FallocTraceOp op, size_t size, uint32_t id,
+                          uint32_t old_id, uint32_t thread) {
+    assert(record->op == op);
+    assert(record->size == size);
+    assert(record->id == id);
+    assert(record->old_id == old_id);
+    assert(record->thread == thread);
+    (void)record;
+    (void)op;
+    (void)size;
+    (void)id;
+    (void)old_id;
+    (void)thread;
+}
+#endif
+
+int main(void) {
+#ifndef FALLOC_TRACE
+    assert(!falloc_trace_start("/dev/null"));
+    puts("Built without FALLOC_TRACE, skipping.");
+#else
+    char path[] = PATH_TEMPLATE;
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    (void)close(fd);
+
+    // Allocated before the trace, so its free shows up with id 0.
+    void *untraced = falloc(SMALL_SIZE);
+
+    puts("Checking that every call is recorded...");
+
+    bool started = falloc_trace_start(path);
+    assert(started);
+    assert(!falloc_trace_start(path));
+    (void)started;
+
+    void *small = falloc(SMALL_SIZE);
+    void *big = falloc(BIG_SIZE);
+    small = frealloc(small, GROWN_SIZE);
+    ffree(big);
+    ffree(NULL);
+
+    pthread_t thread;
+    void *remote = NULL;
+    int ret = pthread_create(&thread, NULL, &alloc_on_other_thread, NULL);
+    assert(ret == 0);
+    (void)ret;
+    pthread_join(thread, &remote);
+
+    ffree(remote);
+    ffree(small);
+    ffree(untraced);
+
+    falloc_trace_stop();
+
+    // Nothing gets in after the trace stopped.
+    ffree(falloc(SMALL_SIZE));
+
+    struct FallocTraceRecord records[MAX_RECORDS];
+    size_t count = read_trace(path, records);
+    assert(count == 8);
+    (void)count;
+
+    // The other thread's buffer is written out when it exits, before the main
+    // thread's.
+    expect_record(&records[0], FALLOC_TRACE_ALLOC, THREAD_SIZE, 4, 0, 1);
+    expect_record(&records[1], FALLOC_TRACE_ALLOC, SMALL_SIZE, 1, 0, 0);
+    expect_record(&records[2], FALLOC_TRACE_ALLOC, BIG_SIZE, 2, 0, 0);
+    expect_record(&records[3], FALLOC_TRACE_REALLOC, GROWN_SIZE, 3, 1, 0);
+    expect_record(&records[4], FALLOC_TRACE_FREE, 0, 2, 0, 0);
+    expect_record(&records[5], FALLOC_TRACE_FREE, 0, 4, 0, 0);
+    expect_record(&records[6], FALLOC_TRACE_FREE, 0, 3, 0, 0);
+    expect_record(&records[7], FALLOC_TRACE_FREE, 0, 0, 0, 0);
+
+    for (size_t i = 1; i < 8; ++i) {
+        assert(i == 1 || records[i].timestamp >= records[i - 1].timestamp);
+    }
+
+    puts("Passed.\n\nChecking that a new trace starts over...");
+
+    started = falloc_trace_start(path);
+    assert(started);
+
+    ffree(falloc(SMALL_SIZE));
+
+    falloc_trace_stop();
+
+    count = read_trace(path, records);
+    assert(count == 2);
+    expect_record(&records[0], FALLOC_TRACE_ALLOC, SMALL_SIZE, 1, 0, 0);
+    expect_record(&records[1], FALLOC_TRACE_FREE, 0, 1, 0, 0);
+
+    puts("Passed.");
+
+    (void)unlink(path);
+#endif
+}